@@ -5,29 +5,66 @@
 #include "bits.h"
 #include "config.h"
 #include "fdt.h"
+#include "hsm.h"
+#include "boot_profile.h"
 #include <string.h>
 
 static const void* entry_point;
 long disabled_hart_mask;
 
+#ifdef PK_ENABLE_PAYLOAD_LZ4
+// The image holds the compressed frame, which unpacking overwrites; its
+// unpacked size is read from the frame header once, before that.
+static uintptr_t payload_size;
+#endif
+
+static uintptr_t payload_end()
+{
+  extern char _payload_start, _payload_end;
+#ifdef PK_ENABLE_PAYLOAD_LZ4
+  return (uintptr_t) &_payload_start + payload_size;
+#else
+  return (uintptr_t) &_payload_end;
+#endif
+}
+
 static uintptr_t dtb_output()
 {
-  extern char _payload_end;
-  uintptr_t end = (uintptr_t) &_payload_end;
+  uintptr_t end = payload_end();
   return (end + MEGAPAGE_SIZE - 1) / MEGAPAGE_SIZE * MEGAPAGE_SIZE;
 }
 
-static void filter_dtb(uintptr_t source)
+static void decompress_payload(uintptr_t dtb)
 {
-  uintptr_t dest = dtb_output();
-  uint32_t size = fdt_size(source);
-  memcpy((void*)dest, (void*)source, size);
+#ifdef PK_ENABLE_PAYLOAD_LZ4
+  extern char _payload_start, _payload_end;
+  size_t len = &_payload_end - &_payload_start;
+  uintptr_t size = payload_lz4_size(&_payload_start, len);
+
+  payload_size = size;
 
-  // Remove information from the chained FDT
-  filter_harts(dest, &disabled_hart_mask);
-  filter_plic(dest);
-  filter_compat(dest, "riscv,clint0");
-  filter_compat(dest, "riscv,debug-013");
+  // Move the frame out of the way of its own output, to where the DTB goes
+  // next; filter_dtb overwrites it once the payload is unpacked. The block
+  // index goes right after it, a word per block of at least 64 KiB. An
+  // incompressible payload's frame is longer than its output and may reach
+  // past that point, so then the copy goes right after the frame instead.
+  uintptr_t frame = dtb_output();
+  if (frame < (uintptr_t) &_payload_start + len)
+    frame = ((uintptr_t) &_payload_start + len + 7) & -8;
+  uintptr_t frame_end = frame + len + 8 + (size >> 14);
+  if (dtb < frame_end && dtb + fdt_size(dtb) > (uintptr_t) &_payload_start)
+    die("payload: the device tree is where the payload unpacks");
+  memcpy((void*) frame, &_payload_start, len);
+  payload_lz4_decompress(&_payload_start, size, (void*) frame, len);
+#endif
+}
+
+static void filter_dtb(uintptr_t source)
+{
+  // Copy the FDT for the next stage, removing information from it on the way
+  static const char *const compat[] = { "riscv,clint0", "riscv,debug-013", NULL };
+  filter_copy(source, dtb_output(), &disabled_hart_mask, compat,
+              boot_profile_chosen());
 }
 
 void boot_other_hart(uintptr_t unused __attribute__((unused)))
@@ -35,8 +72,13 @@ void boot_other_hart(uintptr_t unused __attribute__((unused)))
   const void* entry;
   do {
     entry = entry_point;
+    payload_lz4_help();
     mb();
   } while (!entry);
+#ifdef PK_ENABLE_PAYLOAD_LZ4
+  // the payload was written as data, possibly by other harts
+  __asm__ volatile ("fence.i");
+#endif
 
   long hartid = read_csr(mhartid);
   if ((1 << hartid) & disabled_hart_mask) {
@@ -48,13 +90,23 @@ void boot_other_hart(uintptr_t unused __attribute__((unused)))
     }
   }
 
+#ifdef PK_ENABLE_SBI_HSM
+  // wait in M-mode for the OS to start this hart through SBI HSM
+  supervisor_mode_init();
+  hsm_park_hart();
+#endif
+
   enter_supervisor_mode(entry, hartid, dtb_output());
 }
 
 void boot_loader(uintptr_t dtb)
 {
   extern char _payload_start;
+  boot_profile_mark(BOOT_PROFILE_BOOT_LOADER);
+  decompress_payload(dtb);
+  boot_profile_mark(BOOT_PROFILE_PAYLOAD);
   filter_dtb(dtb);
+  boot_profile_mark(BOOT_PROFILE_FILTER_DTB);
 #ifdef PK_ENABLE_LOGO
   print_logo();
 #endif
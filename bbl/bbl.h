@@ -7,9 +7,19 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "config.h"
 
 void print_logo();
 
+#ifdef PK_ENABLE_PAYLOAD_LZ4
+uintptr_t payload_lz4_size(const void* frame, size_t len);
+void payload_lz4_decompress(void* dst, uintptr_t size, const void* frame,
+                            size_t len);
+void payload_lz4_help();
+#else
+static inline void payload_lz4_help() {}
+#endif
+
 #endif // !__ASSEMBLER__
 
 #endif
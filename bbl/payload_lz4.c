@@ -0,0 +1,240 @@
+// See LICENSE for license details.
+
+// LZ4-compressed payload (--enable-payload-lz4). The build runs the payload
+// through `lz4 --content-size`, whose frame cuts the input into blocks that
+// decompress to a fixed size, all but the last. With independent blocks
+// (the lz4 default) each block's output position is known up front, so the
+// harts waiting in boot_other_hart take blocks off a shared counter and
+// decode them alongside the boot hart. A frame with linked blocks (-BD)
+// still works but is decoded by the boot hart alone, in order.
+
+#include "bbl.h"
+#include "mtrap.h"
+#include "atomic.h"
+#include "config.h"
+#include <string.h>
+
+#ifdef PK_ENABLE_PAYLOAD_LZ4
+
+#define LZ4_MAGIC        0x184D2204
+#define LZ4_FLG_VERSION  0x40
+#define LZ4_FLG_INDEP    0x20
+#define LZ4_FLG_BCHECK   0x10
+#define LZ4_FLG_CSIZE    0x08
+#define LZ4_FLG_DICTID   0x01
+#define LZ4_BLOCK_STORED 0x80000000U
+#define LZ4_MIN_MATCH    4
+
+static struct {
+  char* dst;
+  const uint8_t* frame;
+  const uint32_t* blocks; // offset of each block's size word in the frame
+  uintptr_t nblocks;
+  uintptr_t size;
+  int shift;              // log2 of the block size
+  int ready;              // blocks[] is filled in; helpers may start
+  uintptr_t next;         // next block to hand out
+  uintptr_t done;         // blocks decoded so far
+  long harts;             // harts that decoded at least one block
+} lz4;
+
+static uint32_t get_le32(const uint8_t* p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uintptr_t lz4_frame_header(const uint8_t* frame, size_t len,
+                                  uintptr_t* size, int* shift, int* flg)
+{
+  uint8_t bd;
+
+  if (len < 15 || get_le32(frame) != LZ4_MAGIC)
+    die("payload: not an lz4 frame");
+  *flg = frame[4];
+  bd = frame[5];
+  if ((*flg & 0xc0) != LZ4_FLG_VERSION || (bd >> 4 & 7) < 4)
+    die("payload: unsupported lz4 frame (flags %x, bd %x)", *flg, bd);
+  if (!(*flg & LZ4_FLG_CSIZE))
+    die("payload: lz4 frame has no content size; use lz4 --content-size");
+  if (*flg & LZ4_FLG_DICTID)
+    die("payload: lz4 dictionaries are not supported");
+  if (get_le32(frame + 10))
+    die("payload: too large to decompress");
+
+  *size = get_le32(frame + 6);
+  *shift = 2 * (bd >> 4 & 7) + 8; // 4 is 64 KiB ... 7 is 4 MiB
+  return 15; // magic, FLG, BD, content size, HC
+}
+
+uintptr_t payload_lz4_size(const void* frame, size_t len)
+{
+  uintptr_t size;
+  int shift, flg;
+
+  lz4_frame_header(frame, len, &size, &shift, &flg);
+  return size;
+}
+
+static uintptr_t lz4_length(const uint8_t** in, const uint8_t* end)
+{
+  uintptr_t len = 0, b;
+
+  do {
+    if (*in == end)
+      return -1;
+    b = *(*in)++;
+    len += b;
+  } while (b == 255);
+  return len;
+}
+
+// Decodes one raw LZ4 block into [out, out_end); matches may reach back as
+// far as floor. Returns the decoded length or -1 if the block is corrupt.
+static uintptr_t lz4_decode_block(char* out, char* out_end, const char* floor,
+                                  const uint8_t* in, const uint8_t* in_end)
+{
+  char* op = out;
+
+  while (in < in_end) {
+    uintptr_t token = *in++, len = token >> 4, off, ext;
+
+    if (len == 15) {
+      if ((ext = lz4_length(&in, in_end)) == -1)
+        return -1;
+      len += ext;
+    }
+    if (len > in_end - in || len > out_end - op)
+      return -1;
+    memcpy(op, in, len);
+    op += len;
+    in += len;
+    if (in == in_end)
+      return op - out; // the last sequence is literals only
+
+    if (in_end - in < 2)
+      return -1;
+    off = in[0] | in[1] << 8;
+    in += 2;
+    if (off == 0 || off > op - floor)
+      return -1;
+
+    len = token & 15;
+    if (len == 15) {
+      if ((ext = lz4_length(&in, in_end)) == -1)
+        return -1;
+      len += ext;
+    }
+    len += LZ4_MIN_MATCH;
+    if (len > out_end - op)
+      return -1;
+
+    if (off >= len) {
+      memcpy(op, op - off, len);
+      op += len;
+    } else {
+      // overlapping: the match repeats the last off bytes
+      const char* from = op - off;
+      while (len--)
+        *op++ = *from++;
+    }
+  }
+  return -1; // ran out of input inside a sequence
+}
+
+static void lz4_decode(uintptr_t i)
+{
+  const uint8_t* p = lz4.frame + lz4.blocks[i];
+  uint32_t word = get_le32(p);
+  uintptr_t csize = word & ~LZ4_BLOCK_STORED, start = i << lz4.shift;
+  uintptr_t want = lz4.size - start, got;
+  char* out = lz4.dst + start;
+
+  if (want > (1UL << lz4.shift))
+    want = 1UL << lz4.shift;
+
+  if (word & LZ4_BLOCK_STORED) {
+    got = csize;
+    if (got == want)
+      memcpy(out, p + 4, got);
+  } else {
+    got = lz4_decode_block(out, out + want, lz4.ready ? out : lz4.dst,
+                           p + 4, p + 4 + csize);
+  }
+  if (got != want)
+    die("payload: lz4 block %ld is corrupt", (long)i);
+}
+
+void payload_lz4_help()
+{
+  uintptr_t i;
+
+  if (!atomic_read(&lz4.ready))
+    return;
+  mb();
+  if (atomic_read(&lz4.next) >= lz4.nblocks)
+    return;
+
+  while ((i = atomic_add(&lz4.next, 1)) < lz4.nblocks) {
+    lz4_decode(i);
+    atomic_or(&lz4.harts, 1L << read_const_csr(mhartid));
+    mb();
+    atomic_add(&lz4.done, 1);
+  }
+}
+
+// frame (len bytes, 4-byte aligned) must not overlap [dst, dst + size), and
+// there must be room after it for a word per block.
+void payload_lz4_decompress(void* dst, uintptr_t size, const void* frame,
+                            size_t len)
+{
+  const uint8_t *f = frame, *p, *end = f + len;
+  uint32_t* blocks = (uint32_t*)(f + ((len + 3) & ~3));
+  uintptr_t n = 0, csize, cycles = rdcycle(), i;
+  long harts;
+  int flg;
+
+  p = f + lz4_frame_header(f, len, &lz4.size, &lz4.shift, &flg);
+  if (lz4.size != size)
+    die("payload: lz4 content size changed");
+
+  // index the blocks; the size word is 0 at the end mark
+  while (1) {
+    if (end - p < 4)
+      die("payload: truncated lz4 frame");
+    if (!(csize = get_le32(p) & ~LZ4_BLOCK_STORED))
+      break;
+    if ((n << lz4.shift) >= size || csize > end - p - 4)
+      die("payload: lz4 frame does not match its content size");
+    blocks[n++] = p - f;
+    p += 4 + csize + ((flg & LZ4_FLG_BCHECK) ? 4 : 0);
+  }
+  if ((n << lz4.shift) < size)
+    die("payload: lz4 frame does not match its content size");
+
+  lz4.dst = dst;
+  lz4.frame = f;
+  lz4.blocks = blocks;
+  lz4.nblocks = n;
+  mb();
+
+  if (flg & LZ4_FLG_INDEP) {
+    atomic_set(&lz4.ready, 1);
+    payload_lz4_help();
+    while (atomic_read(&lz4.done) < n)
+      ;
+  } else {
+    for (i = 0; i < n; i++)
+      lz4_decode(i);
+    lz4.harts = 1L << read_const_csr(mhartid);
+  }
+  mb();
+  __asm__ volatile ("fence.i");
+
+  cycles = rdcycle() - cycles;
+  for (i = 0, harts = lz4.harts; harts; harts &= harts - 1)
+    i++;
+  printm("bbl: payload %ld bytes, %ld compressed, %ld blocks on %ld harts in %ld cycles\r\n",
+         (long)size, (long)len, (long)n, (long)i, (long)cycles);
+}
+
+#endif
@@ -0,0 +1,293 @@
+// See LICENSE for license details.
+
+// SBI microbenchmarks, run by the dummy payload in S-mode when bbl is
+// configured with --enable-payload-bench. Each case times an ecall (or
+// other trapping sequence) with rdcycle and prints the minimum and the
+// average over BENCH_ITERS runs.
+//
+// The payload is linked at one address and run at another with
+// translation off, so everything here must stay PC-relative: no
+// pointer tables, no .bss, no libgcc (division included).
+
+#include "config.h"
+#include "mcall.h"
+#include "hsm.h"
+#include "pmu.h"
+#include "encoding.h"
+#include <stdint.h>
+
+#ifdef PK_ENABLE_PAYLOAD_BENCH
+
+#define BENCH_ITERS_SHIFT 10
+#define BENCH_ITERS       (1UL << BENCH_ITERS_SHIFT)
+
+/* an EID nobody implements, to time the dispatcher itself */
+#define BENCH_NO_SUCH_CALL 0x7ffff
+
+struct sbiret {
+  uintptr_t error;
+  uintptr_t value;
+};
+
+static inline struct sbiret sbi_ecall(uintptr_t eid, uintptr_t fid,
+                                      uintptr_t arg0, uintptr_t arg1,
+                                      uintptr_t arg2, uintptr_t arg3)
+{
+  register uintptr_t a0 asm ("a0") = arg0;
+  register uintptr_t a1 asm ("a1") = arg1;
+  register uintptr_t a2 asm ("a2") = arg2;
+  register uintptr_t a3 asm ("a3") = arg3;
+  register uintptr_t a6 asm ("a6") = fid;
+  register uintptr_t a7 asm ("a7") = eid;
+  asm volatile ("ecall"
+                : "+r" (a0), "+r" (a1)
+                : "r" (a2), "r" (a3), "r" (a6), "r" (a7)
+                : "memory");
+  return (struct sbiret) { a0, a1 };
+}
+
+static void bench_putchar(char c)
+{
+  sbi_ecall(SBI_CONSOLE_PUTCHAR, 0, c, 0, 0, 0);
+}
+
+static void bench_puts(const char* s)
+{
+  while (*s)
+    bench_putchar(*s++);
+}
+
+static void bench_putdec(uint64_t n)
+{
+  uint64_t pow[20];
+  int i, started = 0;
+
+  /* digits by repeated subtraction; RV64I has no divide */
+  pow[0] = 1;
+  for (i = 1; i < 20; i++)
+    pow[i] = pow[i - 1] * 10;
+
+  for (i = 19; i >= 0; i--) {
+    char d = '0';
+    while (n >= pow[i]) {
+      n -= pow[i];
+      d++;
+    }
+    if (d != '0' || started || i == 0) {
+      bench_putchar(d);
+      started = 1;
+    }
+  }
+}
+
+static void bench_report(const char* name, uint64_t min, uint64_t total)
+{
+  bench_puts("bench: ");
+  bench_puts(name);
+  bench_puts(": min ");
+  bench_putdec(min);
+  bench_puts(" avg ");
+  bench_putdec(total >> BENCH_ITERS_SHIFT);
+  bench_puts(" cycles\n");
+}
+
+static void bench_ecall_args(const char* name, uintptr_t eid, uintptr_t fid,
+                             uintptr_t a0, uintptr_t a1, uintptr_t a2,
+                             uintptr_t a3)
+{
+  uint64_t min = -1ULL, total = 0;
+  unsigned long i;
+
+  for (i = 0; i < BENCH_ITERS; i++) {
+    uint64_t t0 = rdcycle();
+    sbi_ecall(eid, fid, a0, a1, a2, a3);
+    uint64_t t = rdcycle() - t0;
+    total += t;
+    if (t < min)
+      min = t;
+  }
+  bench_report(name, min, total);
+}
+
+static void bench_ecall(const char* name, uintptr_t eid, uintptr_t fid)
+{
+  bench_ecall_args(name, eid, fid, 0, 0, 0, 0);
+}
+
+/* async remote sfence.vma, then poll until every target has handled it */
+static void bench_fence_async(const char* name, uintptr_t hartid)
+{
+  uint64_t min = -1ULL, total = 0;
+  unsigned long i;
+
+  for (i = 0; i < BENCH_ITERS; i++) {
+    uint64_t t0 = rdcycle();
+    sbi_ecall(SBI_EXT_BBL, SBI_EXT_BBL_SFENCE_VMA_ASYNC, 1, hartid,
+              0x10000000, 0x1000);
+    while (sbi_ecall(SBI_EXT_BBL, SBI_EXT_BBL_FENCE_POLL, 0, 0, 0, 0).value)
+      ;
+    uint64_t t = rdcycle() - t0;
+    total += t;
+    if (t < min)
+      min = t;
+  }
+  bench_report(name, min, total);
+}
+
+/* Retentive suspend with a wake-up already pending: the round trip
+ * through the HSM suspend/resume path without the sleep itself. */
+static void bench_hsm_suspend(const char* name, uintptr_t hartid)
+{
+  uint64_t min = -1ULL, total = 0;
+  uintptr_t mask = 1UL << hartid;
+  unsigned long i;
+
+  if (!sbi_ecall(SBI_EXT_BASE, SBI_EXT_BASE_PROBE_EXT, SBI_EXT_HSM,
+                 0, 0, 0).value)
+    return;
+
+  set_csr(sie, SIP_SSIP);
+  for (i = 0; i < BENCH_ITERS; i++) {
+    sbi_ecall(SBI_SEND_IPI, 0, (uintptr_t)&mask, 0, 0, 0);
+    uint64_t t0 = rdcycle();
+    sbi_ecall(SBI_EXT_HSM, SBI_EXT_HSM_HART_SUSPEND,
+              HSM_SUSPEND_RETENTIVE, 0, 0, 0);
+    uint64_t t = rdcycle() - t0;
+    clear_csr(sip, SIP_SSIP);
+    total += t;
+    if (t < min)
+      min = t;
+  }
+  clear_csr(sie, SIP_SSIP);
+  bench_report(name, min, total);
+}
+
+/* misaligned ld/sd within one page; traps to bbl on harts that don't
+ * handle them in hardware */
+static void bench_misaligned(const char* name, int store)
+{
+  uint64_t min = -1ULL, total = 0, buf[2];
+  volatile uint64_t* p = (volatile uint64_t*)((char*)buf + 3);
+  unsigned long i;
+
+  buf[0] = buf[1] = 0;
+
+  for (i = 0; i < BENCH_ITERS; i++) {
+    uint64_t t0 = rdcycle();
+    if (store)
+      *p = i;
+    else
+      (void)*p;
+    uint64_t t = rdcycle() - t0;
+    total += t;
+    if (t < min)
+      min = t;
+  }
+  bench_report(name, min, total);
+}
+
+/* rdtime; traps to bbl on harts without a time CSR */
+static void bench_rdtime(const char* name)
+{
+  uint64_t min = -1ULL, total = 0;
+  unsigned long i;
+
+  for (i = 0; i < BENCH_ITERS; i++) {
+    uint64_t t0 = rdcycle();
+    (void)rdtime();
+    uint64_t t = rdcycle() - t0;
+    total += t;
+    if (t < min)
+      min = t;
+  }
+  bench_report(name, min, total);
+}
+
+/* Chains of dependent multiplies, written with .insn so this builds for
+ * harts without M, where each one traps to bbl. The firmware illegal
+ * instruction counter from the SBI PMU gives the number of traps, which
+ * is below the number of multiplies when bbl runs ahead. */
+#define BENCH_MUL_CHAIN_SHIFT 3
+
+static void bench_mul(const char* name)
+{
+  uint64_t min = -1ULL, total = 0, traps = 0;
+  uintptr_t x = 0x7f4a7c15, ctr = -1;
+  unsigned long i;
+  struct sbiret ret;
+
+  if (sbi_ecall(SBI_EXT_BASE, SBI_EXT_BASE_PROBE_EXT, SBI_EXT_PMU,
+                0, 0, 0).value) {
+    ret = sbi_ecall(SBI_EXT_PMU, SBI_EXT_PMU_COUNTER_CFG_MATCH, 0, -1,
+                    SBI_PMU_CFG_FLAG_CLEAR_VALUE | SBI_PMU_CFG_FLAG_AUTO_START,
+                    SBI_PMU_TYPE_FW << 16 | SBI_PMU_FW_ILLEGAL_INSN);
+    if (!ret.error)
+      ctr = ret.value;
+  }
+
+  for (i = 0; i < BENCH_ITERS; i++) {
+    uint64_t t0 = rdcycle();
+    asm volatile (".rept 1 << %1\n"
+                  ".insn r 0x33, 0, 1, %0, %0, %0\n"
+                  ".endr"
+                  : "+r" (x) : "i" (BENCH_MUL_CHAIN_SHIFT));
+    uint64_t t = rdcycle() - t0;
+    total += t;
+    if (t < min)
+      min = t;
+  }
+
+  if (ctr != (uintptr_t)-1) {
+    traps = sbi_ecall(SBI_EXT_PMU, SBI_EXT_PMU_COUNTER_FW_READ,
+                      ctr, 0, 0, 0).value;
+    sbi_ecall(SBI_EXT_PMU, SBI_EXT_PMU_COUNTER_STOP, ctr, 1,
+              SBI_PMU_STOP_FLAG_RESET, 0);
+  }
+
+  /* per multiply */
+  bench_report(name, min >> BENCH_MUL_CHAIN_SHIFT,
+               total >> BENCH_MUL_CHAIN_SHIFT);
+  bench_puts("bench: ");
+  bench_puts(name);
+  bench_puts(": ");
+  bench_putdec(BENCH_ITERS << BENCH_MUL_CHAIN_SHIFT);
+  bench_puts(" multiplies, ");
+  if (ctr == (uintptr_t)-1)
+    bench_puts("? (no PMU)");
+  else
+    bench_putdec(traps);
+  bench_puts(" traps\n");
+}
+
+void bench_main(uintptr_t hartid, uintptr_t dtb)
+{
+  bench_puts("bbl payload benchmarks (");
+  bench_putdec(BENCH_ITERS);
+  bench_puts(" iterations)\n");
+
+  /* ecall-to-return latency of the SBI dispatcher */
+  bench_ecall("ecall unknown id", BENCH_NO_SUCH_CALL, 0);
+  bench_ecall("ecall legacy clear_ipi", SBI_CLEAR_IPI, 0);
+  bench_ecall("ecall sm random (id 108)", 108, 0);
+
+  /* remote sfence.vma to this hart: one page vs. the whole TLB */
+  bench_ecall_args("rfence sfence.vma 1 page", SBI_EXT_RFENCE,
+                   SBI_EXT_RFENCE_REMOTE_SFENCE_VMA, 1, hartid,
+                   0x10000000, 0x1000);
+  bench_ecall_args("rfence sfence.vma all", SBI_EXT_RFENCE,
+                   SBI_EXT_RFENCE_REMOTE_SFENCE_VMA, 1, hartid, 0, 0);
+  bench_fence_async("bbl async sfence.vma 1 page + poll", hartid);
+
+  bench_ecall_args("hsm hart_get_status", SBI_EXT_HSM,
+                   SBI_EXT_HSM_HART_GET_STATUS, hartid, 0, 0, 0);
+  bench_hsm_suspend("hsm suspend + resume", hartid);
+
+  bench_misaligned("misaligned load", 0);
+  bench_misaligned("misaligned store", 1);
+
+  bench_mul("mul");
+
+  bench_rdtime("rdtime");
+}
+
+#endif
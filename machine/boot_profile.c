@@ -0,0 +1,109 @@
+// See LICENSE for license details.
+
+#include "boot_profile.h"
+#include "mtrap.h"
+#include "fdt.h"
+#include "atomic.h"
+
+#ifdef PK_ENABLE_BOOT_PROFILE
+
+static struct boot_profile {
+  uint64_t cycle[BOOT_PROFILE_PHASES];
+  uint64_t time[BOOT_PROFILE_PHASES];
+} boot_profile[MAX_HARTS];
+
+static const char* const boot_profile_names[BOOT_PROFILE_PHASES] = {
+  [BOOT_PROFILE_ENTRY]       = "entry",
+  [BOOT_PROFILE_HART_INIT]   = "hart_init",
+  [BOOT_PROFILE_DT_SCAN]     = "dt scan",
+  [BOOT_PROFILE_SM_GLOBAL]   = "sm_init_global",
+  [BOOT_PROFILE_WAKE_HARTS]  = "wake_harts",
+  [BOOT_PROFILE_PLIC_INIT]   = "plic_init",
+  [BOOT_PROFILE_BOOT_LOADER] = "boot_loader",
+  [BOOT_PROFILE_PAYLOAD]     = "payload",
+  [BOOT_PROFILE_FILTER_DTB]  = "filter_dtb",
+  [BOOT_PROFILE_SM_INIT]     = "sm_init",
+  [BOOT_PROFILE_SUPERVISOR]  = "supervisor",
+};
+
+// filled in by filter_copy
+static struct fdt_chosen_prop boot_profile_dt;
+
+void boot_profile_mark(int phase)
+{
+  struct boot_profile* p = &boot_profile[read_const_csr(mhartid)];
+  p->cycle[phase] = rdcycle();
+  p->time[phase] = mtime ? *mtime : 0;
+}
+
+struct fdt_chosen_prop* boot_profile_chosen()
+{
+  int harts = 0;
+
+  for (int hart = 0; hart < MAX_HARTS; hart++)
+    harts += (hart_mask >> hart) & 1;
+
+  boot_profile_dt.name = "bbl,boot-profile";
+  boot_profile_dt.len = harts * BOOT_PROFILE_ROW_CELLS * sizeof(uint32_t);
+  boot_profile_dt.value = NULL;
+  return &boot_profile_dt;
+}
+
+static uint32_t boot_profile_be(uint32_t x)
+{
+  return x << 24 | (x & 0xff00) << 8 | (x >> 8 & 0xff00) | x >> 24;
+}
+
+static void boot_profile_write_dt(uintptr_t hart, const struct boot_profile* p)
+{
+  uint32_t* row = boot_profile_dt.value;
+  int i;
+
+  if (!row || !((hart_mask >> hart) & 1))
+    return;
+
+  for (i = 0; i < hart; i++)
+    row += ((hart_mask >> i) & 1) * BOOT_PROFILE_ROW_CELLS;
+
+  row[0] = boot_profile_be(hart);
+  for (i = 0; i < BOOT_PROFILE_PHASES; i++) {
+    row[1 + 4*i] = boot_profile_be(p->cycle[i] >> 32);
+    row[2 + 4*i] = boot_profile_be(p->cycle[i]);
+    row[3 + 4*i] = boot_profile_be(p->time[i] >> 32);
+    row[4 + 4*i] = boot_profile_be(p->time[i]);
+  }
+}
+
+// Only a hart's first entry counts; SBI HSM can stop and start it again
+void boot_profile_enter_supervisor()
+{
+  uintptr_t hart = read_const_csr(mhartid);
+  struct boot_profile* p = &boot_profile[hart];
+  uint64_t cycle = 0, time = 0;
+  int i;
+
+  if (p->cycle[BOOT_PROFILE_SUPERVISOR])
+    return;
+  boot_profile_mark(BOOT_PROFILE_SUPERVISOR);
+
+  // The boot hart, the one that ran boot_loader, writes every hart's
+  // row as it hands the DTB over; after that it's the payload's.
+  if (p->cycle[BOOT_PROFILE_BOOT_LOADER]) {
+    mb();
+    for (i = 0; i < MAX_HARTS; i++)
+      boot_profile_write_dt(i, &boot_profile[i]);
+  }
+
+  for (i = 0; i < BOOT_PROFILE_PHASES; i++) {
+    if (!p->cycle[i])
+      continue;
+    printm("boot profile: hart %ld %s: cycle %ld (+%ld), mtime %ld (+%ld)\r\n",
+           (long)hart, boot_profile_names[i], (long)p->cycle[i],
+           (long)(p->cycle[i] - cycle), (long)p->time[i],
+           (long)(time ? p->time[i] - time : 0));
+    cycle = p->cycle[i];
+    time = p->time[i];
+  }
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _RISCV_BOOT_PROFILE_H
+#define _RISCV_BOOT_PROFILE_H
+
+#include <stdint.h>
+#include "config.h"
+#include "fdt.h"
+
+// Boot phase checkpoints (--enable-boot-profile). Each hart notes the
+// cycle counter and mtime as it finishes each phase below; mtime reads 0
+// until the device tree scan has found the CLINT. Just before a hart
+// first enters S-mode it prints its checkpoints; see below for the
+// /chosen/bbl,boot-profile property of the DTB handed to the payload.
+//
+// bbl,boot-profile has a row for each hart in hart_mask, in hartid order:
+// the hartid, then <cycle-hi cycle-lo mtime-hi mtime-lo> for each phase,
+// zero for the phases a hart skips. The boot hart fills in every row just
+// before it enters S-mode, since the DTB is the payload's after that: a
+// row holds the checkpoints its hart had reached by then, and phases the
+// hart gets to later (with SBI HSM, at least "supervisor") stay zero and
+// are only printed.
+
+#define BOOT_PROFILE_ENTRY       0 // init_first_hart or init_other_hart
+#define BOOT_PROFILE_HART_INIT   1
+#define BOOT_PROFILE_DT_SCAN     2 // boot hart only
+#define BOOT_PROFILE_SM_GLOBAL   3 // boot hart only: sm_init_global
+#define BOOT_PROFILE_WAKE_HARTS  4 // boot hart only
+#define BOOT_PROFILE_PLIC_INIT   5
+#define BOOT_PROFILE_BOOT_LOADER 6 // boot hart only
+#define BOOT_PROFILE_PAYLOAD     7 // boot hart only: --enable-payload-lz4 unpacking
+#define BOOT_PROFILE_FILTER_DTB  8 // boot hart only
+#define BOOT_PROFILE_SM_INIT     9 // PMP and this hart's security monitor setup
+#define BOOT_PROFILE_SUPERVISOR  10 // about to mret into S-mode
+#define BOOT_PROFILE_PHASES      11
+
+#define BOOT_PROFILE_ROW_CELLS   (1 + 4 * BOOT_PROFILE_PHASES)
+
+#ifdef PK_ENABLE_BOOT_PROFILE
+void boot_profile_mark(int phase);
+void boot_profile_enter_supervisor();
+struct fdt_chosen_prop* boot_profile_chosen();
+#else
+static inline void boot_profile_mark(int phase) {}
+static inline void boot_profile_enter_supervisor() {}
+static inline struct fdt_chosen_prop* boot_profile_chosen() { return 0; }
+#endif
+
+#endif
@@ -3,8 +3,33 @@
 #include "config.h"
 #include "unprivileged_memory.h"
 #include "mtrap.h"
+#include "pmu.h"
+#include "trap_profile.h"
 #include <limits.h>
 
+static struct decoded_insn decode_cache[MAX_HARTS][DECODE_CACHE_SIZE];
+
+// On a miss the entry is retagged for the caller to fill in; a caller
+// that can't decode the instruction must clear its mepc.
+struct decoded_insn* decode_cache_lookup(uintptr_t cause, uintptr_t mepc,
+                                         insn_t insn, int* hit)
+{
+  uintptr_t satp = supports_extension('S') ? read_csr(sptbr) : 0;
+  uintptr_t h = mepc_satp_hash(mepc, satp) % DECODE_CACHE_SIZE;
+  struct decoded_insn* d = &decode_cache[read_const_csr(mhartid)][h];
+
+  *hit = d->mepc == mepc && d->satp == satp && d->cause == cause &&
+         d->insn == insn;
+  trap_profile_decode(*hit);
+  if (!*hit) {
+    d->mepc = mepc;
+    d->satp = satp;
+    d->cause = cause;
+    d->insn = insn;
+  }
+  return d;
+}
+
 static DECLARE_EMULATION_FUNC(emulate_rvc)
 {
 #ifdef __riscv_compressed
@@ -66,6 +91,214 @@ static DECLARE_EMULATION_FUNC(emulate_rvc)
   return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
 }
 
+#ifdef PK_ENABLE_EMULATION_RUN_AHEAD
+// Run-ahead: once an instruction has been emulated, the ones after it are
+// often more of the same (FP loads and stores on a core without an FPU,
+// multiplies and divides on one without M) mixed with plain integer
+// arithmetic. Rather than returning and taking a
+// trap for each, keep executing here while the next instruction is one we
+// can do: something that would trap anyway, or simple integer ALU work.
+// Anything else (branches, integer memory accesses, CSRs, ...) ends the
+// run, as does the budget, which bounds the extra interrupt latency.
+//
+// Instructions are only fetched from the page the trapping one came from,
+// which is known to be readable; a fetch must never fault here, as that
+// would be reported as a load fault.
+#define RUN_AHEAD_BUDGET 32
+
+static struct {
+  uint64_t traps;
+  uint64_t insns;
+} __attribute__((aligned(64))) run_ahead_stats[MAX_HARTS];
+
+static int emulate_alu(uintptr_t* regs, uintptr_t pc, insn_t insn)
+{
+  uintptr_t rs1 = GET_RS1(insn, regs), rs2 = GET_RS2(insn, regs), val;
+  uintptr_t funct7 = insn >> 25, funct3 = (insn >> 12) & 7;
+  // shift immediates: funct6 on RV64, funct7 on RV32
+  uintptr_t shtype = insn >> (__riscv_xlen == 64 ? 26 : 25);
+  uintptr_t shsra = __riscv_xlen == 64 ? 0x10 : 0x20;
+
+  switch (insn & 0x7f) {
+    case 0x37: // lui
+      val = (int32_t)(insn & 0xfffff000);
+      break;
+    case 0x17: // auipc
+      val = pc + (intptr_t)(int32_t)(insn & 0xfffff000);
+      break;
+    case 0x13: // op-imm
+      rs2 = IMM_I(insn);
+      switch (funct3) {
+        case 0: val = rs1 + rs2; break;
+        case 1: if (shtype) return -1;
+                val = rs1 << (rs2 & (__riscv_xlen - 1)); break;
+        case 2: val = (intptr_t)rs1 < (intptr_t)rs2; break;
+        case 3: val = rs1 < rs2; break;
+        case 4: val = rs1 ^ rs2; break;
+        case 5: if (shtype == 0)
+                  val = rs1 >> (rs2 & (__riscv_xlen - 1));
+                else if (shtype == shsra)
+                  val = (intptr_t)rs1 >> (rs2 & (__riscv_xlen - 1));
+                else
+                  return -1;
+                break;
+        case 6: val = rs1 | rs2; break;
+        default: val = rs1 & rs2; break;
+      }
+      break;
+    case 0x33: // op
+      if (funct7 == 0x20 && funct3 == 0)
+        val = rs1 - rs2;
+      else if (funct7 == 0x20 && funct3 == 5)
+        val = (intptr_t)rs1 >> (rs2 & (__riscv_xlen - 1));
+      else if (funct7 != 0)
+        return -1;
+      else switch (funct3) {
+        case 0: val = rs1 + rs2; break;
+        case 1: val = rs1 << (rs2 & (__riscv_xlen - 1)); break;
+        case 2: val = (intptr_t)rs1 < (intptr_t)rs2; break;
+        case 3: val = rs1 < rs2; break;
+        case 4: val = rs1 ^ rs2; break;
+        case 5: val = rs1 >> (rs2 & (__riscv_xlen - 1)); break;
+        case 6: val = rs1 | rs2; break;
+        default: val = rs1 & rs2; break;
+      }
+      break;
+#if __riscv_xlen == 64
+    case 0x1b: // op-imm-32
+      rs2 = IMM_I(insn);
+      if (funct3 == 0)
+        val = (int32_t)(rs1 + rs2);
+      else if (funct3 == 1 && funct7 == 0)
+        val = (int32_t)((uint32_t)rs1 << (rs2 & 31));
+      else if (funct3 == 5 && funct7 == 0)
+        val = (int32_t)((uint32_t)rs1 >> (rs2 & 31));
+      else if (funct3 == 5 && funct7 == 0x20)
+        val = (int32_t)rs1 >> (rs2 & 31);
+      else
+        return -1;
+      break;
+    case 0x3b: // op-32
+      if (funct3 == 0 && funct7 == 0)
+        val = (int32_t)(rs1 + rs2);
+      else if (funct3 == 0 && funct7 == 0x20)
+        val = (int32_t)(rs1 - rs2);
+      else if (funct3 == 1 && funct7 == 0)
+        val = (int32_t)((uint32_t)rs1 << (rs2 & 31));
+      else if (funct3 == 5 && funct7 == 0)
+        val = (int32_t)((uint32_t)rs1 >> (rs2 & 31));
+      else if (funct3 == 5 && funct7 == 0x20)
+        val = (int32_t)rs1 >> (rs2 & 31);
+      else
+        return -1;
+      break;
+#endif
+    default:
+      return -1;
+  }
+
+  SET_RD(insn, regs, val);
+  return 0;
+}
+
+#ifdef __riscv_compressed
+static int emulate_rvc_alu(uintptr_t* regs, insn_t insn)
+{
+  uintptr_t rd = (insn >> SH_RD) & 0x1f, rs2 = (insn >> SH_RS2C) & 0x1f;
+  intptr_t imm = (int32_t)(((insn >> 12) & 1) << 31 | rs2 << 26) >> 26;
+
+  if ((insn & MASK_C_ADDI) == MATCH_C_ADDI)
+    regs[rd] += imm;
+  else if ((insn & MASK_C_LI) == MATCH_C_LI)
+    regs[rd] = imm;
+  else if ((insn & MASK_C_MV) == MATCH_C_MV && rs2)
+    regs[rd] = regs[rs2];
+  else if ((insn & MASK_C_ADD) == MATCH_C_ADD && rs2)
+    regs[rd] += regs[rs2];
+#if __riscv_xlen == 64
+  else if ((insn & MASK_C_ADDIW) == MATCH_C_ADDIW && rd)
+    regs[rd] = (int32_t)(regs[rd] + imm);
+#endif
+  else
+    return -1;
+  return 0;
+}
+#endif
+
+// The emulation function for an instruction that would trap again, or
+// NULL if it wouldn't (or isn't worth following)
+static emulation_func run_ahead_trapping(insn_t insn)
+{
+  switch (insn & 0x7f) {
+#if !defined(__riscv_flen) && defined(PK_ENABLE_FP_EMULATION)
+    case 0x07: return emulate_float_load;
+    case 0x27: return emulate_float_store;
+#endif
+#if !defined(__riscv_muldiv)
+    case 0x33: return (insn >> 25) == 1 ? emulate_mul_div : NULL;
+#endif
+#if !defined(__riscv_muldiv) && __riscv_xlen >= 64
+    case 0x3b: return (insn >> 25) == 1 ? emulate_mul_div32 : NULL;
+#endif
+  }
+  return NULL;
+}
+
+static void emulate_run_ahead(uintptr_t* regs, uintptr_t mcause,
+                              uintptr_t trap_pc)
+{
+  uintptr_t pc = read_csr(mepc), mstatus, n = 1;
+  emulation_func f;
+
+  while (n < RUN_AHEAD_BUDGET &&
+         ((pc ^ trap_pc) | ((pc + 3) ^ trap_pc)) < RISCV_PGSIZE) {
+    insn_t insn = get_insn(pc, &mstatus);
+
+    if ((insn & 3) != 3) {
+#ifdef __riscv_compressed
+      if (emulate_rvc_alu(regs, insn))
+        break;
+      pc += 2;
+#else
+      break;
+#endif
+    } else if (!emulate_alu(regs, pc, insn)) {
+      pc += 4;
+    } else if ((f = run_ahead_trapping(insn))) {
+      // as illegal_insn_trap() does; f() may move mepc on, or never return
+      write_csr(mepc, pc + 4);
+      f(regs, mcause, pc, mstatus, insn);
+      pc = read_csr(mepc);
+    } else {
+      break;
+    }
+
+    regs[0] = 0; // x0 may have been a destination
+    n++;
+  }
+
+  write_csr(mepc, pc);
+  run_ahead_stats[read_const_csr(mhartid)].traps++;
+  run_ahead_stats[read_const_csr(mhartid)].insns += n;
+}
+
+void emulation_dump_stats()
+{
+  uint64_t traps = 0, insns = 0;
+
+  for (int i = 0; i < MAX_HARTS; i++) {
+    traps += run_ahead_stats[i].traps;
+    insns += run_ahead_stats[i].insns;
+  }
+  if (traps)
+    printm("emulation: %ld instructions in %ld traps, %ld.%d per trap\r\n",
+           (long)insns, (long)traps, (long)(insns / traps),
+           (int)(insns * 10 / traps % 10));
+}
+#else
+void emulation_dump_stats() {}
+#endif
+
 void illegal_insn_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 {
   asm (".pushsection .rodata\n"
@@ -124,11 +357,19 @@ void illegal_insn_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
   uintptr_t mstatus = read_csr(mstatus);
   insn_t insn = read_csr(mbadaddr);
 
+  pmu_fw_count(SBI_PMU_FW_ILLEGAL_INSN);
+
   if (unlikely((insn & 3) != 3)) {
     if (insn == 0)
       insn = get_insn(mepc, &mstatus);
-    if ((insn & 3) != 3)
-      return emulate_rvc(regs, mcause, mepc, mstatus, insn);
+    if ((insn & 3) != 3) {
+      emulate_rvc(regs, mcause, mepc, mstatus, insn);
+      trap_hotspot_record(mcause, mepc);
+#ifdef PK_ENABLE_EMULATION_RUN_AHEAD
+      emulate_run_ahead(regs, mcause, mepc);
+#endif
+      return;
+    }
   }
 
   write_csr(mepc, mepc + 4);
@@ -137,6 +378,11 @@ void illegal_insn_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
   uint32_t* pf = (void*)illegal_insn_trap_table + (insn & 0x7c);
   emulation_func f = (emulation_func)(uintptr_t)*pf;
   f(regs, mcause, mepc, mstatus, insn);
+  // truly illegal instructions went to S-mode and don't get here
+  trap_hotspot_record(mcause, mepc);
+#ifdef PK_ENABLE_EMULATION_RUN_AHEAD
+  emulate_run_ahead(regs, mcause, mepc);
+#endif
 }
 
 __attribute__((noinline))
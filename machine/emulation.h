@@ -15,6 +15,34 @@ void redirect_trap(uintptr_t epc, uintptr_t mstatus, uintptr_t badaddr);
 DECLARE_EMULATION_FUNC(truly_illegal_insn);
 DECLARE_EMULATION_FUNC(emulate_rvc_0);
 DECLARE_EMULATION_FUNC(emulate_rvc_2);
+DECLARE_EMULATION_FUNC(emulate_float_load);
+DECLARE_EMULATION_FUNC(emulate_float_store);
+DECLARE_EMULATION_FUNC(emulate_mul_div);
+DECLARE_EMULATION_FUNC(emulate_mul_div32);
+void emulation_dump_stats();
+
+// Per-hart cache of decoded misaligned accesses, direct mapped on
+// (satp, mepc) and tagged with the trap that decoded them, so hot
+// misaligned loads and stores skip decoding. An entry is only used while
+// the instruction bits still match: S-mode rewrites code and switches
+// address spaces with fence.i, sfence.vma and satp writes that don't trap
+// here, so the fetch itself can't be skipped. illegal_insn_trap doesn't
+// use it; its decode is a single table load, cheaper than a lookup.
+struct decoded_insn {
+  uintptr_t mepc;   // 0: empty
+  uintptr_t satp;
+  uintptr_t cause;  // CAUSE_* of the handler that filled it in
+  insn_t insn;      // as fetched
+  insn_t reg;       // rd << SH_RD or rs2 << SH_RS2
+  uint8_t len;
+  uint8_t shift;    // sign extension of integer loads
+  uint8_t fp;
+};
+
+#define DECODE_CACHE_SIZE 32
+
+struct decoded_insn* decode_cache_lookup(uintptr_t cause, uintptr_t mepc,
+                                         insn_t insn, int* hit);
 
 #define SH_RD 7
 #define SH_RS1 15
@@ -25,11 +25,62 @@ static inline int isstring(char c)
   return 0;
 }
 
+static const char *const fdt_key_names[FDT_KEYS] = {
+  [FDT_KEY_ADDRESS_CELLS] = "#address-cells",
+  [FDT_KEY_SIZE_CELLS]    = "#size-cells",
+  [FDT_KEY_COMPATIBLE]    = "compatible",
+  [FDT_KEY_REG]           = "reg",
+};
+
+struct fdt_scan_state {
+  const char *strings;
+  const struct fdt_cb *cbs;
+  int ncbs;
+  uint32_t key_off[FDT_KEYS]; // where each key name first occurs in strings
+  uint32_t key_dup;           // key names that occur more than once
+};
+
+// dtc and libfdt store each property name once, at the first place in the
+// strings block it occurs (possibly as the tail of a longer name), so one
+// offset identifies it. Anything else falls back to strcmp.
+static void fdt_find_keys(struct fdt_scan_state *s, uint32_t size)
+{
+  s->key_dup = 0;
+  for (int k = 1; k < FDT_KEYS; ++k) {
+    const char *name = fdt_key_names[k];
+    uint32_t len = strlen(name);
+    s->key_off[k] = -1;
+    for (uint32_t off = 0; off + len < size; ++off) {
+      if (s->strings[off] != name[0] || strcmp(s->strings + off, name))
+        continue;
+      if (s->key_off[k] != (uint32_t)-1) {
+        s->key_dup |= 1 << k;
+        break;
+      }
+      s->key_off[k] = off;
+    }
+  }
+}
+
+static int fdt_key(const struct fdt_scan_state *s, uint32_t off)
+{
+  for (int k = 1; k < FDT_KEYS; ++k)
+    if (off == s->key_off[k] ||
+        (((s->key_dup >> k) & 1) && !strcmp(s->strings + off, fdt_key_names[k])))
+      return k;
+  return FDT_KEY_OTHER;
+}
+
+static void fdt_scan_done(const struct fdt_scan_state *s, const struct fdt_scan_node *node)
+{
+  for (int i = 0; i < s->ncbs; ++i)
+    if (s->cbs[i].done) s->cbs[i].done(node, s->cbs[i].extra);
+}
+
 static uint32_t *fdt_scan_helper(
   uint32_t *lex,
-  const char *strings,
-  struct fdt_scan_node *node,
-  const struct fdt_cb *cb)
+  const struct fdt_scan_state *s,
+  struct fdt_scan_node *node)
 {
   struct fdt_scan_node child;
   struct fdt_scan_prop prop;
@@ -49,53 +100,75 @@ static uint32_t *fdt_scan_helper(
       }
       case FDT_PROP: {
         assert (!last);
-        prop.name  = strings + bswap(lex[2]);
+        prop.name  = s->strings + bswap(lex[2]);
         prop.len   = bswap(lex[1]);
         prop.value = lex + 3;
-        if (node && !strcmp(prop.name, "#address-cells")) { node->address_cells = bswap(lex[3]); }
-        if (node && !strcmp(prop.name, "#size-cells"))    { node->size_cells    = bswap(lex[3]); }
+        prop.key   = fdt_key(s, bswap(lex[2]));
+        if (node && prop.key == FDT_KEY_ADDRESS_CELLS) { node->address_cells = bswap(lex[3]); }
+        if (node && prop.key == FDT_KEY_SIZE_CELLS)    { node->size_cells    = bswap(lex[3]); }
         lex += 3 + (prop.len+3)/4;
-        cb->prop(&prop, cb->extra);
+        for (int i = 0; i < s->ncbs; ++i)
+          if (s->cbs[i].prop) s->cbs[i].prop(&prop, s->cbs[i].extra);
         break;
       }
       case FDT_BEGIN_NODE: {
         uint32_t *lex_next;
-        if (!last && node && cb->done) cb->done(node, cb->extra);
+        int kill = 0;
+        if (!last && node) fdt_scan_done(s, node);
         last = 1;
         child.name = (const char *)(lex+1);
-        if (cb->open) cb->open(&child, cb->extra);
+        for (int i = 0; i < s->ncbs; ++i)
+          if (s->cbs[i].open) s->cbs[i].open(&child, s->cbs[i].extra);
         lex_next = fdt_scan_helper(
           lex + 2 + strlen(child.name)/4,
-          strings, &child, cb);
-        if (cb->close && cb->close(&child, cb->extra) == -1)
+          s, &child);
+        for (int i = 0; i < s->ncbs; ++i)
+          if (s->cbs[i].close && s->cbs[i].close(&child, s->cbs[i].extra) == -1)
+            kill = 1;
+        if (kill)
           while (lex != lex_next) *lex++ = bswap(FDT_NOP);
         lex = lex_next;
         break;
       }
       case FDT_END_NODE: {
-        if (!last && node && cb->done) cb->done(node, cb->extra);
+        if (!last && node) fdt_scan_done(s, node);
         return lex + 1;
       }
       default: { // FDT_END
-        if (!last && node && cb->done) cb->done(node, cb->extra);
+        if (!last && node) fdt_scan_done(s, node);
         return lex;
       }
     }
   }
 }
 
-void fdt_scan(uintptr_t fdt, const struct fdt_cb *cb)
+void fdt_scan_all(uintptr_t fdt, const struct fdt_cb *cbs, int ncbs)
 {
   struct fdt_header *header = (struct fdt_header *)fdt;
+  struct fdt_scan_state s;
 
   // Only process FDT that we understand
   if (bswap(header->magic) != FDT_MAGIC ||
       bswap(header->last_comp_version) > FDT_VERSION) return;
 
-  const char *strings = (const char *)(fdt + bswap(header->off_dt_strings));
+  s.strings = (const char *)(fdt + bswap(header->off_dt_strings));
+  s.cbs = cbs;
+  s.ncbs = ncbs;
+  fdt_find_keys(&s, bswap(header->size_dt_strings));
+
+  for (int i = 0; i < ncbs; ++i)
+    if (cbs[i].begin) cbs[i].begin(cbs[i].extra);
+
   uint32_t *lex = (uint32_t *)(fdt + bswap(header->off_dt_struct));
+  fdt_scan_helper(lex, &s, 0);
+
+  for (int i = 0; i < ncbs; ++i)
+    if (cbs[i].end) cbs[i].end(cbs[i].extra);
+}
 
-  fdt_scan_helper(lex, strings, 0, cb);
+void fdt_scan(uintptr_t fdt, const struct fdt_cb *cb)
+{
+  fdt_scan_all(fdt, cb, 1);
 }
 
 uint32_t fdt_size(uintptr_t fdt)
@@ -124,6 +197,18 @@ const uint32_t *fdt_get_size(const struct fdt_scan_node *node, const uint32_t *v
   return value;
 }
 
+uint32_t fdt_get_u32(const struct fdt_scan_prop *prop)
+{
+  return fdt_get_cell(prop, 0);
+}
+
+uint32_t fdt_get_cell(const struct fdt_scan_prop *prop, int i)
+{
+  if (i < 0 || prop->len < (int)sizeof(uint32_t) * (i + 1))
+    return 0;
+  return bswap(prop->value[i]);
+}
+
 int fdt_string_list_index(const struct fdt_scan_prop *prop, const char *str)
 {
   const char *list = (const char *)prop->value;
@@ -156,7 +241,7 @@ static void mem_prop(const struct fdt_scan_prop *prop, void *extra)
   struct mem_scan *scan = (struct mem_scan *)extra;
   if (!strcmp(prop->name, "device_type") && !strcmp((const char*)prop->value, "memory")) {
     scan->memory = 1;
-  } else if (!strcmp(prop->name, "reg")) {
+  } else if (prop->key == FDT_KEY_REG) {
     scan->reg_value = prop->value;
     scan->reg_len = prop->len;
   }
@@ -181,20 +266,24 @@ static void mem_done(const struct fdt_scan_node *node, void *extra)
   assert (end == value);
 }
 
-void query_mem(uintptr_t fdt)
+static void mem_end(void *extra)
 {
-  struct fdt_cb cb;
-  struct mem_scan scan;
+  assert (mem_size > 0);
+}
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = mem_open;
-  cb.prop = mem_prop;
-  cb.done = mem_done;
-  cb.extra = &scan;
+static struct mem_scan mem_scan;
 
-  mem_size = 0;
-  fdt_scan(fdt, &cb);
-  assert (mem_size > 0);
+const struct fdt_cb query_mem_cb = {
+  .open = mem_open,
+  .prop = mem_prop,
+  .done = mem_done,
+  .end = mem_end,
+  .extra = &mem_scan,
+};
+
+void query_mem(uintptr_t fdt)
+{
+  fdt_scan(fdt, &query_mem_cb);
 }
 
 ///////////////////////////////////////////// HART SCAN //////////////////////////////////////////
@@ -210,6 +299,12 @@ struct hart_scan {
   uint32_t phandle;
 };
 
+static void hart_begin(void *extra)
+{
+  struct hart_scan *scan = (struct hart_scan *)extra;
+  memset(scan, 0, sizeof(*scan));
+}
+
 static void hart_open(const struct fdt_scan_node *node, void *extra)
 {
   struct hart_scan *scan = (struct hart_scan *)extra;
@@ -235,7 +330,7 @@ static void hart_prop(const struct fdt_scan_prop *prop, void *extra)
     scan->cells = bswap(prop->value[0]);
   } else if (!strcmp(prop->name, "phandle")) {
     scan->phandle = bswap(prop->value[0]);
-  } else if (!strcmp(prop->name, "reg")) {
+  } else if (prop->key == FDT_KEY_REG) {
     uint64_t reg;
     fdt_get_address(prop->node->parent, prop->value, &reg);
     scan->hart = reg;
@@ -270,27 +365,36 @@ static int hart_close(const struct fdt_scan_node *node, void *extra)
   return 0;
 }
 
-void query_harts(uintptr_t fdt)
+static void hart_end(void *extra)
 {
-  struct fdt_cb cb;
-  struct hart_scan scan;
+  // The current hart should have been detected
+  assert ((hart_mask >> read_csr(mhartid)) != 0);
+}
 
-  memset(&cb, 0, sizeof(cb));
-  memset(&scan, 0, sizeof(scan));
-  cb.open = hart_open;
-  cb.prop = hart_prop;
-  cb.done = hart_done;
-  cb.close= hart_close;
-  cb.extra = &scan;
+static struct hart_scan hart_scan;
 
-  fdt_scan(fdt, &cb);
+const struct fdt_cb query_harts_cb = {
+  .begin = hart_begin,
+  .open = hart_open,
+  .prop = hart_prop,
+  .done = hart_done,
+  .close = hart_close,
+  .end = hart_end,
+  .extra = &hart_scan,
+};
 
-  // The current hart should have been detected
-  assert ((hart_mask >> read_csr(mhartid)) != 0);
+void query_harts(uintptr_t fdt)
+{
+  fdt_scan(fdt, &query_harts_cb);
 }
 
 ///////////////////////////////////////////// CLINT SCAN /////////////////////////////////////////
 
+// The hart phandles may not all be known when the CLINT and PLIC nodes are
+// done, since the boot scan walks the tree once with every consumer, so
+// they only note where their interrupts-extended lists are and resolve
+// them at the end.
+
 struct clint_scan
 {
   int compat;
@@ -298,8 +402,17 @@ struct clint_scan
   const uint32_t *int_value;
   int int_len;
   int done;
+  uint64_t base;
+  const uint32_t *ints;
+  int ints_len;
 };
 
+static void clint_begin(void *extra)
+{
+  struct clint_scan *scan = (struct clint_scan *)extra;
+  memset(scan, 0, sizeof(*scan));
+}
+
 static void clint_open(const struct fdt_scan_node *node, void *extra)
 {
   struct clint_scan *scan = (struct clint_scan *)extra;
@@ -311,9 +424,9 @@ static void clint_open(const struct fdt_scan_node *node, void *extra)
 static void clint_prop(const struct fdt_scan_prop *prop, void *extra)
 {
   struct clint_scan *scan = (struct clint_scan *)extra;
-  if (!strcmp(prop->name, "compatible") && fdt_string_list_index(prop, "riscv,clint0") >= 0) {
+  if (prop->key == FDT_KEY_COMPATIBLE && fdt_string_list_index(prop, "riscv,clint0") >= 0) {
     scan->compat = 1;
-  } else if (!strcmp(prop->name, "reg")) {
+  } else if (prop->key == FDT_KEY_REG) {
     fdt_get_address(prop->node->parent, prop->value, &scan->reg);
   } else if (!strcmp(prop->name, "interrupts-extended")) {
     scan->int_value = prop->value;
@@ -324,8 +437,6 @@ static void clint_prop(const struct fdt_scan_prop *prop, void *extra)
 static void clint_done(const struct fdt_scan_node *node, void *extra)
 {
   struct clint_scan *scan = (struct clint_scan *)extra;
-  const uint32_t *value = scan->int_value;
-  const uint32_t *end = value + scan->int_len/4;
 
   if (!scan->compat) return;
   assert (scan->reg != 0);
@@ -333,7 +444,19 @@ static void clint_done(const struct fdt_scan_node *node, void *extra)
   assert (!scan->done); // only one clint
 
   scan->done = 1;
-  mtime = (void*)((uintptr_t)scan->reg + 0xbff8);
+  scan->base = scan->reg;
+  scan->ints = scan->int_value;
+  scan->ints_len = scan->int_len;
+}
+
+static void clint_end(void *extra)
+{
+  struct clint_scan *scan = (struct clint_scan *)extra;
+  const uint32_t *value = scan->ints;
+  const uint32_t *end = value + scan->ints_len/4;
+
+  assert (scan->done);
+  mtime = (void*)((uintptr_t)scan->base + 0xbff8);
 
   for (int index = 0; end - value > 0; ++index) {
     uint32_t phandle = bswap(value[0]);
@@ -343,27 +466,27 @@ static void clint_done(const struct fdt_scan_node *node, void *extra)
         break;
     if (hart < MAX_HARTS) {
       hls_t *hls = OTHER_HLS(hart);
-      hls->ipi = (void*)((uintptr_t)scan->reg + index * 4);
-      hls->timecmp = (void*)((uintptr_t)scan->reg + 0x4000 + (index * 8));
+      hls->ipi = (void*)((uintptr_t)scan->base + index * 4);
+      hls->timecmp = (void*)((uintptr_t)scan->base + 0x4000 + (index * 8));
     }
     value += 4;
   }
 }
 
-void query_clint(uintptr_t fdt)
-{
-  struct fdt_cb cb;
-  struct clint_scan scan;
+static struct clint_scan clint_scan;
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = clint_open;
-  cb.prop = clint_prop;
-  cb.done = clint_done;
-  cb.extra = &scan;
+const struct fdt_cb query_clint_cb = {
+  .begin = clint_begin,
+  .open = clint_open,
+  .prop = clint_prop,
+  .done = clint_done,
+  .end = clint_end,
+  .extra = &clint_scan,
+};
 
-  scan.done = 0;
-  fdt_scan(fdt, &cb);
-  assert (scan.done);
+void query_clint(uintptr_t fdt)
+{
+  fdt_scan(fdt, &query_clint_cb);
 }
 
 ///////////////////////////////////////////// PLIC SCAN /////////////////////////////////////////
@@ -376,8 +499,17 @@ struct plic_scan
   int int_len;
   int done;
   int ndev;
+  uint64_t base;
+  const uint32_t *ints;
+  int ints_len;
 };
 
+static void plic_begin(void *extra)
+{
+  struct plic_scan *scan = (struct plic_scan *)extra;
+  memset(scan, 0, sizeof(*scan));
+}
+
 static void plic_open(const struct fdt_scan_node *node, void *extra)
 {
   struct plic_scan *scan = (struct plic_scan *)extra;
@@ -389,9 +521,9 @@ static void plic_open(const struct fdt_scan_node *node, void *extra)
 static void plic_prop(const struct fdt_scan_prop *prop, void *extra)
 {
   struct plic_scan *scan = (struct plic_scan *)extra;
-  if (!strcmp(prop->name, "compatible") && fdt_string_list_index(prop, "riscv,plic0") >= 0) {
+  if (prop->key == FDT_KEY_COMPATIBLE && fdt_string_list_index(prop, "riscv,plic0") >= 0) {
     scan->compat = 1;
-  } else if (!strcmp(prop->name, "reg")) {
+  } else if (prop->key == FDT_KEY_REG) {
     fdt_get_address(prop->node->parent, prop->value, &scan->reg);
   } else if (!strcmp(prop->name, "interrupts-extended")) {
     scan->int_value = prop->value;
@@ -409,8 +541,6 @@ static void plic_prop(const struct fdt_scan_prop *prop, void *extra)
 static void plic_done(const struct fdt_scan_node *node, void *extra)
 {
   struct plic_scan *scan = (struct plic_scan *)extra;
-  const uint32_t *value = scan->int_value;
-  const uint32_t *end = value + scan->int_len/4;
 
   if (!scan->compat) return;
   assert (scan->reg != 0);
@@ -419,8 +549,20 @@ static void plic_done(const struct fdt_scan_node *node, void *extra)
   assert (!scan->done); // only one plic
 
   scan->done = 1;
+  scan->base = scan->reg;
+  scan->ints = scan->int_value;
+  scan->ints_len = scan->int_len;
   plic_priorities = (uint32_t*)(uintptr_t)scan->reg;
   plic_ndevs = scan->ndev;
+}
+
+static void plic_end(void *extra)
+{
+  struct plic_scan *scan = (struct plic_scan *)extra;
+  const uint32_t *value = scan->ints;
+  const uint32_t *end = value + scan->ints_len/4;
+
+  if (!scan->done) return;
 
   for (int index = 0; end - value > 0; ++index) {
     uint32_t phandle = bswap(value[0]);
@@ -432,11 +574,11 @@ static void plic_done(const struct fdt_scan_node *node, void *extra)
     if (hart < MAX_HARTS) {
       hls_t *hls = OTHER_HLS(hart);
       if (cpu_int == IRQ_M_EXT) {
-        hls->plic_m_ie     = (uintptr_t*)((uintptr_t)scan->reg + ENABLE_BASE + ENABLE_SIZE * index);
-        hls->plic_m_thresh = (uint32_t*) ((uintptr_t)scan->reg + HART_BASE   + HART_SIZE   * index);
+        hls->plic_m_ie     = (uintptr_t*)((uintptr_t)scan->base + ENABLE_BASE + ENABLE_SIZE * index);
+        hls->plic_m_thresh = (uint32_t*) ((uintptr_t)scan->base + HART_BASE   + HART_SIZE   * index);
       } else if (cpu_int == IRQ_S_EXT) {
-        hls->plic_s_ie     = (uintptr_t*)((uintptr_t)scan->reg + ENABLE_BASE + ENABLE_SIZE * index);
-        hls->plic_s_thresh = (uint32_t*) ((uintptr_t)scan->reg + HART_BASE   + HART_SIZE   * index);
+        hls->plic_s_ie     = (uintptr_t*)((uintptr_t)scan->base + ENABLE_BASE + ENABLE_SIZE * index);
+        hls->plic_s_thresh = (uint32_t*) ((uintptr_t)scan->base + HART_BASE   + HART_SIZE   * index);
       } else {
         printm("PLIC wired hart %d to wrong interrupt %d", hart, cpu_int);
       }
@@ -452,19 +594,20 @@ static void plic_done(const struct fdt_scan_node *node, void *extra)
 #endif
 }
 
-void query_plic(uintptr_t fdt)
-{
-  struct fdt_cb cb;
-  struct plic_scan scan;
+static struct plic_scan plic_scan;
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = plic_open;
-  cb.prop = plic_prop;
-  cb.done = plic_done;
-  cb.extra = &scan;
+const struct fdt_cb query_plic_cb = {
+  .begin = plic_begin,
+  .open = plic_open,
+  .prop = plic_prop,
+  .done = plic_done,
+  .end = plic_end,
+  .extra = &plic_scan,
+};
 
-  scan.done = 0;
-  fdt_scan(fdt, &cb);
+void query_plic(uintptr_t fdt)
+{
+  fdt_scan(fdt, &query_plic_cb);
 }
 
 static void plic_redact(const struct fdt_scan_node *node, void *extra)
@@ -482,18 +625,22 @@ static void plic_redact(const struct fdt_scan_node *node, void *extra)
   }
 }
 
+static void filter_plic_cb(struct fdt_cb *cb, struct plic_scan *scan)
+{
+  memset(cb, 0, sizeof(*cb));
+  cb->begin = plic_begin;
+  cb->open = plic_open;
+  cb->prop = plic_prop;
+  cb->done = plic_redact;
+  cb->extra = scan;
+}
+
 void filter_plic(uintptr_t fdt)
 {
   struct fdt_cb cb;
   struct plic_scan scan;
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = plic_open;
-  cb.prop = plic_prop;
-  cb.done = plic_redact;
-  cb.extra = &scan;
-
-  scan.done = 0;
+  filter_plic_cb(&cb, &scan);
   fdt_scan(fdt, &cb);
 }
 
@@ -501,7 +648,7 @@ void filter_plic(uintptr_t fdt)
 
 struct compat_scan
 {
-  const char *compat;
+  const char *const *compat; // NULL-terminated
   int depth;
   int kill;
 };
@@ -515,8 +662,10 @@ static void compat_open(const struct fdt_scan_node *node, void *extra)
 static void compat_prop(const struct fdt_scan_prop *prop, void *extra)
 {
   struct compat_scan *scan = (struct compat_scan *)extra;
-  if (!strcmp(prop->name, "compatible") && fdt_string_list_index(prop, scan->compat) >= 0)
-    if (scan->depth < scan->kill)
+  if (prop->key != FDT_KEY_COMPATIBLE)
+    return;
+  for (const char *const *compat = scan->compat; *compat; ++compat)
+    if (fdt_string_list_index(prop, *compat) >= 0 && scan->depth < scan->kill)
       scan->kill = scan->depth;
 }
 
@@ -531,20 +680,26 @@ static int compat_close(const struct fdt_scan_node *node, void *extra)
   }
 }
 
+static void filter_compat_cb(struct fdt_cb *cb, struct compat_scan *scan, const char *const *compat)
+{
+  memset(cb, 0, sizeof(*cb));
+  cb->open = compat_open;
+  cb->prop = compat_prop;
+  cb->close = compat_close;
+  cb->extra = scan;
+
+  scan->compat = compat;
+  scan->depth = 0;
+  scan->kill = 999;
+}
+
 void filter_compat(uintptr_t fdt, const char *compat)
 {
+  const char *list[] = { compat, NULL };
   struct fdt_cb cb;
   struct compat_scan scan;
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = compat_open;
-  cb.prop = compat_prop;
-  cb.close = compat_close;
-  cb.extra = &scan;
-
-  scan.compat = compat;
-  scan.depth = 0;
-  scan.kill = 999;
+  filter_compat_cb(&cb, &scan, list);
   fdt_scan(fdt, &cb);
 }
 
@@ -572,7 +727,7 @@ static void hart_filter_prop(const struct fdt_scan_prop *prop, void *extra)
   struct hart_filter *filter = (struct hart_filter *)extra;
   if (!strcmp(prop->name, "device_type") && !strcmp((const char*)prop->value, "cpu")) {
     filter->compat = 1;
-  } else if (!strcmp(prop->name, "reg")) {
+  } else if (prop->key == FDT_KEY_REG) {
     uint64_t reg;
     fdt_get_address(prop->node->parent, prop->value, &reg);
     filter->hart = reg;
@@ -610,22 +765,308 @@ static void hart_filter_done(const struct fdt_scan_node *node, void *extra)
   }
 }
 
+static void filter_harts_cb(struct fdt_cb *cb, struct hart_filter *filter, long *disabled_hart_mask)
+{
+  memset(cb, 0, sizeof(*cb));
+  cb->open = hart_filter_open;
+  cb->prop = hart_filter_prop;
+  cb->done = hart_filter_done;
+  cb->extra = filter;
+
+  filter->disabled_hart_mask = disabled_hart_mask;
+  *disabled_hart_mask = 0;
+}
+
 void filter_harts(uintptr_t fdt, long *disabled_hart_mask)
 {
   struct fdt_cb cb;
   struct hart_filter filter;
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = hart_filter_open;
-  cb.prop = hart_filter_prop;
-  cb.done = hart_filter_done;
-  cb.extra = &filter;
-
-  filter.disabled_hart_mask = disabled_hart_mask;
-  *disabled_hart_mask = 0;
+  filter_harts_cb(&cb, &filter, disabled_hart_mask);
   fdt_scan(fdt, &cb);
 }
 
+//////////////////////////////////////////// FILTER COPY ////////////////////////////////////////
+
+// filter_copy streams the source tree into the destination instead of
+// copying it and then editing it in place. Before writing a node it looks
+// ahead over the node's properties, which all precede its children, so a
+// removed node is skipped without being written and the hart and PLIC
+// edits are applied as the properties go out. NOPs are dropped, and
+// property names are remapped into a new strings block holding only the
+// names that are still referenced.
+
+#define FDT_STRMAP_BITS  9
+#define FDT_STRMAP_SLOTS (1 << FDT_STRMAP_BITS)
+
+// source string offset + 1 (0 if free) => destination string offset
+static struct {
+  uint32_t src;
+  uint32_t dst;
+} fdt_strmap[FDT_STRMAP_SLOTS];
+
+struct fdt_filter {
+  struct fdt_scan_state keys;
+  const char *const *compat;
+  long *disabled_hart_mask;
+  struct fdt_chosen_prop *chosen;
+  uint32_t chosen_name;  // string offset of chosen->name
+  int chosen_done;
+  uint32_t *out;
+  uint32_t strings_size; // of the new strings block
+  int compact;           // 0 => keep the source strings block as it is
+  int overflow;          // fdt_strmap filled up
+};
+
+static uint32_t filter_copy_string(struct fdt_filter *f, uint32_t off)
+{
+  uint32_t h = (off * 0x9e3779b1) >> (32 - FDT_STRMAP_BITS);
+
+  if (!f->compact)
+    return off;
+
+  for (int i = 0; i < FDT_STRMAP_SLOTS; ++i) {
+    int slot = (h + i) % FDT_STRMAP_SLOTS;
+    if (!fdt_strmap[slot].src) {
+      fdt_strmap[slot].src = off + 1;
+      fdt_strmap[slot].dst = f->strings_size;
+      f->strings_size += strlen(f->keys.strings + off) + 1;
+      return fdt_strmap[slot].dst;
+    }
+    if (fdt_strmap[slot].src == off + 1)
+      return fdt_strmap[slot].dst;
+  }
+
+  f->overflow = 1;
+  return 0;
+}
+
+static void filter_copy_chosen(struct fdt_filter *f)
+{
+  uint32_t *out = f->out;
+
+  out[0] = bswap(FDT_PROP);
+  out[1] = bswap(f->chosen->len);
+  out[2] = bswap(f->chosen_name);
+  memset(out + 3, 0, (f->chosen->len+3)/4 * sizeof(uint32_t));
+  f->chosen->value = out + 3;
+  f->out = out + 3 + (f->chosen->len+3)/4;
+  f->chosen_done = 1;
+}
+
+// lex follows a FDT_BEGIN_NODE and its name; return what follows its FDT_END_NODE
+static uint32_t *filter_copy_skip(uint32_t *lex)
+{
+  for (int depth = 1; depth > 0; ) {
+    switch (bswap(lex[0])) {
+      case FDT_BEGIN_NODE: ++depth; lex += 2 + strlen((const char *)(lex+1))/4; break;
+      case FDT_PROP:       lex += 3 + (bswap(lex[1])+3)/4; break;
+      case FDT_END_NODE:   --depth; lex += 1; break;
+      case FDT_NOP:        lex += 1; break;
+      default:             return lex; // FDT_END
+    }
+  }
+  return lex;
+}
+
+static uint32_t *filter_copy_node(struct fdt_filter *f, uint32_t *lex, struct fdt_scan_node *node)
+{
+  struct fdt_scan_prop prop;
+  struct hart_filter hart;
+  struct plic_scan plic;
+  const char *name = (const char *)(lex+1);
+  uint32_t *props = lex + 2 + strlen(name)/4;
+  uint32_t *p;
+  int kill = 0, masked = 0;
+
+  node->name = name;
+  node->address_cells = 2;
+  node->size_cells = 1;
+  prop.node = node;
+  hart_filter_open(node, &hart);
+  plic_open(node, &plic);
+
+  // Look ahead at the properties to decide what happens to the node
+  for (p = props; bswap(p[0]) == FDT_PROP || bswap(p[0]) == FDT_NOP; ) {
+    if (bswap(p[0]) == FDT_NOP) { p += 1; continue; }
+    prop.name  = f->keys.strings + bswap(p[2]);
+    prop.len   = bswap(p[1]);
+    prop.value = p + 3;
+    prop.key   = fdt_key(&f->keys, bswap(p[2]));
+    if (prop.key == FDT_KEY_ADDRESS_CELLS) { node->address_cells = bswap(p[3]); }
+    if (prop.key == FDT_KEY_SIZE_CELLS)    { node->size_cells    = bswap(p[3]); }
+    if (prop.key == FDT_KEY_COMPATIBLE)
+      for (const char *const *compat = f->compat; *compat; ++compat)
+        if (fdt_string_list_index(&prop, *compat) >= 0)
+          kill = 1;
+    hart_filter_prop(&prop, &hart);
+    plic_prop(&prop, &plic);
+    p += 3 + (prop.len+3)/4;
+  }
+
+  if (kill)
+    return filter_copy_skip(props);
+
+  if (hart.compat) {
+    assert (hart.status);
+    assert (hart.hart >= 0);
+    masked = hart_filter_mask(&hart);
+    if (masked)
+      *f->disabled_hart_mask |= (1 << hart.hart);
+  }
+
+  memcpy(f->out, lex, (props - lex) * sizeof(uint32_t));
+  f->out += props - lex;
+
+  for (p = props; bswap(p[0]) == FDT_PROP || bswap(p[0]) == FDT_NOP; ) {
+    uint32_t *value = p + 3, *out = f->out;
+    uint32_t len = bswap(p[1]);
+
+    if (bswap(p[0]) == FDT_NOP) { p += 1; continue; }
+    p += 3 + (len+3)/4;
+
+    out[0] = bswap(FDT_PROP);
+    out[2] = bswap(filter_copy_string(f, bswap(value[-1])));
+    if (masked && (char *)value == hart.status) {
+      len = strlen("masked")+1;
+      out[3 + (len+3)/4 - 1] = 0;
+      strcpy((char *)(out + 3), "masked");
+    } else {
+      memcpy(out + 3, value, (len+3)/4 * sizeof(uint32_t));
+    }
+    out[1] = bswap(len);
+
+    if (plic.compat && value == plic.int_value)
+      for (uint32_t *cell = out + 3; cell + 2 <= out + 3 + len/4; cell += 2)
+        if (bswap(cell[1]) == IRQ_M_EXT) cell[1] = bswap(-1);
+
+    f->out = out + 3 + (len+3)/4;
+  }
+
+  if (f->chosen && node->parent && !node->parent->parent && !strcmp(name, "chosen"))
+    filter_copy_chosen(f);
+
+  while (1) {
+    switch (bswap(p[0])) {
+      case FDT_BEGIN_NODE: {
+        struct fdt_scan_node child;
+        child.parent = node;
+        p = filter_copy_node(f, p, &child);
+        break;
+      }
+      case FDT_NOP: {
+        p += 1;
+        break;
+      }
+      case FDT_END_NODE: {
+        if (f->chosen && !f->chosen_done && !node->parent) {
+          // the tree has no /chosen; add one at the end of the root
+          f->out[0] = bswap(FDT_BEGIN_NODE);
+          f->out[1] = f->out[2] = 0;
+          strcpy((char *)(f->out + 1), "chosen");
+          f->out += 2 + strlen("chosen")/4;
+          filter_copy_chosen(f);
+          *f->out++ = bswap(FDT_END_NODE);
+        }
+        *f->out++ = bswap(FDT_END_NODE);
+        return p + 1;
+      }
+      default: { // FDT_END
+        return p;
+      }
+    }
+  }
+}
+
+uint32_t filter_copy(uintptr_t source, uintptr_t dest, long *disabled_hart_mask,
+                     const char *const *compat, struct fdt_chosen_prop *chosen)
+{
+  struct fdt_header *in = (struct fdt_header *)source;
+  struct fdt_header *out = (struct fdt_header *)dest;
+  const uint64_t *rsv = (const uint64_t *)(source + bswap(in->off_mem_rsvmap));
+  uint32_t off_rsv = (sizeof(struct fdt_header) + 7) / 8 * 8;
+  uint32_t off_struct, off_strings, size_strings, rsv_entries = 1;
+  struct fdt_filter f;
+
+  // Only process FDT that we understand
+  if (bswap(in->magic) != FDT_MAGIC ||
+      bswap(in->last_comp_version) > FDT_VERSION) return 0;
+
+  f.keys.strings = (const char *)(source + bswap(in->off_dt_strings));
+  fdt_find_keys(&f.keys, bswap(in->size_dt_strings));
+  f.compat = compat;
+  f.disabled_hart_mask = disabled_hart_mask;
+  f.chosen = chosen;
+
+  while (rsv[2 * (rsv_entries - 1)] || rsv[2 * (rsv_entries - 1) + 1])
+    ++rsv_entries;
+  memcpy((void *)(dest + off_rsv), rsv, rsv_entries * 2 * sizeof(uint64_t));
+  off_struct = off_rsv + rsv_entries * 2 * sizeof(uint64_t);
+
+  // Should the source somehow use more names than fdt_strmap holds, go
+  // again and keep its strings block as it is
+  for (f.compact = 1; ; f.compact = 0) {
+    uint32_t *lex = (uint32_t *)(source + bswap(in->off_dt_struct));
+
+    memset(fdt_strmap, 0, sizeof(fdt_strmap));
+    f.out = (uint32_t *)(dest + off_struct);
+    f.strings_size = 0;
+    f.overflow = 0;
+    f.chosen_done = 0;
+    // the new name goes first in a new strings block, last in a kept one
+    if (chosen && f.compact) {
+      f.chosen_name = 0;
+      f.strings_size = strlen(chosen->name) + 1;
+    } else if (chosen) {
+      f.chosen_name = bswap(in->size_dt_strings);
+    }
+    *disabled_hart_mask = 0;
+
+    while (bswap(lex[0]) != FDT_END) {
+      if (bswap(lex[0]) == FDT_BEGIN_NODE) {
+        struct fdt_scan_node root;
+        root.parent = 0;
+        lex = filter_copy_node(&f, lex, &root);
+      } else {
+        lex += 1;
+      }
+    }
+    *f.out++ = bswap(FDT_END);
+
+    if (!f.overflow) break;
+  }
+
+  off_strings = (uintptr_t)f.out - dest;
+  if (f.compact) {
+    size_strings = f.strings_size;
+    for (int i = 0; i < FDT_STRMAP_SLOTS; ++i)
+      if (fdt_strmap[i].src)
+        strcpy((char *)(dest + off_strings + fdt_strmap[i].dst),
+               f.keys.strings + fdt_strmap[i].src - 1);
+  } else {
+    size_strings = bswap(in->size_dt_strings);
+    memcpy((void *)(dest + off_strings), f.keys.strings, size_strings);
+  }
+  if (chosen) {
+    strcpy((char *)(dest + off_strings + f.chosen_name), chosen->name);
+    if (!f.compact)
+      size_strings += strlen(chosen->name) + 1;
+  }
+
+  out->magic = bswap(FDT_MAGIC);
+  out->totalsize = bswap(off_strings + size_strings);
+  out->off_dt_struct = bswap(off_struct);
+  out->off_dt_strings = bswap(off_strings);
+  out->off_mem_rsvmap = bswap(off_rsv);
+  out->version = bswap(FDT_VERSION);
+  out->last_comp_version = bswap(16);
+  out->boot_cpuid_phys = in->boot_cpuid_phys;
+  out->size_dt_strings = bswap(size_strings);
+  out->size_dt_struct = bswap(off_strings - off_struct);
+
+  return off_strings + size_strings;
+}
+
 //////////////////////////////////////////// PRINT //////////////////////////////////////////////
 
 #ifdef PK_PRINT_DEVICE_TREE
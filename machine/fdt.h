@@ -30,29 +30,46 @@ struct fdt_scan_node {
   int size_cells;
 };
 
+// Property names the scanner matches by string offset, so consumers can
+// test prop->key instead of running strcmp on every property
+#define FDT_KEY_OTHER		0
+#define FDT_KEY_ADDRESS_CELLS	1
+#define FDT_KEY_SIZE_CELLS	2
+#define FDT_KEY_COMPATIBLE	3
+#define FDT_KEY_REG		4
+#define FDT_KEYS		5
+
 struct fdt_scan_prop {
   const struct fdt_scan_node *node;
   const char *name;
   uint32_t *value;
   int len; // in bytes of value
+  int key; // FDT_KEY_*
 };
 
 struct fdt_cb {
+  void (*begin)(void *extra); // before the first node
   void (*open)(const struct fdt_scan_node *node, void *extra);
   void (*prop)(const struct fdt_scan_prop *prop, void *extra);
   void (*done)(const struct fdt_scan_node *node, void *extra); // last property was seen
   int  (*close)(const struct fdt_scan_node *node, void *extra); // -1 => delete the node + children
+  void (*end)(void *extra); // the whole tree was seen
   void *extra;
 };
 
 // Scan the contents of FDT
 void fdt_scan(uintptr_t fdt, const struct fdt_cb *cb);
+// Scan it once, calling every consumer in turn at each step; a node is
+// deleted if any of them asks for it
+void fdt_scan_all(uintptr_t fdt, const struct fdt_cb *cbs, int ncbs);
 uint32_t fdt_size(uintptr_t fdt);
 
 // Extract fields
 const uint32_t *fdt_get_address(const struct fdt_scan_node *node, const uint32_t *base, uint64_t *value);
 const uint32_t *fdt_get_size(const struct fdt_scan_node *node, const uint32_t *base, uint64_t *value);
 int fdt_string_list_index(const struct fdt_scan_prop *prop, const char *str); // -1 if not found
+uint32_t fdt_get_u32(const struct fdt_scan_prop *prop); // first cell, 0 if none
+uint32_t fdt_get_cell(const struct fdt_scan_prop *prop, int i); // cell i, 0 if none
 
 // Setup memory+clint+plic
 void query_mem(uintptr_t fdt);
@@ -60,10 +77,29 @@ void query_harts(uintptr_t fdt);
 void query_plic(uintptr_t fdt);
 void query_clint(uintptr_t fdt);
 
+// The same, as consumers for fdt_scan_all
+extern const struct fdt_cb query_mem_cb;
+extern const struct fdt_cb query_harts_cb;
+extern const struct fdt_cb query_clint_cb;
+extern const struct fdt_cb query_plic_cb;
+
 // Remove information from FDT
 void filter_harts(uintptr_t fdt, long *disabled_hart_mask);
 void filter_plic(uintptr_t fdt);
 void filter_compat(uintptr_t fdt, const char *compat);
+// A property for filter_copy to add to /chosen, creating the node if need
+// be. Its value is zeroed and left at *value for the caller to fill in.
+struct fdt_chosen_prop {
+  const char *name;
+  int len;
+  uint32_t *value;
+};
+
+// All of the above while copying FDT from source to dest in one pass,
+// keeping only the strings still in use; compat is a NULL-terminated list
+// and chosen may be NULL. Returns the size of the new FDT.
+uint32_t filter_copy(uintptr_t source, uintptr_t dest, long *disabled_hart_mask,
+                     const char *const *compat, struct fdt_chosen_prop *chosen);
 
 // The hartids of available harts
 extern uint64_t hart_mask;
@@ -29,9 +29,9 @@ static void finisher_open(const struct fdt_scan_node *node, void *extra)
 static void finisher_prop(const struct fdt_scan_prop *prop, void *extra)
 {
   struct finisher_scan *scan = (struct finisher_scan *)extra;
-  if (!strcmp(prop->name, "compatible") && !strcmp((const char*)prop->value, "sifive,test0")) {
+  if (prop->key == FDT_KEY_COMPATIBLE && !strcmp((const char*)prop->value, "sifive,test0")) {
     scan->compat = 1;
-  } else if (!strcmp(prop->name, "reg")) {
+  } else if (prop->key == FDT_KEY_REG) {
     fdt_get_address(prop->node->parent, prop->value, &scan->reg);
   }
 }
@@ -43,16 +43,16 @@ static void finisher_done(const struct fdt_scan_node *node, void *extra)
   finisher = (uint32_t*)(uintptr_t)scan->reg;
 }
 
-void query_finisher(uintptr_t fdt)
-{
-  struct fdt_cb cb;
-  struct finisher_scan scan;
+static struct finisher_scan finisher_scan;
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = finisher_open;
-  cb.prop = finisher_prop;
-  cb.done = finisher_done;
-  cb.extra = &scan;
+const struct fdt_cb query_finisher_cb = {
+  .open = finisher_open,
+  .prop = finisher_prop,
+  .done = finisher_done,
+  .extra = &finisher_scan,
+};
 
-  fdt_scan(fdt, &cb);
+void query_finisher(uintptr_t fdt)
+{
+  fdt_scan(fdt, &query_finisher_cb);
 }
@@ -9,5 +9,6 @@
 
 void finisher_exit(uint16_t code);
 void query_finisher(uintptr_t fdt);
+extern const struct fdt_cb query_finisher_cb; // for fdt_scan_all
 
 #endif
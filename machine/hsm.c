@@ -0,0 +1,146 @@
+// See LICENSE for license details.
+
+// SBI hart state management. With --enable-sbi-hsm only the boot hart
+// enters the payload; the others wait in M-mode, in hsm_park_hart(), until
+// the OS starts them. A started hart can stop itself again, or suspend in
+// place until its next interrupt.
+
+#include "hsm.h"
+#include "mtrap.h"
+#include "mcall.h"
+#include "atomic.h"
+#include "bits.h"
+#include "fdt.h"
+#include "disabled_hart_mask.h"
+#include "boot_profile.h"
+
+// set while a hart_start caller fills in the start address; never seen
+// outside this file
+#define HSM_STATE_CLAIMED 0x100
+
+static int hsm_valid_hart(uintptr_t hartid)
+{
+  return hartid < MAX_HARTS && ((hart_mask & ~disabled_hart_mask) >> hartid) & 1;
+}
+
+void hsm_init_hart(uintptr_t hartid)
+{
+  OTHER_HLS(hartid)->hsm_state =
+    hartid == 0 ? HSM_STATE_STARTED : HSM_STATE_STOPPED;
+}
+
+// Enter S-mode at 'start' as the SBI spec asks for a freshly started hart:
+// satp = 0, SIE = 0, a0 = hartid, a1 = opaque. Everything else that
+// enter_supervisor_mode() sets up (PMP, SM) was done when the hart booted
+// and is still in place, so this only rewrites what S-mode can change.
+static void __attribute__((noreturn)) hsm_start_supervisor(uintptr_t start,
+                                                           uintptr_t opaque)
+{
+  uintptr_t mstatus = read_csr(mstatus);
+  mstatus = INSERT_FIELD(mstatus, MSTATUS_MPP, PRV_S);
+  mstatus = INSERT_FIELD(mstatus, MSTATUS_MPIE, 0);
+  mstatus &= ~MSTATUS_SIE;
+  write_csr(mstatus, mstatus);
+  if (supports_extension('S'))
+    write_csr(sptbr, 0);
+  clear_csr(mip, MIP_STIP | MIP_SSIP);
+  write_csr(mscratch, MACHINE_STACK_TOP() - MENTRY_FRAME_SIZE);
+  write_csr(mepc, start);
+
+  boot_profile_enter_supervisor();
+  console_flush();
+  HLS()->hsm_state = HSM_STATE_STARTED;
+  mb();
+
+  register uintptr_t a0 asm ("a0") = read_csr(mhartid);
+  register uintptr_t a1 asm ("a1") = opaque;
+  asm volatile ("mret" : : "r" (a0), "r" (a1));
+  __builtin_unreachable();
+}
+
+void hsm_park_hart()
+{
+  // only IPIs wake a stopped hart; a stale timer must not
+  clear_csr(mie, MIP_MTIP);
+  clear_csr(mip, MIP_STIP | MIP_SSIP);
+  // nothing may stay buffered while this hart sleeps
+  console_flush();
+
+  while (1) {
+    // fences, PMP updates and poweroff still reach stopped harts
+    handle_ipi_in_machine_mode();
+    if (HLS()->hsm_state == HSM_STATE_START_PENDING) {
+      mb();
+      hsm_start_supervisor(HLS()->hsm_start_addr, HLS()->hsm_opaque);
+    }
+    wfi();
+  }
+}
+
+uintptr_t mcall_hsm_hart_start(uintptr_t hartid, uintptr_t start_addr,
+                               uintptr_t opaque)
+{
+  if (!hsm_valid_hart(hartid))
+    return SBI_ERR_INVALID_PARAM;
+
+  hls_t* hls = OTHER_HLS(hartid);
+  if (atomic_cas(&hls->hsm_state, HSM_STATE_STOPPED,
+                 HSM_STATE_START_PENDING | HSM_STATE_CLAIMED) != HSM_STATE_STOPPED)
+    return SBI_ERR_ALREADY_AVAILABLE;
+
+  hls->hsm_start_addr = start_addr;
+  hls->hsm_opaque = opaque;
+  mb();
+  hls->hsm_state = HSM_STATE_START_PENDING;
+  mb();
+  *hls->ipi = 1;
+  return SBI_SUCCESS;
+}
+
+uintptr_t mcall_hsm_hart_stop()
+{
+  if (HLS()->hsm_state != HSM_STATE_STARTED)
+    return SBI_ERR_FAILED;
+
+  HLS()->hsm_state = HSM_STATE_STOP_PENDING;
+  mb();
+  HLS()->hsm_state = HSM_STATE_STOPPED;
+  hsm_park_hart();
+}
+
+uintptr_t mcall_hsm_hart_get_status(uintptr_t hartid, uintptr_t* status)
+{
+  if (!hsm_valid_hart(hartid))
+    return SBI_ERR_INVALID_PARAM;
+
+  *status = OTHER_HLS(hartid)->hsm_state & ~HSM_STATE_CLAIMED;
+  return SBI_SUCCESS;
+}
+
+// Retentive suspend: wait right here until an interrupt the hart has
+// enabled is pending. M-mode work that woke us (IPIs, the timer) is done
+// before returning so it doesn't cost a second trap on the way out.
+uintptr_t mcall_hsm_hart_suspend(uintptr_t type, uintptr_t resume_addr,
+                                 uintptr_t opaque)
+{
+  if (type == HSM_SUSPEND_NON_RETENTIVE)
+    return SBI_ERR_NOT_SUPPORTED;
+  if (type != HSM_SUSPEND_RETENTIVE)
+    return SBI_ERR_INVALID_PARAM;
+
+  HLS()->hsm_state = HSM_STATE_SUSPENDED;
+  while (!(read_csr(mip) & read_csr(mie)))
+    wfi();
+  HLS()->hsm_state = HSM_STATE_RESUME_PENDING;
+
+  if (read_csr(mip) & MIP_MSIP)
+    handle_ipi_in_machine_mode();
+  if (read_csr(mip) & read_csr(mie) & MIP_MTIP) {
+    // what mentry.S does for a timer interrupt
+    clear_csr(mie, MIP_MTIP);
+    set_csr(mip, MIP_STIP);
+  }
+
+  HLS()->hsm_state = HSM_STATE_STARTED;
+  return SBI_SUCCESS;
+}
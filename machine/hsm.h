@@ -0,0 +1,28 @@
+#ifndef _RISCV_HSM_H
+#define _RISCV_HSM_H
+
+#include <stdint.h>
+
+// hart states, as reported by SBI_EXT_HSM_HART_GET_STATUS
+#define HSM_STATE_STARTED         0
+#define HSM_STATE_STOPPED         1
+#define HSM_STATE_START_PENDING   2
+#define HSM_STATE_STOP_PENDING    3
+#define HSM_STATE_SUSPENDED       4
+#define HSM_STATE_SUSPEND_PENDING 5
+#define HSM_STATE_RESUME_PENDING  6
+
+#define HSM_SUSPEND_RETENTIVE     0x00000000
+#define HSM_SUSPEND_NON_RETENTIVE 0x80000000
+
+void hsm_init_hart(uintptr_t hartid);
+void hsm_park_hart() __attribute__((noreturn));
+
+uintptr_t mcall_hsm_hart_start(uintptr_t hartid, uintptr_t start_addr,
+                               uintptr_t opaque);
+uintptr_t mcall_hsm_hart_stop();
+uintptr_t mcall_hsm_hart_get_status(uintptr_t hartid, uintptr_t* status);
+uintptr_t mcall_hsm_hart_suspend(uintptr_t type, uintptr_t resume_addr,
+                                 uintptr_t opaque);
+
+#endif
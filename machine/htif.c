@@ -17,6 +17,40 @@ uintptr_t htif;
 #define TOHOST_OFFSET		((uintptr_t)tohost - (uintptr_t)__htif_base)
 #define FROMHOST_OFFSET		((uintptr_t)fromhost - (uintptr_t)__htif_base)
 
+/* Request queues
+ *
+ * tohost holds one request at a time, but the host takes it as soon as
+ * it has read it and answers through fromhost later, so several requests
+ * can be in flight. Each device has its own queue; htif_pump() moves
+ * queued requests into tohost whenever it is free, round-robin between
+ * devices, and counts the replies coming back through fromhost per
+ * device and command. The host answers each device in order, so a
+ * caller that needs the reply waits for its ticket to be completed.
+ * htif_lock only covers these data structures, never a round trip.
+ * Console writes return as soon as their bytes are queued; later HTIF
+ * calls, htif_console_drain() after each SBI call and
+ * htif_console_flush() (before S-mode entry, when a hart parks, at
+ * poweroff) push them out.
+ */
+#define HTIF_NDEV 2
+#define HTIF_NCMD 2
+#define HTIF_QUEUE_SIZE 64 // power of two
+
+#define HTIF_DEV_SYSCALL 0
+#define HTIF_DEV_CONSOLE 1
+#define HTIF_CONSOLE_CMD_GETC 0
+#define HTIF_CONSOLE_CMD_PUTC 1
+
+struct htif_queue {
+  uint64_t req[HTIF_QUEUE_SIZE];
+  unsigned int head, tail;
+};
+
+static struct htif_queue htif_queues[HTIF_NDEV];
+static unsigned int htif_next_dev;
+static uint64_t htif_issued[HTIF_NDEV][HTIF_NCMD];
+static volatile uint64_t htif_completed[HTIF_NDEV][HTIF_NCMD];
+
 static void __check_fromhost()
 {
   uint64_t fh = fromhost;
@@ -24,72 +58,142 @@ static void __check_fromhost()
     return;
   fromhost = 0;
 
-  // this should be from the console
-  assert(FROMHOST_DEV(fh) == 1);
-  switch (FROMHOST_CMD(fh)) {
-    case 0:
-      htif_console_buf = 1 + (uint8_t)FROMHOST_DATA(fh);
-      break;
-    case 1:
-      break;
-    default:
-      assert(0);
+  uintptr_t dev = FROMHOST_DEV(fh), cmd = FROMHOST_CMD(fh);
+  assert(dev < HTIF_NDEV && cmd < HTIF_NCMD);
+  if (dev == HTIF_DEV_CONSOLE && cmd == HTIF_CONSOLE_CMD_GETC)
+    htif_console_buf = 1 + (uint8_t)FROMHOST_DATA(fh);
+  htif_completed[dev][cmd]++;
+}
+
+// Collect a reply and issue the next queued request. Call with htif_lock.
+static void htif_pump()
+{
+  __check_fromhost();
+  if (tohost)
+    return;
+
+  for (int i = 0; i < HTIF_NDEV; i++) {
+    struct htif_queue* q = &htif_queues[htif_next_dev];
+    htif_next_dev = (htif_next_dev + 1) % HTIF_NDEV;
+    if (q->head != q->tail) {
+      tohost = q->req[q->tail++ % HTIF_QUEUE_SIZE];
+      return;
+    }
   }
 }
 
-static void __set_tohost(uintptr_t dev, uintptr_t cmd, uintptr_t data)
+// Queue a request; returns the ticket its reply will complete. Call with
+// htif_lock.
+static uint64_t htif_submit(uintptr_t dev, uintptr_t cmd, uintptr_t data)
+{
+  struct htif_queue* q = &htif_queues[dev];
+
+  while (q->head - q->tail == HTIF_QUEUE_SIZE)
+    htif_pump();
+  q->req[q->head++ % HTIF_QUEUE_SIZE] = TOHOST_CMD(dev, cmd, data);
+  htif_pump();
+  return ++htif_issued[dev][cmd];
+}
+
+static void htif_wait(uintptr_t dev, uintptr_t cmd, uint64_t ticket)
 {
-  while (tohost)
-    __check_fromhost();
-  tohost = TOHOST_CMD(dev, cmd, data);
+  while (1) {
+    spinlock_lock(&htif_lock);
+      htif_pump();
+      int done = htif_completed[dev][cmd] >= ticket;
+    spinlock_unlock(&htif_lock);
+    if (done)
+      return;
+  }
 }
 
 int htif_console_getchar()
 {
   spinlock_lock(&htif_lock);
-    __check_fromhost();
+    htif_pump();
     int ch = htif_console_buf;
     if (ch >= 0) {
       htif_console_buf = -1;
-      __set_tohost(1, 0, 0);
+      htif_submit(HTIF_DEV_CONSOLE, HTIF_CONSOLE_CMD_GETC, 0);
     }
   spinlock_unlock(&htif_lock);
 
   return ch - 1;
 }
 
-static void do_tohost_fromhost(uintptr_t dev, uintptr_t cmd, uintptr_t data)
+void htif_syscall(uintptr_t arg)
 {
   spinlock_lock(&htif_lock);
-    __set_tohost(dev, cmd, data);
-
-    while (1) {
-      uint64_t fh = fromhost;
-      if (fh) {
-        if (FROMHOST_DEV(fh) == dev && FROMHOST_CMD(fh) == cmd) {
-          fromhost = 0;
-          break;
-        }
-        __check_fromhost();
-      }
-    }
+    uint64_t ticket = htif_submit(HTIF_DEV_SYSCALL, 0, arg);
   spinlock_unlock(&htif_lock);
+  htif_wait(HTIF_DEV_SYSCALL, 0, ticket);
 }
 
-void htif_syscall(uintptr_t arg)
+void htif_console_putchar(uint8_t ch)
 {
-  do_tohost_fromhost(0, 0, arg);
+  spinlock_lock(&htif_lock);
+    htif_submit(HTIF_DEV_CONSOLE, HTIF_CONSOLE_CMD_PUTC, ch);
+  spinlock_unlock(&htif_lock);
 }
 
-void htif_console_putchar(uint8_t ch)
+// Issue whatever is queued if tohost is free, without waiting
+void htif_console_drain()
+{
+  if (spinlock_trylock(&htif_lock))
+    return;
+  htif_pump();
+  spinlock_unlock(&htif_lock);
+}
+
+// Wait until the host has printed everything queued so far
+void htif_console_flush()
 {
   spinlock_lock(&htif_lock);
-    __set_tohost(1, 1, ch);
+    uint64_t ticket = htif_issued[HTIF_DEV_CONSOLE][HTIF_CONSOLE_CMD_PUTC];
+  spinlock_unlock(&htif_lock);
+  htif_wait(HTIF_DEV_CONSOLE, HTIF_CONSOLE_CMD_PUTC, ticket);
+}
+
+#ifdef PK_ENABLE_HTIF_BULK_CONSOLE
+// Longer writes go to the host as one write(1, buf, len) through the
+// syscall device (as pk's frontend does) instead of a request per byte.
+# define HTIF_BULK_MIN 16
+# define HTIF_SYS_WRITE 64
+
+static spinlock_t htif_bulk_lock = SPINLOCK_INIT;
+static volatile uint64_t htif_bulk_mem[8] __attribute__((aligned(64)));
+
+static void htif_console_write_bulk(const char* buf, size_t len)
+{
+  spinlock_lock(&htif_bulk_lock);
+    // keep order with bytes still queued on the console device
+    htif_console_flush();
+    htif_bulk_mem[0] = HTIF_SYS_WRITE;
+    htif_bulk_mem[1] = 1;
+    htif_bulk_mem[2] = (uintptr_t)buf;
+    htif_bulk_mem[3] = len;
+    mb();
+    htif_syscall((uintptr_t)htif_bulk_mem);
+  spinlock_unlock(&htif_bulk_lock);
+}
+#endif
+
+void htif_console_write(const char* buf, size_t len)
+{
+#ifdef PK_ENABLE_HTIF_BULK_CONSOLE
+  if (len >= HTIF_BULK_MIN)
+    return htif_console_write_bulk(buf, len);
+#endif
+
+  spinlock_lock(&htif_lock);
+    while (len--)
+      htif_submit(HTIF_DEV_CONSOLE, HTIF_CONSOLE_CMD_PUTC, (uint8_t)*buf++);
   spinlock_unlock(&htif_lock);
 }
 
 void htif_poweroff()
 {
+  htif_console_flush();
   while (1) {
     fromhost = 0;
     tohost = 1;
@@ -110,7 +214,7 @@ static void htif_open(const struct fdt_scan_node *node, void *extra)
 static void htif_prop(const struct fdt_scan_prop *prop, void *extra)
 {
   struct htif_scan *scan = (struct htif_scan *)extra;
-  if (!strcmp(prop->name, "compatible") && !strcmp((const char*)prop->value, "ucb,htif0")) {
+  if (prop->key == FDT_KEY_COMPATIBLE && !strcmp((const char*)prop->value, "ucb,htif0")) {
     scan->compat = 1;
   }
 }
@@ -123,16 +227,16 @@ static void htif_done(const struct fdt_scan_node *node, void *extra)
   htif = 1;
 }
 
-void query_htif(uintptr_t fdt)
-{
-  struct fdt_cb cb;
-  struct htif_scan scan;
+static struct htif_scan htif_scan;
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = htif_open;
-  cb.prop = htif_prop;
-  cb.done = htif_done;
-  cb.extra = &scan;
+const struct fdt_cb query_htif_cb = {
+  .open = htif_open,
+  .prop = htif_prop,
+  .done = htif_done,
+  .extra = &htif_scan,
+};
 
-  fdt_scan(fdt, &cb);
+void query_htif(uintptr_t fdt)
+{
+  fdt_scan(fdt, &query_htif_cb);
 }
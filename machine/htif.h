@@ -2,6 +2,7 @@
 #define _RISCV_HTIF_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #if __riscv_xlen == 64
 # define TOHOST_CMD(dev, cmd, payload) \
@@ -17,7 +18,11 @@
 
 extern uintptr_t htif;
 void query_htif(uintptr_t dtb);
+extern const struct fdt_cb query_htif_cb; // for fdt_scan_all
 void htif_console_putchar(uint8_t);
+void htif_console_write(const char* buf, size_t len);
+void htif_console_drain();
+void htif_console_flush();
 int htif_console_getchar();
 void htif_poweroff() __attribute__((noreturn));
 void htif_syscall(uintptr_t);
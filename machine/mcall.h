@@ -11,4 +11,62 @@
 #define SBI_REMOTE_SFENCE_VMA_ASID 7
 #define SBI_SHUTDOWN 8
 
+/* SBI v0.2 extensions: a7 = extension ID, a6 = function ID,
+ * returns a0 = error, a1 = value */
+#define SBI_EXT_BASE 0x10
+#define SBI_EXT_BASE_GET_SPEC_VERSION 0
+#define SBI_EXT_BASE_GET_IMPL_ID 1
+#define SBI_EXT_BASE_GET_IMPL_VERSION 2
+#define SBI_EXT_BASE_PROBE_EXT 3
+#define SBI_EXT_BASE_GET_MVENDORID 4
+#define SBI_EXT_BASE_GET_MARCHID 5
+#define SBI_EXT_BASE_GET_MIMPID 6
+
+#define SBI_EXT_RFENCE 0x52464E43
+#define SBI_EXT_RFENCE_REMOTE_FENCE_I 0
+#define SBI_EXT_RFENCE_REMOTE_SFENCE_VMA 1
+#define SBI_EXT_RFENCE_REMOTE_SFENCE_VMA_ASID 2
+
+#define SBI_EXT_HSM 0x48534D
+#define SBI_EXT_HSM_HART_START 0
+#define SBI_EXT_HSM_HART_STOP 1
+#define SBI_EXT_HSM_HART_GET_STATUS 2
+#define SBI_EXT_HSM_HART_SUSPEND 3
+
+#define SBI_EXT_PMU 0x504D55
+#define SBI_EXT_PMU_NUM_COUNTERS 0
+#define SBI_EXT_PMU_COUNTER_GET_INFO 1
+#define SBI_EXT_PMU_COUNTER_CFG_MATCH 2
+#define SBI_EXT_PMU_COUNTER_START 3
+#define SBI_EXT_PMU_COUNTER_STOP 4
+#define SBI_EXT_PMU_COUNTER_FW_READ 5
+
+#define SBI_EXT_DBCN 0x4442434E
+#define SBI_EXT_DBCN_CONSOLE_WRITE 0
+#define SBI_EXT_DBCN_CONSOLE_READ 1
+#define SBI_EXT_DBCN_CONSOLE_WRITE_BYTE 2
+
+/* bbl vendor extension */
+#define SBI_EXT_BBL 0x09000000
+#define SBI_EXT_BBL_FENCE_I_ASYNC 0
+#define SBI_EXT_BBL_SFENCE_VMA_ASYNC 1
+#define SBI_EXT_BBL_SFENCE_VMA_ASID_ASYNC 2
+#define SBI_EXT_BBL_FENCE_POLL 3
+#define SBI_EXT_BBL_TRAP_PROFILE_READ 4
+#define SBI_EXT_BBL_TRAP_PROFILE_RESET 5
+#define SBI_EXT_BBL_TRAP_HOTSPOT_READ 6
+
+#define SBI_SPEC_VERSION 0x2 /* v0.2 */
+#define SBI_IMPL_ID_BBL 0
+
+#define SBI_SUCCESS 0
+#define SBI_ERR_FAILED -1
+#define SBI_ERR_NOT_SUPPORTED -2
+#define SBI_ERR_INVALID_PARAM -3
+#define SBI_ERR_DENIED -4
+#define SBI_ERR_INVALID_ADDRESS -5
+#define SBI_ERR_ALREADY_AVAILABLE -6
+#define SBI_ERR_ALREADY_STARTED -7
+#define SBI_ERR_ALREADY_STOPPED -8
+
 #endif
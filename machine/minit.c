@@ -8,6 +8,9 @@
 #include "finisher.h"
 #include "disabled_hart_mask.h"
 #include "htif.h"
+#include "hsm.h"
+#include "pmu.h"
+#include "boot_profile.h"
 #include <string.h>
 #include <limits.h>
 
@@ -82,6 +85,9 @@ hls_t* hls_init(uintptr_t id)
 {
   hls_t* hls = OTHER_HLS(id);
   memset(hls, 0, sizeof(*hls));
+#ifdef PK_ENABLE_SBI_HSM
+  hsm_init_hart(id);
+#endif
   return hls;
 }
 
@@ -140,29 +146,76 @@ static void wake_harts()
       *OTHER_HLS(hart)->ipi = 1; // wakeup the hart
 }
 
-void init_first_hart(uintptr_t hartid, uintptr_t dtb)
+#ifdef PK_ENABLE_UART_TX_IRQ
+// Route the console's interrupt to this hart's M-mode PLIC context, so
+// the TX ring drains on THRE instead of waiting for the next ecall. The
+// OS must leave the UART alone in this configuration.
+static void uart_tx_irq_init()
 {
-  // Confirm console as early as possible
-  query_uart(dtb);
-  query_uart16550(dtb);
-  query_htif(dtb);
-  printm("bbl loader\r\n");
+  uint32_t irq = uart ? uart_irq : uart16550 ? uart16550_irq : 0;
+  size_t bits = 8 * sizeof(uintptr_t);
+
+  if (!irq || irq > plic_ndevs || !HLS()->plic_m_ie)
+    return;
+
+  plic_priorities[irq] = 2; // above plic_m_thresh
+  HLS()->plic_m_ie[irq / bits] |= 1UL << (irq % bits);
+  set_csr(mie, MIP_MEIP);
+
+  if (uart)
+    uart_enable_tx_irq();
+  else
+    uart16550_enable_tx_irq();
+}
+#endif
 
+// Everything bbl needs from the device tree, found in a single walk. At
+// each node the console and power button come first, so they are set up
+// by the time a later consumer can fail on the same node.
+static void query_platform(uintptr_t dtb)
+{
+  const struct fdt_cb cbs[] = {
+    query_uart_cb,
+    query_uart16550_cb,
+    query_htif_cb,
+    query_finisher_cb,
+    query_mem_cb,
+    query_harts_cb,
+    query_clint_cb,
+    query_plic_cb,
+    query_pmu_cb,
+  };
+
+  fdt_scan_all(dtb, cbs, sizeof(cbs) / sizeof(cbs[0]));
+}
+
+void init_first_hart(uintptr_t hartid, uintptr_t dtb)
+{
+  boot_profile_mark(BOOT_PROFILE_ENTRY);
   hart_init();
+  boot_profile_mark(BOOT_PROFILE_HART_INIT);
   hls_init(0); // this might get called again from parse_config_string
 
-  // Find the power button early as well so die() works
-  query_finisher(dtb);
+  query_platform(dtb);
+  printm("bbl loader\r\n");
+  boot_profile_mark(BOOT_PROFILE_DT_SCAN);
 
-  query_mem(dtb);
-  query_harts(dtb);
-  query_clint(dtb);
-  query_plic(dtb);
+#ifdef SM_ENABLED
+  // the other harts only program their own PMPs, so they can do it in
+  // parallel once this is done
+  sm_init_global();
+  boot_profile_mark(BOOT_PROFILE_SM_GLOBAL);
+#endif
 
   wake_harts();
+  boot_profile_mark(BOOT_PROFILE_WAKE_HARTS);
 
   plic_init();
   hart_plic_init();
+  boot_profile_mark(BOOT_PROFILE_PLIC_INIT);
+#ifdef PK_ENABLE_UART_TX_IRQ
+  uart_tx_irq_init();
+#endif
   //prci_test();
   memory_init();
   boot_loader(dtb);
@@ -170,11 +223,15 @@ void init_first_hart(uintptr_t hartid, uintptr_t dtb)
 
 void init_other_hart(uintptr_t hartid, uintptr_t dtb)
 {
+  boot_profile_mark(BOOT_PROFILE_ENTRY);
   hart_init();
+  boot_profile_mark(BOOT_PROFILE_HART_INIT);
   hart_plic_init();
+  boot_profile_mark(BOOT_PROFILE_PLIC_INIT);
   boot_other_hart(dtb);
 }
-void enter_supervisor_mode(void (*fn)(uintptr_t), uintptr_t arg0, uintptr_t arg1)
+// M-mode setup a hart needs once before it first runs S-mode code
+void supervisor_mode_init()
 {
   // Set up a PMP to permit access to all of memory.
   // Ignore the illegal-instruction trap if PMPs aren't supported.
@@ -186,19 +243,29 @@ void enter_supervisor_mode(void (*fn)(uintptr_t), uintptr_t arg0, uintptr_t arg1
                 ".align 2\n\t"
                 "1: csrw mtvec, t0"
                 : : "r" (pmpc), "r" (-1UL) : "t0");
-  
+
+#ifdef SM_ENABLED
+	printm("initializing sm\r\n");
+	sm_init();
+	printm("initialized sm\r\n");
+#endif
+  boot_profile_mark(BOOT_PROFILE_SM_INIT);
+}
+
+void enter_supervisor_mode(void (*fn)(uintptr_t), uintptr_t arg0, uintptr_t arg1)
+{
+  supervisor_mode_init();
+
 	uintptr_t mstatus = read_csr(mstatus);
   mstatus = INSERT_FIELD(mstatus, MSTATUS_MPP, PRV_S);
   mstatus = INSERT_FIELD(mstatus, MSTATUS_MPIE, 0);
   write_csr(mstatus, mstatus);
   write_csr(mscratch, MACHINE_STACK_TOP() - MENTRY_FRAME_SIZE);
   write_csr(mepc, fn);
+  boot_profile_enter_supervisor();
+  // S-mode drives the console itself from here on
+  console_flush();
 
-#ifdef SM_ENABLED
-	printm("initializing sm\r\n");
-	sm_init();
-	printm("initialized sm\r\n");
-#endif
   register uintptr_t a0 asm ("a0") = arg0;
   register uintptr_t a1 asm ("a1") = arg1;
 	asm volatile ("mret" : : "r" (a0), "r" (a1));
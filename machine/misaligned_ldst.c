@@ -4,6 +4,8 @@
 #include "mtrap.h"
 #include "config.h"
 #include "pk.h"
+#include "pmu.h"
+#include "trap_profile.h"
 
 union byte_array {
   uint8_t bytes[8];
@@ -11,15 +13,14 @@ union byte_array {
   uint64_t int64;
 };
 
-void misaligned_load_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
-{
-  union byte_array val;
-  uintptr_t mstatus;
-  insn_t insn = get_insn(mepc, &mstatus);
-  uintptr_t npc = mepc + insn_len(insn);
-  uintptr_t addr = read_csr(mbadaddr);
+#define RD(insn) ((((insn) >> SH_RD) & 0x1f) << SH_RD)
+#define RS2(insn) ((((insn) >> SH_RS2) & 0x1f) << SH_RS2)
 
+static int decode_misaligned_load(insn_t insn, struct decoded_insn* d)
+{
   int shift = 0, fp = 0, len;
+  insn_t reg = RD(insn);
+
   if ((insn & MASK_LW) == MATCH_LW)
     len = 4, shift = 8*(sizeof(uintptr_t) - len);
 #if __riscv_xlen == 64
@@ -41,53 +42,42 @@ void misaligned_load_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 #ifdef __riscv_compressed
 # if __riscv_xlen >= 64
   else if ((insn & MASK_C_LD) == MATCH_C_LD)
-    len = 8, shift = 8*(sizeof(uintptr_t) - len), insn = RVC_RS2S(insn) << SH_RD;
+    len = 8, shift = 8*(sizeof(uintptr_t) - len), reg = RVC_RS2S(insn) << SH_RD;
   else if ((insn & MASK_C_LDSP) == MATCH_C_LDSP && ((insn >> SH_RD) & 0x1f))
     len = 8, shift = 8*(sizeof(uintptr_t) - len);
 # endif
   else if ((insn & MASK_C_LW) == MATCH_C_LW)
-    len = 4, shift = 8*(sizeof(uintptr_t) - len), insn = RVC_RS2S(insn) << SH_RD;
+    len = 4, shift = 8*(sizeof(uintptr_t) - len), reg = RVC_RS2S(insn) << SH_RD;
   else if ((insn & MASK_C_LWSP) == MATCH_C_LWSP && ((insn >> SH_RD) & 0x1f))
     len = 4, shift = 8*(sizeof(uintptr_t) - len);
 # ifdef PK_ENABLE_FP_EMULATION
   else if ((insn & MASK_C_FLD) == MATCH_C_FLD)
-    fp = 1, len = 8, insn = RVC_RS2S(insn) << SH_RD;
+    fp = 1, len = 8, reg = RVC_RS2S(insn) << SH_RD;
   else if ((insn & MASK_C_FLDSP) == MATCH_C_FLDSP)
     fp = 1, len = 8;
 #  if __riscv_xlen == 32
   else if ((insn & MASK_C_FLW) == MATCH_C_FLW)
-    fp = 1, len = 4, insn = RVC_RS2S(insn) << SH_RD;
+    fp = 1, len = 4, reg = RVC_RS2S(insn) << SH_RD;
   else if ((insn & MASK_C_FLWSP) == MATCH_C_FLWSP)
     fp = 1, len = 4;
 #  endif
 # endif
 #endif
   else
-    return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
-
-  val.int64 = 0;
-  for (intptr_t i = 0; i < len; i++)
-    val.bytes[i] = load_uint8_t((void *)(addr + i), mepc);
+    return -1;
 
-  if (!fp)
-    SET_RD(insn, regs, (intptr_t)val.intx << shift >> shift);
-  else if (len == 8)
-    SET_F64_RD(insn, regs, val.int64);
-  else
-    SET_F32_RD(insn, regs, val.intx);
-
-  write_csr(mepc, npc);
+  d->reg = reg;
+  d->len = len;
+  d->shift = shift;
+  d->fp = fp;
+  return 0;
 }
 
-void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
+static int decode_misaligned_store(insn_t insn, struct decoded_insn* d)
 {
-  union byte_array val;
-  uintptr_t mstatus;
-  insn_t insn = get_insn(mepc, &mstatus);
-  uintptr_t npc = mepc + insn_len(insn);
-  int len;
+  int fp = 0, len;
+  insn_t reg = RS2(insn);
 
-  val.intx = GET_RS2(insn, regs);
   if ((insn & MASK_SW) == MATCH_SW)
     len = 4;
 #if __riscv_xlen == 64
@@ -96,42 +86,203 @@ void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 #endif
 #ifdef PK_ENABLE_FP_EMULATION
   else if ((insn & MASK_FSD) == MATCH_FSD)
-    len = 8, val.int64 = GET_F64_RS2(insn, regs);
+    fp = 1, len = 8;
   else if ((insn & MASK_FSW) == MATCH_FSW)
-    len = 4, val.intx = GET_F32_RS2(insn, regs);
+    fp = 1, len = 4;
 #endif
   else if ((insn & MASK_SH) == MATCH_SH)
     len = 2;
 #ifdef __riscv_compressed
 # if __riscv_xlen >= 64
   else if ((insn & MASK_C_SD) == MATCH_C_SD)
-    len = 8, val.intx = GET_RS2S(insn, regs);
+    len = 8, reg = RVC_RS2S(insn) << SH_RS2;
   else if ((insn & MASK_C_SDSP) == MATCH_C_SDSP && ((insn >> SH_RD) & 0x1f))
-    len = 8, val.intx = GET_RS2C(insn, regs);
+    len = 8, reg = RVC_RS2(insn) << SH_RS2;
 # endif
   else if ((insn & MASK_C_SW) == MATCH_C_SW)
-    len = 4, val.intx = GET_RS2S(insn, regs);
+    len = 4, reg = RVC_RS2S(insn) << SH_RS2;
   else if ((insn & MASK_C_SWSP) == MATCH_C_SWSP && ((insn >> SH_RD) & 0x1f))
-    len = 4, val.intx = GET_RS2C(insn, regs);
+    len = 4, reg = RVC_RS2(insn) << SH_RS2;
 # ifdef PK_ENABLE_FP_EMULATION
   else if ((insn & MASK_C_FSD) == MATCH_C_FSD)
-    len = 8, val.int64 = GET_F64_RS2S(insn, regs);
+    fp = 1, len = 8, reg = RVC_RS2S(insn) << SH_RS2;
   else if ((insn & MASK_C_FSDSP) == MATCH_C_FSDSP)
-    len = 8, val.int64 = GET_F64_RS2C(insn, regs);
+    fp = 1, len = 8, reg = RVC_RS2(insn) << SH_RS2;
 #  if __riscv_xlen == 32
   else if ((insn & MASK_C_FSW) == MATCH_C_FSW)
-    len = 4, val.intx = GET_F32_RS2S(insn, regs);
+    fp = 1, len = 4, reg = RVC_RS2S(insn) << SH_RS2;
   else if ((insn & MASK_C_FSWSP) == MATCH_C_FSWSP)
-    len = 4, val.intx = GET_F32_RS2C(insn, regs);
+    fp = 1, len = 4, reg = RVC_RS2(insn) << SH_RS2;
 #  endif
 # endif
 #endif
   else
+    return -1;
+
+  d->reg = reg;
+  d->len = len;
+  d->shift = 0;
+  d->fp = fp;
+  return 0;
+}
+
+// Both words an access at 'addr' touches, in one MPRV window
+static inline uintptr_t load_aligned_pair(uintptr_t addr, uintptr_t* hi,
+                                          uintptr_t mepc)
+{
+  register uintptr_t __mepc asm ("a2") = mepc;
+  register uintptr_t __mstatus asm ("a3");
+  uintptr_t lo;
+  asm volatile ("csrrs %[mstatus], mstatus, %[mprv]\n"
+                STR(LOAD) " %[lo], 0(%[addr])\n"
+                STR(LOAD) " %[hi], %[size](%[addr])\n"
+                "csrw mstatus, %[mstatus]"
+                : [mstatus] "+&r" (__mstatus), [lo] "=&r" (lo), [hi] "=&r" (*hi)
+                : [addr] "r" (addr), [mprv] "r" (MSTATUS_MPRV),
+                  [size] "i" (sizeof(uintptr_t)), "r" (__mepc));
+  return lo;
+}
+
+// Store the low 'len' bytes of 'val' at 'addr' as naturally aligned
+// pieces (at most four), in one MPRV window. Unlike a read-modify-write of
+// the enclosing words, this never writes bytes outside the access, so it
+// can't undo a racing store by another hart to a neighbouring field.
+static inline void store_aligned_pieces(uintptr_t addr, uintptr_t val,
+                                        uintptr_t len, uintptr_t mepc)
+{
+  register uintptr_t __mepc asm ("a2") = mepc;
+  register uintptr_t __mstatus asm ("a3");
+  uintptr_t tmp;
+  asm volatile ("csrrs %[mstatus], mstatus, %[mprv]\n"
+                "1: beqz %[len], 9f\n"
+                "andi %[tmp], %[addr], 1\n"
+                "bnez %[tmp], 2f\n"
+                "andi %[tmp], %[len], -2\n"
+                "beqz %[tmp], 2f\n"
+                "andi %[tmp], %[addr], 2\n"
+                "bnez %[tmp], 3f\n"
+                "andi %[tmp], %[len], -4\n"
+                "beqz %[tmp], 3f\n"
+#if __riscv_xlen == 64
+                "andi %[tmp], %[addr], 4\n"
+                "bnez %[tmp], 4f\n"
+                "andi %[tmp], %[len], -8\n"
+                "beqz %[tmp], 4f\n"
+                "sd %[val], 0(%[addr])\n"
+                "li %[tmp], 8\n"
+                "j 8f\n"
+#endif
+                "4: sw %[val], 0(%[addr])\n"
+                "li %[tmp], 4\n"
+                "j 8f\n"
+                "3: sh %[val], 0(%[addr])\n"
+                "li %[tmp], 2\n"
+                "j 8f\n"
+                "2: sb %[val], 0(%[addr])\n"
+                "li %[tmp], 1\n"
+                "8: add %[addr], %[addr], %[tmp]\n"
+                "sub %[len], %[len], %[tmp]\n"
+                "slli %[tmp], %[tmp], 3\n"
+                "srl %[val], %[val], %[tmp]\n"
+                "j 1b\n"
+                "9: csrw mstatus, %[mstatus]"
+                : [mstatus] "+&r" (__mstatus), [addr] "+&r" (addr),
+                  [val] "+&r" (val), [len] "+&r" (len), [tmp] "=&r" (tmp)
+                : [mprv] "r" (MSTATUS_MPRV), "r" (__mepc)
+                : "memory");
+}
+
+// The fast paths read or write whole aligned words, so they are only used
+// when the access stays within one page: it then can't fault on, or touch,
+// a page the byte-by-byte path wouldn't have.
+static inline int misaligned_fast(uintptr_t addr, uintptr_t len)
+{
+  return len <= sizeof(uintptr_t) && (addr ^ (addr + len - 1)) < RISCV_PGSIZE;
+}
+
+void misaligned_load_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
+{
+  union byte_array val;
+  uintptr_t mstatus;
+  insn_t insn = get_insn(mepc, &mstatus);
+  uintptr_t npc = mepc + insn_len(insn);
+  uintptr_t addr = read_csr(mbadaddr);
+  int hit;
+  // keyed on the cause this decodes for: emulate_rvc() calls here too
+  struct decoded_insn* d =
+    decode_cache_lookup(CAUSE_MISALIGNED_LOAD, mepc, insn, &hit);
+
+  pmu_fw_count(SBI_PMU_FW_MISALIGNED_LOAD);
+
+  if (!hit && decode_misaligned_load(insn, d)) {
+    d->mepc = 0;
+    return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
+  }
+
+  uintptr_t len = d->len;
+  if (misaligned_fast(addr, len)) {
+    uintptr_t off = addr % sizeof(uintptr_t), base = addr - off;
+    if (off + len <= sizeof(uintptr_t)) {
+      val.intx = load_uintptr_t((uintptr_t*)base, mepc) >> (8 * off);
+    } else {
+      uintptr_t hi, lo = load_aligned_pair(base, &hi, mepc);
+      val.intx = lo >> (8 * off) | hi << (8 * (sizeof(uintptr_t) - off));
+    }
+    if (len < sizeof(uintptr_t))
+      val.intx &= ((uintptr_t)1 << (8 * len)) - 1;
+  } else {
+    val.int64 = 0;
+    for (intptr_t i = 0; i < len; i++)
+      val.bytes[i] = load_uint8_t((void *)(addr + i), mepc);
+  }
+
+  if (!d->fp)
+    SET_RD(d->reg, regs, (intptr_t)val.intx << d->shift >> d->shift);
+  else if (len == 8)
+    SET_F64_RD(d->reg, regs, val.int64);
+  else
+    SET_F32_RD(d->reg, regs, val.intx);
+
+  write_csr(mepc, npc);
+  trap_hotspot_record(mcause, mepc);
+}
+
+void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
+{
+  union byte_array val;
+  uintptr_t mstatus;
+  insn_t insn = get_insn(mepc, &mstatus);
+  uintptr_t npc = mepc + insn_len(insn);
+  int hit;
+  struct decoded_insn* d =
+    decode_cache_lookup(CAUSE_MISALIGNED_STORE, mepc, insn, &hit);
+
+  pmu_fw_count(SBI_PMU_FW_MISALIGNED_STORE);
+
+  if (!hit && decode_misaligned_store(insn, d)) {
+    d->mepc = 0;
     return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
+  }
+
+  uintptr_t len = d->len;
+  val.int64 = 0;
+  if (!d->fp)
+    val.intx = GET_RS2(d->reg, regs);
+#ifdef PK_ENABLE_FP_EMULATION
+  else if (len == 8)
+    val.int64 = GET_F64_RS2(d->reg, regs);
+  else
+    val.intx = GET_F32_RS2(d->reg, regs);
+#endif
 
   uintptr_t addr = read_csr(mbadaddr);
-  for (int i = 0; i < len; i++)
-    store_uint8_t((void *)(addr + i), val.bytes[i], mepc);
+  if (misaligned_fast(addr, len)) {
+    store_aligned_pieces(addr, val.intx, len, mepc);
+  } else {
+    for (int i = 0; i < len; i++)
+      store_uint8_t((void *)(addr + i), val.bytes[i], mepc);
+  }
 
   write_csr(mepc, npc);
+  trap_hotspot_record(mcause, mepc);
 }
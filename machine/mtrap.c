@@ -10,14 +10,47 @@
 #include "fdt.h"
 #include "unprivileged_memory.h"
 #include "disabled_hart_mask.h"
+#include "hsm.h"
+#include "pmu.h"
+#include "trap_profile.h"
+#include "emulation.h"
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifdef SM_ENABLED
 #include "sm.h"
+#include "cpu.h"
+#include "mprv.h"
 #endif
 
+// mentry.S reaches these through the MENTRY_*_OFFSET constants
+_Static_assert(sizeof(hls_t) <= HLS_SIZE, "hls_t does not fit HLS_SIZE");
+_Static_assert(MENTRY_HLS_OFFSET + offsetof(hls_t, sfence_start) == MENTRY_SFENCE_START_OFFSET &&
+               MENTRY_HLS_OFFSET + offsetof(hls_t, sfence_size) == MENTRY_SFENCE_SIZE_OFFSET &&
+               MENTRY_HLS_OFFSET + offsetof(hls_t, sfence_asid) == MENTRY_SFENCE_ASID_OFFSET &&
+               MENTRY_HLS_OFFSET + offsetof(hls_t, sfence_busy) == MENTRY_SFENCE_BUSY_OFFSET &&
+               MENTRY_HLS_OFFSET + offsetof(hls_t, ipi_acks) == MENTRY_IPI_ACKS_OFFSET &&
+               MENTRY_HLS_OFFSET + offsetof(hls_t, prof_vector) == MENTRY_PROF_VECTOR_OFFSET &&
+               MENTRY_HLS_OFFSET + offsetof(hls_t, prof_start) == MENTRY_PROF_START_OFFSET,
+               "hls_t layout does not match mentry.S");
+
+// IPIs each hart has sent and that are not handled yet. The sender counts
+// what it sent to each target; each target counts what it handled for that
+// sender in its own slot from mentry.S. Every slot has a single writer, so
+// this needs no AMOs, and a waiting sender spins on its own cache line only.
+struct ipi_completion {
+  volatile unsigned acked[MAX_HARTS];
+  unsigned sent[MAX_HARTS];
+} __attribute__((aligned(IPI_COMPLETION_STRIDE)));
+
+_Static_assert(sizeof(struct ipi_completion) == IPI_COMPLETION_STRIDE &&
+               offsetof(struct ipi_completion, acked) == 0,
+               "mentry.S indexes ipi_completion by IPI_COMPLETION_STRIDE");
+
+struct ipi_completion ipi_completion[MAX_HARTS];
+
 hls_t *get_hls()
 {
   return HLS();
@@ -40,10 +73,41 @@ uintptr_t mcall_console_putchar(uint8_t ch)
   return 0;
 }
 
+static void console_write(const char* buf, size_t len)
+{
+  if (uart) {
+    uart_write(buf, len);
+  } else if (uart16550) {
+    uart16550_write(buf, len);
+  } else if (htif) {
+    htif_console_write(buf, len);
+  }
+}
+
+// Push out what the console drivers have buffered, if they can take it
+static void console_drain()
+{
+  if (uart)
+    uart_drain();
+  else if (uart16550)
+    uart16550_drain();
+  else if (htif)
+    htif_console_drain();
+}
+
+void console_flush()
+{
+  if (uart)
+    uart_flush();
+  else if (uart16550)
+    uart16550_flush();
+  else if (htif)
+    htif_console_flush();
+}
+
 void putstring(const char* s)
 {
-  while (*s)
-    mcall_console_putchar(*s++);
+  console_write(s, strlen(s));
 }
 
 void vprintm(const char* s, va_list vl)
@@ -66,6 +130,12 @@ static void send_ipi(uintptr_t recipient, int event)
 {
   if (((disabled_hart_mask >> recipient) & 1)) return;
   atomic_or(&OTHER_HLS(recipient)->mipi_pending, event);
+  if (event != IPI_SOFT) {
+    // the cause goes first: see the ack mask handling in mentry.S
+    int me = 1 << read_csr(mhartid);
+    if (!(atomic_or(&OTHER_HLS(recipient)->ipi_acks, me) & me))
+      ipi_completion[read_csr(mhartid)].sent[recipient]++;
+  }
   mb();
   *OTHER_HLS(recipient)->ipi = 1;
 }
@@ -95,203 +165,827 @@ static uintptr_t mcall_shutdown()
 
 static uintptr_t mcall_set_timer(uint64_t when)
 {
+  pmu_fw_count(SBI_PMU_FW_SET_TIMER);
   *HLS()->timecmp = when;
   clear_csr(mip, MIP_STIP);
   set_csr(mie, MIP_MTIP);
   return 0;
 }
-static void send_ipi_many(uintptr_t* pmask, int event)
+// Handle our own IPIs from C, the way mentry.S does, while we wait for
+// other harts with interrupts off: they may be waiting for us in turn.
+void handle_ipi_in_machine_mode()
+{
+  if (!*HLS()->ipi)
+    return;
+
+  *HLS()->ipi = 0;
+  mb();
+  int acks = atomic_swap(&HLS()->ipi_acks, 0);
+  int pending = atomic_swap(&HLS()->mipi_pending, 0);
+
+  if (pending & IPI_SOFT)
+    set_csr(mip, MIP_SSIP);
+  if (pending & IPI_FENCE_I)
+    asm volatile ("fence.i");
+  if (pending & IPI_SFENCE_VMA)
+    asm volatile ("sfence.vma");
+  if (pending & IPI_SFENCE_VMA_RANGE) {
+    uintptr_t va = HLS()->sfence_start, end = va + HLS()->sfence_size;
+    uintptr_t asid = HLS()->sfence_asid;
+    for (; va < end; va += RISCV_PGSIZE) {
+      if ((intptr_t)asid < 0)
+        asm volatile ("sfence.vma %0" : : "r" (va));
+      else
+        asm volatile ("sfence.vma %0, %1" : : "r" (va), "r" (asid));
+    }
+    mb();
+    HLS()->sfence_busy = 0;
+  }
+
+  mb();
+  uintptr_t me = read_csr(mhartid);
+  for (uintptr_t i = 0; acks; i++, acks >>= 1)
+    if (acks & 1)
+      ipi_completion[i].acked[me]++;
+
+  if (pending & IPI_HALT)
+    while (1)
+      wfi();
+#ifdef SM_ENABLED
+  if (pending & IPI_PMP)
+    pmp_ipi_update();
+#endif
+}
+
+static int ipi_outstanding()
+{
+  struct ipi_completion* c = &ipi_completion[read_csr(mhartid)];
+  unsigned outstanding = 0;
+  for (int i = 0; i < MAX_HARTS; i++)
+    outstanding += c->sent[i] - c->acked[i];
+  return outstanding;
+}
+
+static void wait_ipi_many()
+{
+  while (ipi_outstanding())
+    handle_ipi_in_machine_mode();
+}
+
+static void post_ipi_many(uintptr_t mask, int event)
 {
-  _Static_assert(MAX_HARTS <= 8 * sizeof(*pmask), "# harts > uintptr_t bits");
-  uintptr_t mask = hart_mask;
-  if (pmask)
-    mask &= load_uintptr_t(pmask, read_csr(mepc));
+  _Static_assert(MAX_HARTS <= 8 * sizeof(mask), "# harts > uintptr_t bits");
+
+  if (event == IPI_SOFT)
+    pmu_fw_count(SBI_PMU_FW_IPI_SENT);
+  else if (event == IPI_FENCE_I)
+    pmu_fw_count(SBI_PMU_FW_FENCE_I_SENT);
 
   // send IPIs to everyone
   for (uintptr_t i = 0, m = mask; m; i++, m >>= 1)
     if (m & 1)
       send_ipi(i, event);
+}
 
-  if (event == IPI_SOFT)
-    return;
+static void send_ipi_many(uintptr_t mask, int event)
+{
+  post_ipi_many(mask, event);
+  if (event != IPI_SOFT)
+    wait_ipi_many();
+}
 
-  // wait until all events have been handled.
-  // prevent deadlock by consuming incoming IPIs.
-  uint32_t incoming_ipi = 0;
-  for (uintptr_t i = 0, m = mask; m; i++, m >>= 1)
-    if (m & 1)
-      while (*OTHER_HLS(i)->ipi)
-        incoming_ipi |= atomic_swap(HLS()->ipi, 0);
+static int sfence_vma_is_full(uintptr_t start, uintptr_t size)
+{
+  return (start == 0 && size == 0) || size == (uintptr_t)-1 ||
+         size > SFENCE_VMA_RANGE_MAX || start + size < start;
+}
 
-  // if we got an IPI, restore it; it will be taken after returning
-  if (incoming_ipi) {
-    *HLS()->ipi = incoming_ipi;
-    mb();
+// Remote sfence.vma of [start, start + size) in 'asid' (-1: all of them).
+// Each target takes the range from its HLS slot and flushes page by page;
+// if the slot is still busy with an earlier request, or the range is too
+// large to be worth it, the target does a full flush instead.
+static void post_sfence_vma_many(uintptr_t mask, uintptr_t start,
+                                 uintptr_t size, uintptr_t asid)
+{
+  pmu_fw_count(asid == (uintptr_t)-1 ? SBI_PMU_FW_SFENCE_VMA_SENT
+                                     : SBI_PMU_FW_SFENCE_VMA_ASID_SENT);
+  if (sfence_vma_is_full(start, size))
+    return post_ipi_many(mask, IPI_SFENCE_VMA);
+
+  uintptr_t end = start + size;
+  start &= ~(uintptr_t)(RISCV_PGSIZE - 1);
+
+  for (uintptr_t i = 0, m = mask; m; i++, m >>= 1) {
+    if (!(m & 1) || ((disabled_hart_mask >> i) & 1))
+      continue;
+
+    hls_t* hls = OTHER_HLS(i);
+    if (atomic_cas(&hls->sfence_busy, 0, 1) == 0) {
+      hls->sfence_start = start;
+      hls->sfence_size = end - start;
+      hls->sfence_asid = asid;
+      send_ipi(i, IPI_SFENCE_VMA_RANGE);
+    } else {
+      send_ipi(i, IPI_SFENCE_VMA);
+    }
   }
 }
 
+static void send_sfence_vma_many(uintptr_t mask, uintptr_t start,
+                                 uintptr_t size, uintptr_t asid)
+{
+  post_sfence_vma_many(mask, start, size, asid);
+  wait_ipi_many();
+}
+
+// v0.1 calls pass the hart mask by reference; NULL means all harts
+static uintptr_t sbi_legacy_hart_mask(uintptr_t pmask)
+{
+  if (!pmask)
+    return hart_mask;
+  return hart_mask & load_uintptr_t((uintptr_t*)pmask, read_csr(mepc));
+}
 
-void mcall_trap_enclave(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
+// v0.2 calls pass it by value, relative to a base hart ID; a base of -1
+// means all harts. Returns -1 if the mask names a hart that isn't there.
+static uintptr_t sbi_hart_mask(uintptr_t mask, uintptr_t base)
 {
-  uintptr_t n = regs[17], arg0 = regs[10], arg1 = regs[11], arg2 = regs[12], arg3 = regs[13], retval, ipi_type;
+  if (base == (uintptr_t)-1)
+    return hart_mask;
+  if (base >= __riscv_xlen || ((mask << base) >> base) != mask ||
+      ((mask << base) & ~hart_mask))
+    return -1;
+  return mask << base;
+}
 
-  switch (n)
-  {
-    case SBI_CONSOLE_PUTCHAR:
-      retval = mcall_console_putchar(arg0);
-      break;
-    case SBI_CONSOLE_GETCHAR:
-      retval = mcall_console_getchar();
-      break;
-    case SBI_SEND_IPI:
-      ipi_type = IPI_SOFT;
-      goto send_ipi;
-    case SBI_REMOTE_SFENCE_VMA:
-    case SBI_REMOTE_SFENCE_VMA_ASID:
-      ipi_type = IPI_SFENCE_VMA;
-      goto send_ipi;
-    case SBI_REMOTE_FENCE_I:
-      ipi_type = IPI_FENCE_I;
-send_ipi:
-      send_ipi_many((uintptr_t*)arg0, ipi_type);
-      retval = 0;
-      break;
-    case SBI_CLEAR_IPI:
-      retval = mcall_clear_ipi();
-      break;
-    case SBI_SHUTDOWN:
-      retval = mcall_shutdown();
-      break;
-    case SBI_SET_TIMER:
+/* SBI dispatch
+ *
+ * Legacy (v0.1) and SM calls are found by indexing their tables with a7
+ * directly. v0.2-style extensions are looked up by EID in a short table,
+ * most frequently called first, and indexed by the function ID in a6.
+ * Handlers get the saved registers and return the value for a0; the
+ * permission mask says which context (host or enclave) may make the call
+ * and is checked here only.
+ */
+#define SBI_PERM_HOST     0x1
+#define SBI_PERM_ENCLAVE  0x2
+#define SBI_PERM_ANY      (SBI_PERM_HOST | SBI_PERM_ENCLAVE)
+
+typedef uintptr_t (*sbi_handler_t)(uintptr_t* regs);
+
+struct sbi_call {
+  sbi_handler_t handler;
+  uintptr_t perm;
+};
+
+struct sbi_extension {
+  uintptr_t id;      /* EID (a7) */
+  uintptr_t n_calls; /* indexed by FID (a6) */
+  const struct sbi_call* calls;
+};
+
+#define SBI_CALLS(calls) (sizeof(calls) / sizeof((calls)[0]))
+
+static uintptr_t sbi_console_putchar(uintptr_t* regs)
+{
+  return mcall_console_putchar(regs[10]);
+}
+
+static uintptr_t sbi_console_getchar(uintptr_t* regs)
+{
+  return mcall_console_getchar();
+}
+
+static uintptr_t sbi_clear_ipi(uintptr_t* regs)
+{
+  return mcall_clear_ipi();
+}
+
+static uintptr_t sbi_send_ipi(uintptr_t* regs)
+{
+  send_ipi_many(sbi_legacy_hart_mask(regs[10]), IPI_SOFT);
+  return 0;
+}
+
+static uintptr_t sbi_remote_fence_i(uintptr_t* regs)
+{
+  send_ipi_many(sbi_legacy_hart_mask(regs[10]), IPI_FENCE_I);
+  return 0;
+}
+
+static uintptr_t sbi_remote_sfence_vma(uintptr_t* regs)
+{
+  send_sfence_vma_many(sbi_legacy_hart_mask(regs[10]), regs[11], regs[12], -1);
+  return 0;
+}
+
+static uintptr_t sbi_remote_sfence_vma_asid(uintptr_t* regs)
+{
+  send_sfence_vma_many(sbi_legacy_hart_mask(regs[10]), regs[11], regs[12],
+                       regs[13]);
+  return 0;
+}
+
+static uintptr_t sbi_shutdown(uintptr_t* regs)
+{
+  return mcall_shutdown();
+}
+
+static uintptr_t sbi_set_timer(uintptr_t* regs)
+{
 #if __riscv_xlen == 32
-      retval = mcall_set_timer(arg0 + ((uint64_t)arg1 << 32));
+  return mcall_set_timer(regs[10] + ((uint64_t)regs[11] << 32));
 #else
-      retval = mcall_set_timer(arg0);
+  return mcall_set_timer(regs[10]);
 #endif
-      break;
+}
+
+static const struct sbi_call sbi_legacy_calls[] = {
+  [SBI_SET_TIMER]              = { sbi_set_timer,         SBI_PERM_ANY },
+  [SBI_CONSOLE_PUTCHAR]        = { sbi_console_putchar,   SBI_PERM_ANY },
+  [SBI_CONSOLE_GETCHAR]        = { sbi_console_getchar,   SBI_PERM_ANY },
+  [SBI_CLEAR_IPI]              = { sbi_clear_ipi,         SBI_PERM_ANY },
+  [SBI_SEND_IPI]               = { sbi_send_ipi,          SBI_PERM_ANY },
+  [SBI_REMOTE_FENCE_I]         = { sbi_remote_fence_i,    SBI_PERM_ANY },
+  [SBI_REMOTE_SFENCE_VMA]      = { sbi_remote_sfence_vma, SBI_PERM_ANY },
+  [SBI_REMOTE_SFENCE_VMA_ASID] = { sbi_remote_sfence_vma_asid, SBI_PERM_ANY },
+  [SBI_SHUTDOWN]               = { sbi_shutdown,          SBI_PERM_ANY },
+};
+
+/* v0.2 extensions: handlers return the error code and leave the value
+ * in regs[11] (a1) */
+static int sbi_probe_extension(uintptr_t eid);
+
+static uintptr_t sbi_base_get_spec_version(uintptr_t* regs)
+{
+  regs[11] = SBI_SPEC_VERSION;
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_base_get_impl_id(uintptr_t* regs)
+{
+  regs[11] = SBI_IMPL_ID_BBL;
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_base_get_impl_version(uintptr_t* regs)
+{
+  regs[11] = 0;
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_base_probe_extension(uintptr_t* regs)
+{
+  regs[11] = sbi_probe_extension(regs[10]);
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_base_get_mvendorid(uintptr_t* regs)
+{
+  regs[11] = read_csr(mvendorid);
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_base_get_marchid(uintptr_t* regs)
+{
+  regs[11] = read_csr(marchid);
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_base_get_mimpid(uintptr_t* regs)
+{
+  regs[11] = read_csr(mimpid);
+  return SBI_SUCCESS;
+}
+
+static const struct sbi_call sbi_base_calls[] = {
+  [SBI_EXT_BASE_GET_SPEC_VERSION] = { sbi_base_get_spec_version, SBI_PERM_ANY },
+  [SBI_EXT_BASE_GET_IMPL_ID]      = { sbi_base_get_impl_id,      SBI_PERM_ANY },
+  [SBI_EXT_BASE_GET_IMPL_VERSION] = { sbi_base_get_impl_version, SBI_PERM_ANY },
+  [SBI_EXT_BASE_PROBE_EXT]        = { sbi_base_probe_extension,  SBI_PERM_ANY },
+  [SBI_EXT_BASE_GET_MVENDORID]    = { sbi_base_get_mvendorid,    SBI_PERM_ANY },
+  [SBI_EXT_BASE_GET_MARCHID]      = { sbi_base_get_marchid,      SBI_PERM_ANY },
+  [SBI_EXT_BASE_GET_MIMPID]       = { sbi_base_get_mimpid,       SBI_PERM_ANY },
+};
+
+static uintptr_t sbi_rfence_fence_i(uintptr_t* regs)
+{
+  uintptr_t mask = sbi_hart_mask(regs[10], regs[11]);
+  if (mask == (uintptr_t)-1)
+    return SBI_ERR_INVALID_PARAM;
+  send_ipi_many(mask, IPI_FENCE_I);
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_rfence_sfence_vma(uintptr_t* regs)
+{
+  uintptr_t mask = sbi_hart_mask(regs[10], regs[11]);
+  if (mask == (uintptr_t)-1)
+    return SBI_ERR_INVALID_PARAM;
+  send_sfence_vma_many(mask, regs[12], regs[13], -1);
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_rfence_sfence_vma_asid(uintptr_t* regs)
+{
+  uintptr_t mask = sbi_hart_mask(regs[10], regs[11]);
+  if (mask == (uintptr_t)-1)
+    return SBI_ERR_INVALID_PARAM;
+  send_sfence_vma_many(mask, regs[12], regs[13], regs[14]);
+  return SBI_SUCCESS;
+}
+
+/* the hypervisor fences (FIDs 3-6) are left out: no H extension here */
+static const struct sbi_call sbi_rfence_calls[] = {
+  [SBI_EXT_RFENCE_REMOTE_FENCE_I]         = { sbi_rfence_fence_i,         SBI_PERM_ANY },
+  [SBI_EXT_RFENCE_REMOTE_SFENCE_VMA]      = { sbi_rfence_sfence_vma,      SBI_PERM_ANY },
+  [SBI_EXT_RFENCE_REMOTE_SFENCE_VMA_ASID] = { sbi_rfence_sfence_vma_asid, SBI_PERM_ANY },
+};
+
+#ifdef PK_ENABLE_SBI_HSM
+static uintptr_t sbi_hsm_hart_start(uintptr_t* regs)
+{
+  return mcall_hsm_hart_start(regs[10], regs[11], regs[12]);
+}
+
+static uintptr_t sbi_hsm_hart_stop(uintptr_t* regs)
+{
+  return mcall_hsm_hart_stop();
+}
+
+static uintptr_t sbi_hsm_hart_get_status(uintptr_t* regs)
+{
+  return mcall_hsm_hart_get_status(regs[10], &regs[11]);
+}
+
+static uintptr_t sbi_hsm_hart_suspend(uintptr_t* regs)
+{
+  return mcall_hsm_hart_suspend(regs[10], regs[11], regs[12]);
+}
+
+/* an enclave must not stop or park the hart it runs on */
+static const struct sbi_call sbi_hsm_calls[] = {
+  [SBI_EXT_HSM_HART_START]      = { sbi_hsm_hart_start,      SBI_PERM_HOST },
+  [SBI_EXT_HSM_HART_STOP]       = { sbi_hsm_hart_stop,       SBI_PERM_HOST },
+  [SBI_EXT_HSM_HART_GET_STATUS] = { sbi_hsm_hart_get_status, SBI_PERM_ANY },
+  [SBI_EXT_HSM_HART_SUSPEND]    = { sbi_hsm_hart_suspend,    SBI_PERM_HOST },
+};
+#endif
+
+/* 64-bit arguments take two registers on RV32, low half first */
+#if __riscv_xlen == 32
+# define SBI_ARG64(regs, i) ((regs)[i] | (uint64_t)(regs)[(i) + 1] << 32)
+#else
+# define SBI_ARG64(regs, i) ((regs)[i])
+#endif
+
+static uintptr_t sbi_pmu_num_counters(uintptr_t* regs)
+{
+  regs[11] = mcall_pmu_num_counters();
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_pmu_counter_get_info(uintptr_t* regs)
+{
+  return mcall_pmu_counter_get_info(regs[10], &regs[11]);
+}
+
+static uintptr_t sbi_pmu_counter_cfg_match(uintptr_t* regs)
+{
+  return mcall_pmu_counter_config_matching(regs[10], regs[11], regs[12],
+                                           regs[13], SBI_ARG64(regs, 14),
+                                           &regs[11]);
+}
+
+static uintptr_t sbi_pmu_counter_start(uintptr_t* regs)
+{
+  return mcall_pmu_counter_start(regs[10], regs[11], regs[12],
+                                 SBI_ARG64(regs, 13));
+}
+
+static uintptr_t sbi_pmu_counter_stop(uintptr_t* regs)
+{
+  return mcall_pmu_counter_stop(regs[10], regs[11], regs[12]);
+}
+
+static uintptr_t sbi_pmu_counter_fw_read(uintptr_t* regs)
+{
+  uint64_t value;
+  uintptr_t err = mcall_pmu_counter_fw_read(regs[10], &value);
+  if (err == SBI_SUCCESS)
+    regs[11] = value;
+  return err;
+}
+
+/* the counters are shared by everything running on the hart; enclaves
+ * don't get to program them */
+static const struct sbi_call sbi_pmu_calls[] = {
+  [SBI_EXT_PMU_NUM_COUNTERS]      = { sbi_pmu_num_counters,      SBI_PERM_HOST },
+  [SBI_EXT_PMU_COUNTER_GET_INFO]  = { sbi_pmu_counter_get_info,  SBI_PERM_HOST },
+  [SBI_EXT_PMU_COUNTER_CFG_MATCH] = { sbi_pmu_counter_cfg_match, SBI_PERM_HOST },
+  [SBI_EXT_PMU_COUNTER_START]     = { sbi_pmu_counter_start,     SBI_PERM_HOST },
+  [SBI_EXT_PMU_COUNTER_STOP]      = { sbi_pmu_counter_stop,      SBI_PERM_HOST },
+  [SBI_EXT_PMU_COUNTER_FW_READ]   = { sbi_pmu_counter_fw_read,   SBI_PERM_HOST },
+};
+
+// Buffers passed to v0.2 extensions are given by physical address. With
+// the SM, guest memory is read and written as S-mode would, so PMP keeps
+// enclave and SM memory out of reach; translation is turned off for the
+// copy since the address is physical.
+static int sbi_copy_in(char* dst, uintptr_t src, size_t len)
+{
 #ifdef SM_ENABLED
-    case SBI_SM_CREATE_ENCLAVE:
-      retval = mcall_sm_create_enclave(arg0);
-      break;
-    case SBI_SM_DESTROY_ENCLAVE:
-      retval = mcall_sm_destroy_enclave(arg0);
-      break;
-    case SBI_SM_RUN_ENCLAVE:
-      retval = mcall_sm_run_enclave(regs, arg0);
-      break;
-    case SBI_SM_EXIT_ENCLAVE:
-      retval = mcall_sm_exit_enclave(regs, arg0);
-      break;
-    case SBI_SM_STOP_ENCLAVE:
-      retval = mcall_sm_stop_enclave(regs, arg0);
-      break;
-    case SBI_SM_RESUME_ENCLAVE:
-      retval = mcall_sm_resume_enclave(regs, arg0);
-      break;
-    case SBI_SM_ATTEST_ENCLAVE:
-      retval = mcall_sm_attest_enclave(arg0, arg1, arg2);
-      break;
-    case SBI_SM_GET_SEALING_KEY:
-      retval = mcall_sm_get_sealing_key(arg0, arg1, arg2);
-      break;
-    case SBI_SM_RANDOM:
-      retval = mcall_sm_random();
-      break;
-    case SBI_SM_NOT_IMPLEMENTED:
-      retval = mcall_sm_not_implemented(regs, arg0);
-      break;
+  uintptr_t satp = swap_csr(sptbr, 0);
+  int err = copy_to_sm(dst, src, len);
+  write_csr(sptbr, satp);
+  return err;
+#else
+  if (src < DRAM_BASE || src - DRAM_BASE > mem_size ||
+      len > DRAM_BASE + mem_size - src)
+    return -1;
+  memcpy(dst, (void*)src, len);
+  return 0;
 #endif
-    default:
-      retval = -ENOSYS;
+}
+
+static int sbi_copy_out(uintptr_t dst, char* src, size_t len)
+{
+#ifdef SM_ENABLED
+  uintptr_t satp = swap_csr(sptbr, 0);
+  int err = copy_from_sm(dst, src, len);
+  write_csr(sptbr, satp);
+  return err;
+#else
+  if (dst < DRAM_BASE || dst - DRAM_BASE > mem_size ||
+      len > DRAM_BASE + mem_size - dst)
+    return -1;
+  memcpy((void*)dst, src, len);
+  return 0;
+#endif
+}
+
+/* Debug console: whole buffers per call instead of a trap per character. */
+#define DBCN_CHUNK 256
+
+static struct {
+  unsigned long writes;
+  unsigned long bytes;
+  unsigned long traps_saved; // vs. one SBI_CONSOLE_PUTCHAR per byte
+} dbcn_stats;
+
+static uintptr_t sbi_dbcn_write(uintptr_t* regs)
+{
+  uintptr_t len = regs[10], base = regs[11], done = 0;
+  char buf[DBCN_CHUNK];
+
+  if (regs[12])
+    return SBI_ERR_INVALID_PARAM;
+
+  while (done < len) {
+    size_t n = len - done < DBCN_CHUNK ? len - done : DBCN_CHUNK;
+    if (sbi_copy_in(buf, base + done, n))
       break;
+    console_write(buf, n);
+    done += n;
   }
-  regs[10] = retval;
+  if (len && !done)
+    return SBI_ERR_INVALID_PARAM;
+
+  atomic_add(&dbcn_stats.writes, 1);
+  atomic_add(&dbcn_stats.bytes, done);
+  if (done > 1)
+    atomic_add(&dbcn_stats.traps_saved, done - 1);
+  regs[11] = done;
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_dbcn_read(uintptr_t* regs)
+{
+  uintptr_t len = regs[10], base = regs[11], done = 0;
+  char buf[DBCN_CHUNK];
+  size_t n = 0;
+  int ch;
+
+  if (regs[12])
+    return SBI_ERR_INVALID_PARAM;
+  if (!uart && !uart16550 && !htif)
+    len = 0;
+
+  if (len > DBCN_CHUNK)
+    len = DBCN_CHUNK;
+  while (n < len && (ch = (int)mcall_console_getchar()) >= 0)
+    buf[n++] = ch;
+
+  if (n && sbi_copy_out(base, buf, n))
+    return SBI_ERR_INVALID_PARAM;
+  done = n;
+
+  regs[11] = done;
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_dbcn_write_byte(uintptr_t* regs)
+{
+  mcall_console_putchar(regs[10]);
+  return SBI_SUCCESS;
+}
+
+static const struct sbi_call sbi_dbcn_calls[] = {
+  [SBI_EXT_DBCN_CONSOLE_WRITE]      = { sbi_dbcn_write,      SBI_PERM_ANY },
+  [SBI_EXT_DBCN_CONSOLE_READ]       = { sbi_dbcn_read,       SBI_PERM_ANY },
+  [SBI_EXT_DBCN_CONSOLE_WRITE_BYTE] = { sbi_dbcn_write_byte, SBI_PERM_ANY },
+};
+
+/* bbl's own extension. The async fences return once the IPIs are out;
+ * FENCE_POLL gives the number of this hart's fence IPIs still in flight,
+ * so the caller can overlap the shootdown with other work. */
+static uintptr_t sbi_bbl_fence_i_async(uintptr_t* regs)
+{
+  uintptr_t mask = sbi_hart_mask(regs[10], regs[11]);
+  if (mask == (uintptr_t)-1)
+    return SBI_ERR_INVALID_PARAM;
+  post_ipi_many(mask, IPI_FENCE_I);
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_bbl_sfence_vma_async(uintptr_t* regs)
+{
+  uintptr_t mask = sbi_hart_mask(regs[10], regs[11]);
+  if (mask == (uintptr_t)-1)
+    return SBI_ERR_INVALID_PARAM;
+  post_sfence_vma_many(mask, regs[12], regs[13], -1);
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_bbl_sfence_vma_asid_async(uintptr_t* regs)
+{
+  uintptr_t mask = sbi_hart_mask(regs[10], regs[11]);
+  if (mask == (uintptr_t)-1)
+    return SBI_ERR_INVALID_PARAM;
+  post_sfence_vma_many(mask, regs[12], regs[13], regs[14]);
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_bbl_fence_poll(uintptr_t* regs)
+{
+  regs[11] = ipi_outstanding();
+  return SBI_SUCCESS;
+}
+
+#ifdef PK_ENABLE_TRAP_PROFILE
+/* Copy hart a0's trap profile (struct trap_profile) to a1, at most a2
+ * bytes of it; the value is the full size. */
+static uintptr_t sbi_bbl_trap_profile_read(uintptr_t* regs)
+{
+  struct trap_profile* p = trap_profile_get(regs[10]);
+  if (!p)
+    return SBI_ERR_INVALID_PARAM;
+  if (sbi_copy_out(regs[11], (char*)p, MIN(regs[12], sizeof(*p))))
+    return SBI_ERR_INVALID_ADDRESS;
+  regs[11] = sizeof(*p);
+  return SBI_SUCCESS;
+}
+
+static uintptr_t sbi_bbl_trap_profile_reset(uintptr_t* regs)
+{
+  trap_profile_reset();
+  return SBI_SUCCESS;
+}
+
+/* Copy hart a0's busiest (at most a2) misaligned/emulation sites to a1 as
+ * an array of struct trap_hotspot; the value is how many were copied. */
+static uintptr_t sbi_bbl_trap_hotspot_read(uintptr_t* regs)
+{
+  const struct trap_hotspot* top[TRAP_HOTSPOT_SLOTS];
+  uintptr_t i, n;
+
+  if (!trap_profile_get(regs[10]))
+    return SBI_ERR_INVALID_PARAM;
+
+  n = trap_hotspot_top(regs[10], top, MIN(regs[12], TRAP_HOTSPOT_SLOTS));
+  for (i = 0; i < n; i++)
+    if (sbi_copy_out(regs[11] + i * sizeof(*top[i]), (char*)top[i],
+                     sizeof(*top[i])))
+      return SBI_ERR_INVALID_ADDRESS;
+
+  regs[11] = n;
+  return SBI_SUCCESS;
+}
+#endif
+
+static const struct sbi_call sbi_bbl_calls[] = {
+  [SBI_EXT_BBL_FENCE_I_ASYNC]         = { sbi_bbl_fence_i_async,         SBI_PERM_ANY },
+  [SBI_EXT_BBL_SFENCE_VMA_ASYNC]      = { sbi_bbl_sfence_vma_async,      SBI_PERM_ANY },
+  [SBI_EXT_BBL_SFENCE_VMA_ASID_ASYNC] = { sbi_bbl_sfence_vma_asid_async, SBI_PERM_ANY },
+  [SBI_EXT_BBL_FENCE_POLL]            = { sbi_bbl_fence_poll,            SBI_PERM_ANY },
+#ifdef PK_ENABLE_TRAP_PROFILE
+  [SBI_EXT_BBL_TRAP_PROFILE_READ]     = { sbi_bbl_trap_profile_read,     SBI_PERM_HOST },
+  [SBI_EXT_BBL_TRAP_PROFILE_RESET]    = { sbi_bbl_trap_profile_reset,    SBI_PERM_HOST },
+  [SBI_EXT_BBL_TRAP_HOTSPOT_READ]     = { sbi_bbl_trap_hotspot_read,     SBI_PERM_HOST },
+#endif
+};
+
+#ifdef SM_ENABLED
+static uintptr_t sbi_sm_create_enclave(uintptr_t* regs)
+{
+  return mcall_sm_create_enclave(regs[10]);
+}
+
+static uintptr_t sbi_sm_destroy_enclave(uintptr_t* regs)
+{
+  return mcall_sm_destroy_enclave(regs[10]);
+}
+
+static uintptr_t sbi_sm_attest_enclave(uintptr_t* regs)
+{
+  return mcall_sm_attest_enclave(regs[10], regs[11], regs[12]);
 }
 
+static uintptr_t sbi_sm_get_sealing_key(uintptr_t* regs)
+{
+  return mcall_sm_get_sealing_key(regs[10], regs[11], regs[12]);
+}
 
+static uintptr_t sbi_sm_run_enclave(uintptr_t* regs)
+{
+  return mcall_sm_run_enclave(regs, regs[10]);
+}
+
+static uintptr_t sbi_sm_stop_enclave(uintptr_t* regs)
+{
+  return mcall_sm_stop_enclave(regs, regs[10]);
+}
+
+static uintptr_t sbi_sm_resume_enclave(uintptr_t* regs)
+{
+  uintptr_t retval = mcall_sm_resume_enclave(regs, regs[10]);
+  if (regs[0]) /* preserve a0 */
+    return regs[10];
+  return retval;
+}
+
+static uintptr_t sbi_sm_random(uintptr_t* regs)
+{
+  return mcall_sm_random();
+}
+
+#ifdef SBI_SM_SET_TIME_SLICE // not in sm_rs
+static uintptr_t sbi_sm_set_time_slice(uintptr_t* regs)
+{
+  return mcall_sm_set_time_slice(regs[10], regs[11]);
+}
+#endif
+
+#ifdef SBI_SM_SHMEM_APPROVE // not in sm_rs
+static uintptr_t sbi_sm_shmem_approve(uintptr_t* regs)
+{
+  return mcall_sm_shmem_approve(regs[10], regs[11], regs[12]);
+}
+#endif
+
+static uintptr_t sbi_sm_call_plugin(uintptr_t* regs)
+{
+  return mcall_sm_call_plugin(regs[10], regs[11], regs[12], regs[13]);
+}
+
+static uintptr_t sbi_sm_exit_enclave(uintptr_t* regs)
+{
+  return mcall_sm_exit_enclave(regs, regs[10]);
+}
+
+static uintptr_t sbi_sm_not_implemented(uintptr_t* regs)
+{
+  return mcall_sm_not_implemented(regs, regs[10]);
+}
+
+static const struct sbi_call sbi_sm_calls[] = {
+  [SBI_SM_CREATE_ENCLAVE  - SBI_SM_CREATE_ENCLAVE] = { sbi_sm_create_enclave,  SBI_PERM_HOST },
+  [SBI_SM_DESTROY_ENCLAVE - SBI_SM_CREATE_ENCLAVE] = { sbi_sm_destroy_enclave, SBI_PERM_HOST },
+  [SBI_SM_ATTEST_ENCLAVE  - SBI_SM_CREATE_ENCLAVE] = { sbi_sm_attest_enclave,  SBI_PERM_ENCLAVE },
+  [SBI_SM_GET_SEALING_KEY - SBI_SM_CREATE_ENCLAVE] = { sbi_sm_get_sealing_key, SBI_PERM_ENCLAVE },
+  [SBI_SM_RUN_ENCLAVE     - SBI_SM_CREATE_ENCLAVE] = { sbi_sm_run_enclave,     SBI_PERM_HOST },
+  [SBI_SM_STOP_ENCLAVE    - SBI_SM_CREATE_ENCLAVE] = { sbi_sm_stop_enclave,    SBI_PERM_ENCLAVE },
+  [SBI_SM_RESUME_ENCLAVE  - SBI_SM_CREATE_ENCLAVE] = { sbi_sm_resume_enclave,  SBI_PERM_HOST },
+  [SBI_SM_RANDOM          - SBI_SM_CREATE_ENCLAVE] = { sbi_sm_random,          SBI_PERM_ANY },
+#ifdef SBI_SM_SET_TIME_SLICE
+  [SBI_SM_SET_TIME_SLICE  - SBI_SM_CREATE_ENCLAVE] = { sbi_sm_set_time_slice,  SBI_PERM_HOST },
+#endif
+#ifdef SBI_SM_SHMEM_APPROVE
+  [SBI_SM_SHMEM_APPROVE   - SBI_SM_CREATE_ENCLAVE] = { sbi_sm_shmem_approve,   SBI_PERM_HOST },
+#endif
+};
+
+static const struct sbi_call sbi_sm_call_plugin_call[] = {
+  { sbi_sm_call_plugin, SBI_PERM_ENCLAVE },
+};
+
+static const struct sbi_call sbi_sm_exit_enclave_call[] = {
+  { sbi_sm_exit_enclave, SBI_PERM_ENCLAVE },
+};
+
+static const struct sbi_call sbi_sm_not_implemented_call[] = {
+  { sbi_sm_not_implemented, SBI_PERM_ENCLAVE },
+};
+#endif
+
+#define SBI_EXTENSION(eid, calls) { (eid), SBI_CALLS(calls), (calls) }
+
+// v0.2 extensions, most frequently called first
+static const struct sbi_extension sbi_extensions[] = {
+  SBI_EXTENSION(SBI_EXT_RFENCE, sbi_rfence_calls),
+  SBI_EXTENSION(SBI_EXT_DBCN, sbi_dbcn_calls),
+  SBI_EXTENSION(SBI_EXT_BBL, sbi_bbl_calls),
+  SBI_EXTENSION(SBI_EXT_PMU, sbi_pmu_calls),
+#ifdef PK_ENABLE_SBI_HSM
+  SBI_EXTENSION(SBI_EXT_HSM, sbi_hsm_calls),
+#endif
+  SBI_EXTENSION(SBI_EXT_BASE, sbi_base_calls),
+};
+
+static const struct sbi_call* sbi_index(const struct sbi_call* calls,
+                                        uintptr_t n_calls, uintptr_t idx)
+{
+  if (idx >= n_calls || !calls[idx].handler)
+    return NULL;
+  return &calls[idx];
+}
+
+static const struct sbi_call* sbi_find_legacy_call(uintptr_t eid)
+{
+  if (eid < SBI_EXT_BASE)
+    return sbi_index(sbi_legacy_calls, SBI_CALLS(sbi_legacy_calls), eid);
+#ifdef SM_ENABLED
+  if (eid - SBI_SM_CREATE_ENCLAVE < SBI_CALLS(sbi_sm_calls))
+    return sbi_index(sbi_sm_calls, SBI_CALLS(sbi_sm_calls),
+                     eid - SBI_SM_CREATE_ENCLAVE);
+  if (eid == SBI_SM_CALL_PLUGIN)
+    return sbi_sm_call_plugin_call;
+  if (eid == SBI_SM_EXIT_ENCLAVE)
+    return sbi_sm_exit_enclave_call;
+  if (eid == SBI_SM_NOT_IMPLEMENTED)
+    return sbi_sm_not_implemented_call;
+#endif
+  return NULL;
+}
+
+static const struct sbi_extension* sbi_find_extension(uintptr_t eid)
+{
+  const struct sbi_extension* ext;
+
+  for (ext = sbi_extensions; ext < sbi_extensions + SBI_CALLS(sbi_extensions); ext++)
+    if (eid == ext->id)
+      return ext;
+  return NULL;
+}
+
+static int sbi_probe_extension(uintptr_t eid)
+{
+  return sbi_find_legacy_call(eid) || sbi_find_extension(eid);
+}
+
+static uintptr_t sbi_context()
+{
+#ifdef SM_ENABLED
+  if (cpu_is_enclave_context())
+    return SBI_PERM_ENCLAVE;
+#endif
+  return SBI_PERM_HOST;
+}
 
 void mcall_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 {
   write_csr(mepc, mepc + 4);
 
-  uintptr_t n = regs[17], arg0 = regs[10], arg1 = regs[11], arg2 = regs[12], arg3 = regs[13], retval, ipi_type;
-
-  switch (n)
-  {
-    case SBI_CONSOLE_PUTCHAR:
-      retval = mcall_console_putchar(arg0);
-      break;
-    case SBI_CONSOLE_GETCHAR:
-      retval = mcall_console_getchar();
-      break;
-    case SBI_SEND_IPI:
-      ipi_type = IPI_SOFT;
-      goto send_ipi;
-    case SBI_REMOTE_SFENCE_VMA:
-    case SBI_REMOTE_SFENCE_VMA_ASID:
-      ipi_type = IPI_SFENCE_VMA;
-      goto send_ipi;
-    case SBI_REMOTE_FENCE_I:
-      ipi_type = IPI_FENCE_I;
-send_ipi:
-      send_ipi_many((uintptr_t*)arg0, ipi_type);
-      retval = 0;
-      break;
-    case SBI_CLEAR_IPI:
-      retval = mcall_clear_ipi();
-      break;
-    case SBI_SHUTDOWN:
-      retval = mcall_shutdown();
-      break;
-    case SBI_SET_TIMER:
-#if __riscv_xlen == 32
-      retval = mcall_set_timer(arg0 + ((uint64_t)arg1 << 32));
-#else
-      retval = mcall_set_timer(arg0);
+#ifdef PK_ENABLE_TRAP_PROFILE
+  // a7/a6 may belong to another context by the time the handler returns
+  uintptr_t eid = regs[17], fid = regs[16], start = rdcycle();
 #endif
-      break;
+  const struct sbi_call* call = sbi_find_legacy_call(regs[17]);
+  const struct sbi_extension* ext = NULL;
+  uintptr_t retval;
+
+  if (!call && (ext = sbi_find_extension(regs[17])))
+    call = sbi_index(ext->calls, ext->n_calls, regs[16]);
+
+  // as before v0.2: an unknown ID is -ENOSYS; only a known v0.2
+  // extension answers an unknown function with SBI_ERR_NOT_SUPPORTED
+  if (!call)
+    retval = ext ? SBI_ERR_NOT_SUPPORTED : -ENOSYS;
+  else if (!(call->perm & sbi_context()))
 #ifdef SM_ENABLED
-    case SBI_SM_CREATE_ENCLAVE:
-      retval = mcall_sm_create_enclave(arg0);
-      break;
-    case SBI_SM_DESTROY_ENCLAVE:
-      retval = mcall_sm_destroy_enclave(arg0);
-      break;
-    case SBI_SM_RUN_ENCLAVE:
-      retval = mcall_sm_run_enclave(regs, arg0);
-      break;
-    case SBI_SM_EXIT_ENCLAVE:
-      retval = mcall_sm_exit_enclave(regs, arg0);
-      break;
-    case SBI_SM_STOP_ENCLAVE:
-      retval = mcall_sm_stop_enclave(regs, arg0);
-      break;
-    case SBI_SM_RESUME_ENCLAVE:
-      retval = mcall_sm_resume_enclave(regs, arg0);
-      if (regs[0]) /* preserve a0 */
-        return;
-      break;
-    case SBI_SM_ATTEST_ENCLAVE:
-      retval = mcall_sm_attest_enclave(arg0, arg1, arg2);
-      break;
-    case SBI_SM_GET_SEALING_KEY:
-      retval = mcall_sm_get_sealing_key(arg0, arg1, arg2);
-      break;
-    case SBI_SM_RANDOM:
-      retval = mcall_sm_random();
-      break;
-    case SBI_SM_CALL_PLUGIN:
-      retval = mcall_sm_call_plugin(arg0, arg1, arg2, arg3);
-      break;
-    case SBI_SM_NOT_IMPLEMENTED:
-      retval = mcall_sm_not_implemented(regs, arg0);
-      break;
+    retval = ENCLAVE_SBI_PROHIBITED;
+#else
+    retval = -EPERM;
 #endif
-    default:
-      retval = -ENOSYS;
-      break;
-  }
+  else
+    retval = call->handler(regs);
+
   regs[10] = retval;
+
+  console_drain();
+#ifdef PK_ENABLE_TRAP_PROFILE
+  trap_profile_sbi(eid, fid, rdcycle() - start);
+#endif
 }
 
 void redirect_trap(uintptr_t epc, uintptr_t mstatus, uintptr_t badaddr)
@@ -308,12 +1002,36 @@ void redirect_trap(uintptr_t epc, uintptr_t mstatus, uintptr_t badaddr)
   new_mstatus |= mpp_s;
   write_csr(mstatus, new_mstatus);
 
+#ifdef PK_ENABLE_TRAP_PROFILE
+  trap_profile_redirect();
+#endif
   extern void __redirect_trap();
   return __redirect_trap();
 }
 
+#ifdef PK_ENABLE_UART_TX_IRQ
+// M-mode external interrupt; only the console's TX interrupt is routed here
+void m_ext_irq_trap(uintptr_t* regs, uintptr_t dummy, uintptr_t mepc)
+{
+  volatile uint32_t* claim = HLS()->plic_m_thresh + 1;
+  uint32_t irq;
+
+  while ((irq = *claim)) {
+    if (uart && irq == uart_irq)
+      uart_drain();
+    else if (uart16550 && irq == uart16550_irq)
+      uart16550_drain();
+    *claim = irq;
+  }
+}
+#endif
+
 void pmp_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 {
+  if (mcause == CAUSE_LOAD_ACCESS)
+    pmu_fw_count(SBI_PMU_FW_ACCESS_LOAD);
+  else if (mcause == CAUSE_STORE_ACCESS)
+    pmu_fw_count(SBI_PMU_FW_ACCESS_STORE);
   redirect_trap(mepc, read_csr(mstatus), read_csr(mbadaddr));
 }
 
@@ -346,12 +1064,20 @@ void trap_from_machine_mode(uintptr_t* regs, uintptr_t dummy, uintptr_t mepc)
 
 void poweroff(uint16_t code)
 {
+  if (dbcn_stats.writes)
+    printm("dbcn: %ld writes, %ld bytes, %ld traps saved\r\n",
+           dbcn_stats.writes, dbcn_stats.bytes, dbcn_stats.traps_saved);
+#ifdef PK_ENABLE_TRAP_PROFILE
+  trap_profile_dump();
+#endif
+  emulation_dump_stats();
   printm("Power off\r\n");
+  console_flush();
   finisher_exit(code);
   if (htif) {
     htif_poweroff();
   } else {
-    send_ipi_many(0, IPI_HALT);
+    send_ipi_many(hart_mask, IPI_HALT);
     while (1) { asm volatile ("wfi\n"); }
   }
 }
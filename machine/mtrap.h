@@ -29,6 +29,18 @@ static inline int xlen()
   return read_const_csr(misa) < 0 ? 64 : 32;
 }
 
+// Folds a trapping pc and the S-mode satp into a small table index. Shifts
+// and XORs only: without M a multiply is a libgcc call on every trap.
+static inline uintptr_t mepc_satp_hash(uintptr_t mepc, uintptr_t satp)
+{
+#if __riscv_xlen == 64
+  satp ^= satp >> 32;
+#endif
+  satp ^= satp >> 16;
+  satp ^= satp >> 8;
+  return (mepc >> 1) ^ satp;
+}
+
 extern uintptr_t mem_size;
 extern volatile uint64_t* mtime;
 extern volatile uint32_t* plic_priorities;
@@ -44,6 +56,26 @@ typedef struct {
   volatile uintptr_t* plic_m_ie;
   volatile uint32_t* plic_s_thresh;
   volatile uintptr_t* plic_s_ie;
+
+  // ranged remote sfence.vma request (IPI_SFENCE_VMA_RANGE); a sender
+  // owns the slot from claiming sfence_busy until the target clears it
+  volatile uintptr_t sfence_start;
+  volatile uintptr_t sfence_size;
+  volatile uintptr_t sfence_asid; // -1: all address spaces
+  volatile int sfence_busy;
+
+  // senders waiting for this hart to handle their IPIs, one bit per hart
+  volatile int ipi_acks;
+
+  // trap profiler: vector and start cycle of the trap from S/U-mode being
+  // handled, for handlers that leave through __redirect_trap
+  uintptr_t prof_vector;
+  uintptr_t prof_start;
+
+  // SBI HSM state (HSM_STATE_*) and where hart_start sends the hart
+  volatile int hsm_state;
+  volatile uintptr_t hsm_start_addr;
+  volatile uintptr_t hsm_opaque;
 } hls_t;
 
 hls_t *get_hls();
@@ -62,11 +94,14 @@ void poweroff(uint16_t code) __attribute((noreturn));
 void printm(const char* s, ...);
 void vprintm(const char *s, va_list args);
 void putstring(const char* s);
+void console_flush(); // wait until buffered console output is out
 #define assert(x) ({ if (!(x)) die("assertion failed: %s", #x); })
 #define die(str, ...) ({ printm("%s:%d: " str "\n", __FILE__, __LINE__, ##__VA_ARGS__); poweroff(-1); })
 
+void supervisor_mode_init();
 void enter_supervisor_mode(void (*fn)(uintptr_t), uintptr_t arg0, uintptr_t arg1)
   __attribute__((noreturn));
+void handle_ipi_in_machine_mode();
 void boot_loader(uintptr_t dtb);
 void boot_other_hart(uintptr_t dtb);
 
@@ -82,19 +117,37 @@ static inline void wfi()
 #define IPI_SFENCE_VMA 0x4
 #define IPI_HALT       0x8
 #define IPI_PMP       0x10
+#define IPI_SFENCE_VMA_RANGE 0x20
+
+// above this, a ranged remote sfence.vma becomes a full flush
+#define SFENCE_VMA_RANGE_MAX (64 * RISCV_PGSIZE)
+
+// each sender's IPI completion block (see mtrap.c) sits on its own cache line
+#define IPI_COMPLETION_STRIDE 64
+
+// mentry.S's rdtime fast path bumps pmu_harts[hartid].fw_events[] itself
+#define PMU_HART_SHIFT 10
+#define PMU_FW_ILLEGAL_INSN_OFFSET (4 * 8)
 
 #define MACHINE_STACK_SIZE RISCV_PGSIZE
 #define MENTRY_HLS_OFFSET (INTEGER_CONTEXT_SIZE + SOFT_FLOAT_CONTEXT_SIZE)
 #define MENTRY_FRAME_SIZE (MENTRY_HLS_OFFSET + HLS_SIZE)
 #define MENTRY_IPI_OFFSET (MENTRY_HLS_OFFSET)
 #define MENTRY_IPI_PENDING_OFFSET (MENTRY_HLS_OFFSET + REGBYTES)
+#define MENTRY_SFENCE_START_OFFSET (MENTRY_HLS_OFFSET + 7 * REGBYTES)
+#define MENTRY_SFENCE_SIZE_OFFSET (MENTRY_HLS_OFFSET + 8 * REGBYTES)
+#define MENTRY_SFENCE_ASID_OFFSET (MENTRY_HLS_OFFSET + 9 * REGBYTES)
+#define MENTRY_SFENCE_BUSY_OFFSET (MENTRY_HLS_OFFSET + 10 * REGBYTES)
+#define MENTRY_IPI_ACKS_OFFSET (MENTRY_SFENCE_BUSY_OFFSET + 4)
+#define MENTRY_PROF_VECTOR_OFFSET (MENTRY_IPI_ACKS_OFFSET + 4)
+#define MENTRY_PROF_START_OFFSET (MENTRY_PROF_VECTOR_OFFSET + REGBYTES)
 
 #ifdef __riscv_flen
 # define SOFT_FLOAT_CONTEXT_SIZE 0
 #else
 # define SOFT_FLOAT_CONTEXT_SIZE (8 * 32)
 #endif
-#define HLS_SIZE 64
+#define HLS_SIZE 128
 #define INTEGER_CONTEXT_SIZE (32 * REGBYTES)
 
 #endif
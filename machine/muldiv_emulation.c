@@ -2,36 +2,124 @@
 
 #ifndef __riscv_muldiv
 
-#if __riscv_xlen == 64
-typedef __int128 double_int;
-#else
-typedef int64_t double_int;
-#endif
+// Without the M extension the compiler would turn '*', '/' and '%' into
+// generic libgcc calls, which also leave division by zero undefined. These
+// kernels use only shifts and adds, stop as soon as the operands run out of
+// bits, and give the results the ISA specifies for x/0 and MIN/-1.
+
+// Full XLEN x XLEN -> 2*XLEN unsigned product; the high half goes in *hi
+static uintptr_t mul_wide(uintptr_t a, uintptr_t b, uintptr_t* hi)
+{
+  uintptr_t lo = 0, ahi = 0;
+
+  *hi = 0;
+  if (a < b) { // fewer iterations with the narrower multiplier
+    uintptr_t t = a;
+    a = b;
+    b = t;
+  }
+
+  while (b) {
+    if (b & 1) {
+      lo += a;
+      *hi += ahi + (lo < a);
+    }
+    ahi = (ahi << 1) | (a >> (__riscv_xlen - 1));
+    a <<= 1;
+    b >>= 1;
+  }
+  return lo;
+}
+
+// Only the low half; shorter loop with no carries to track
+static uintptr_t mul_lo(uintptr_t a, uintptr_t b)
+{
+  uintptr_t lo = 0;
+
+  if (a < b) {
+    uintptr_t t = a;
+    a = b;
+    b = t;
+  }
+
+  while (b) {
+    if (b & 1)
+      lo += a;
+    a <<= 1;
+    b >>= 1;
+  }
+  return lo;
+}
 
-// These routines rely on the compiler to turn these operations into libcalls
-// when not natively supported.  So work on making those go fast.
+// Restoring shift-and-subtract division. The divisor is first shifted up
+// under the dividend's leading one, so small quotients take few rounds.
+static uintptr_t divu(uintptr_t n, uintptr_t d, uintptr_t* rem)
+{
+  uintptr_t q = 0, bit = 1;
+
+  if (d == 0) {
+    *rem = n;
+    return -1;
+  }
+
+  while (d < n && !(d >> (__riscv_xlen - 1))) {
+    d <<= 1;
+    bit <<= 1;
+  }
+
+  while (bit) {
+    if (n >= d) {
+      n -= d;
+      q |= bit;
+    }
+    d >>= 1;
+    bit >>= 1;
+  }
+
+  *rem = n;
+  return q;
+}
+
+// Signed division on magnitudes; MIN / -1 wraps to MIN with no special case
+static uintptr_t divs(intptr_t n, intptr_t d, uintptr_t* rem)
+{
+  uintptr_t q, r;
+
+  if (d == 0) {
+    *rem = n;
+    return -1;
+  }
+
+  q = divu(n < 0 ? -(uintptr_t)n : n, d < 0 ? -(uintptr_t)d : d, &r);
+  *rem = n < 0 ? -r : r;
+  return (n < 0) != (d < 0) ? -q : q;
+}
 
 DECLARE_EMULATION_FUNC(emulate_mul_div)
 {
-  uintptr_t rs1 = GET_RS1(insn, regs), rs2 = GET_RS2(insn, regs), val;
+  uintptr_t rs1 = GET_RS1(insn, regs), rs2 = GET_RS2(insn, regs), val, r;
 
   if ((insn & MASK_MUL) == MATCH_MUL)
-    val = rs1 * rs2;
+    val = mul_lo(rs1, rs2);
   else if ((insn & MASK_DIV) == MATCH_DIV)
-    val = (intptr_t)rs1 / (intptr_t)rs2;
+    val = divs(rs1, rs2, &r);
   else if ((insn & MASK_DIVU) == MATCH_DIVU)
-    val = rs1 / rs2;
+    val = divu(rs1, rs2, &r);
   else if ((insn & MASK_REM) == MATCH_REM)
-    val = (intptr_t)rs1 % (intptr_t)rs2;
+    divs(rs1, rs2, &val);
   else if ((insn & MASK_REMU) == MATCH_REMU)
-    val = rs1 % rs2;
-  else if ((insn & MASK_MULH) == MATCH_MULH)
-    val = ((double_int)(intptr_t)rs1 * (double_int)(intptr_t)rs2) >> (8 * sizeof(rs1));
-  else if ((insn & MASK_MULHU) == MATCH_MULHU)
-    val = ((double_int)rs1 * (double_int)rs2) >> (8 * sizeof(rs1));
-  else if ((insn & MASK_MULHSU) == MATCH_MULHSU)
-    val = ((double_int)(intptr_t)rs1 * (double_int)rs2) >> (8 * sizeof(rs1));
-  else
+    divu(rs1, rs2, &val);
+  // signed high halves from the unsigned one: subtract the other operand
+  // once for each operand that is negative
+  else if ((insn & MASK_MULH) == MATCH_MULH) {
+    mul_wide(rs1, rs2, &val);
+    val -= ((intptr_t)rs1 < 0 ? rs2 : 0) + ((intptr_t)rs2 < 0 ? rs1 : 0);
+  } else if ((insn & MASK_MULHU) == MATCH_MULHU)
+    mul_wide(rs1, rs2, &val);
+  else if ((insn & MASK_MULHSU) == MATCH_MULHSU) {
+    mul_wide(rs1, rs2, &val);
+    val -= (intptr_t)rs1 < 0 ? rs2 : 0;
+  } else
     return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
 
   SET_RD(insn, regs, val);
@@ -42,19 +130,22 @@ DECLARE_EMULATION_FUNC(emulate_mul_div)
 DECLARE_EMULATION_FUNC(emulate_mul_div32)
 {
   uint32_t rs1 = GET_RS1(insn, regs), rs2 = GET_RS2(insn, regs);
+  uintptr_t r;
   int32_t val;
 
   if ((insn & MASK_MULW) == MATCH_MULW)
-    val = rs1 * rs2;
+    val = mul_lo(rs1, rs2);
   else if ((insn & MASK_DIVW) == MATCH_DIVW)
-    val = (int32_t)rs1 / (int32_t)rs2;
+    val = divs((int32_t)rs1, (int32_t)rs2, &r);
   else if ((insn & MASK_DIVUW) == MATCH_DIVUW)
-    val = rs1 / rs2;
-  else if ((insn & MASK_REMW) == MATCH_REMW)
-    val = (int32_t)rs1 % (int32_t)rs2;
-  else if ((insn & MASK_REMUW) == MATCH_REMUW)
-    val = rs1 % rs2;
-  else
+    val = divu(rs1, rs2, &r);
+  else if ((insn & MASK_REMW) == MATCH_REMW) {
+    divs((int32_t)rs1, (int32_t)rs2, &r);
+    val = r;
+  } else if ((insn & MASK_REMUW) == MATCH_REMUW) {
+    divu(rs1, rs2, &r);
+    val = r;
+  } else
     return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
 
   SET_RD(insn, regs, val);
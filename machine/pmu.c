@@ -0,0 +1,419 @@
+// See LICENSE for license details.
+
+// SBI PMU extension. Which hardware events the mhpmcounters can count,
+// and how to select them in mhpmevent, is platform specific and comes from
+// the device tree node compatible with "riscv,pmu" (the binding OpenSBI
+// uses); without one, only cycle and instret are offered. bbl's own
+// firmware events are counted all the time in pmu_harts[], and a firmware
+// counter reports the difference since it was started.
+//
+// Counters are per hart: every call acts on the calling hart's counters.
+// mcounteren stays fully open, so S-mode reads hardware counters directly.
+
+#include "pmu.h"
+#include "mtrap.h"
+#include "mcall.h"
+#include "fdt.h"
+#include <string.h>
+
+struct pmu_hart pmu_harts[MAX_HARTS];
+
+_Static_assert(sizeof(struct pmu_hart) == 1 << PMU_HART_SHIFT &&
+               offsetof(struct pmu_hart, fw_events[SBI_PMU_FW_ILLEGAL_INSN]) ==
+               PMU_FW_ILLEGAL_INSN_OFFSET,
+               "mentry.S counts rdtime traps into pmu_harts[]");
+
+#define PMU_MAP_MAX 32
+
+// riscv,event-to-mhpmcounters: events [first, last] may use 'counters'
+static struct {
+  uint32_t first, last, counters;
+} pmu_event_maps[PMU_MAP_MAX];
+static int pmu_n_event_maps;
+
+// riscv,event-to-mhpmevent: mhpmevent value selecting 'event'
+static struct {
+  uint32_t event;
+  uint64_t select;
+} pmu_select_maps[PMU_MAP_MAX];
+static int pmu_n_select_maps;
+
+// riscv,raw-event-to-mhpmcounters: raw selectors matching 'select' under
+// 'mask' may use 'counters'
+static struct {
+  uint64_t select, mask;
+  uint32_t counters;
+} pmu_raw_maps[PMU_MAP_MAX];
+static int pmu_n_raw_maps;
+
+// hardware counters to report: cycle, time, instret and the DT's hpm ones
+static uint32_t pmu_hw_mask = 0x7;
+static uintptr_t pmu_num_hw = 3;
+
+#define PMU_FW_SUPPORTED \
+  (1 << SBI_PMU_FW_MISALIGNED_LOAD | 1 << SBI_PMU_FW_MISALIGNED_STORE | \
+   1 << SBI_PMU_FW_ACCESS_LOAD | 1 << SBI_PMU_FW_ACCESS_STORE | \
+   1 << SBI_PMU_FW_ILLEGAL_INSN | 1 << SBI_PMU_FW_SET_TIMER | \
+   1 << SBI_PMU_FW_IPI_SENT | 1 << SBI_PMU_FW_FENCE_I_SENT | \
+   1 << SBI_PMU_FW_SFENCE_VMA_SENT | 1 << SBI_PMU_FW_SFENCE_VMA_ASID_SENT)
+
+struct pmu_scan
+{
+  int compat;
+  const struct fdt_scan_prop* events;
+  const struct fdt_scan_prop* selects;
+  const struct fdt_scan_prop* raw;
+  struct fdt_scan_prop props[3];
+};
+
+static void pmu_open(const struct fdt_scan_node *node, void *extra)
+{
+  struct pmu_scan *scan = (struct pmu_scan *)extra;
+  memset(scan, 0, sizeof(*scan));
+}
+
+static void pmu_prop(const struct fdt_scan_prop *prop, void *extra)
+{
+  struct pmu_scan *scan = (struct pmu_scan *)extra;
+  if (prop->key == FDT_KEY_COMPATIBLE && fdt_string_list_index(prop, "riscv,pmu") >= 0) {
+    scan->compat = 1;
+  } else if (!strcmp(prop->name, "riscv,event-to-mhpmcounters")) {
+    scan->props[0] = *prop;
+    scan->events = &scan->props[0];
+  } else if (!strcmp(prop->name, "riscv,event-to-mhpmevent")) {
+    scan->props[1] = *prop;
+    scan->selects = &scan->props[1];
+  } else if (!strcmp(prop->name, "riscv,raw-event-to-mhpmcounters")) {
+    scan->props[2] = *prop;
+    scan->raw = &scan->props[2];
+  }
+}
+
+static uint64_t pmu_cell64(const struct fdt_scan_prop *prop, int i)
+{
+  return (uint64_t)fdt_get_cell(prop, i) << 32 | fdt_get_cell(prop, i + 1);
+}
+
+// only hpmcounter3..31 can be handed out for hardware events; the fixed
+// cycle and instret events are handled separately
+static uint32_t pmu_dt_counters(uint32_t counters)
+{
+  counters &= ~0x7;
+  pmu_hw_mask |= counters;
+  return counters;
+}
+
+static void pmu_done(const struct fdt_scan_node *node, void *extra)
+{
+  struct pmu_scan *scan = (struct pmu_scan *)extra;
+  int i, n;
+
+  if (!scan->compat)
+    return;
+
+  if (scan->events) {
+    n = scan->events->len / (3 * sizeof(uint32_t));
+    for (i = 0; i < n && pmu_n_event_maps < PMU_MAP_MAX; i++) {
+      pmu_event_maps[pmu_n_event_maps].first = fdt_get_cell(scan->events, 3*i);
+      pmu_event_maps[pmu_n_event_maps].last = fdt_get_cell(scan->events, 3*i + 1);
+      pmu_event_maps[pmu_n_event_maps].counters =
+        pmu_dt_counters(fdt_get_cell(scan->events, 3*i + 2));
+      pmu_n_event_maps++;
+    }
+  }
+
+  if (scan->selects) {
+    n = scan->selects->len / (3 * sizeof(uint32_t));
+    for (i = 0; i < n && pmu_n_select_maps < PMU_MAP_MAX; i++) {
+      pmu_select_maps[pmu_n_select_maps].event = fdt_get_cell(scan->selects, 3*i);
+      pmu_select_maps[pmu_n_select_maps].select = pmu_cell64(scan->selects, 3*i + 1);
+      pmu_n_select_maps++;
+    }
+  }
+
+  if (scan->raw) {
+    n = scan->raw->len / (5 * sizeof(uint32_t));
+    for (i = 0; i < n && pmu_n_raw_maps < PMU_MAP_MAX; i++) {
+      pmu_raw_maps[pmu_n_raw_maps].select = pmu_cell64(scan->raw, 5*i);
+      pmu_raw_maps[pmu_n_raw_maps].mask = pmu_cell64(scan->raw, 5*i + 2);
+      pmu_raw_maps[pmu_n_raw_maps].counters =
+        pmu_dt_counters(fdt_get_cell(scan->raw, 5*i + 4));
+      pmu_n_raw_maps++;
+    }
+  }
+
+  for (pmu_num_hw = PMU_HW_COUNTERS; !((pmu_hw_mask >> (pmu_num_hw - 1)) & 1); )
+    pmu_num_hw--;
+}
+
+static struct pmu_scan pmu_scan;
+
+const struct fdt_cb query_pmu_cb = {
+  .open = pmu_open,
+  .prop = pmu_prop,
+  .done = pmu_done,
+  .extra = &pmu_scan,
+};
+
+void query_pmu(uintptr_t fdt)
+{
+  fdt_scan(fdt, &query_pmu_cb);
+}
+
+#if __riscv_xlen == 32
+# define PMU_WRITE64(csr, val) ({ write_csr(csr, 0); \
+                                  write_csr(csr##h, (uint64_t)(val) >> 32); \
+                                  write_csr(csr, (uint32_t)(val)); })
+#else
+# define PMU_WRITE64(csr, val) write_csr(csr, val)
+#endif
+
+#define PMU_FOR_EACH_HPM(f) \
+  f(3)  f(4)  f(5)  f(6)  f(7)  f(8)  f(9)  f(10) f(11) f(12) \
+  f(13) f(14) f(15) f(16) f(17) f(18) f(19) f(20) f(21) f(22) \
+  f(23) f(24) f(25) f(26) f(27) f(28) f(29) f(30) f(31)
+
+static void pmu_write_hpmevent(uintptr_t i, uintptr_t select)
+{
+  switch (i) {
+#define PMU_WRITE_HPMEVENT(n) case n: write_csr(mhpmevent##n, select); break;
+    PMU_FOR_EACH_HPM(PMU_WRITE_HPMEVENT)
+#undef PMU_WRITE_HPMEVENT
+  }
+}
+
+static void pmu_write_counter(uintptr_t i, uint64_t value)
+{
+  switch (i) {
+    case 0: PMU_WRITE64(mcycle, value); break;
+    case 2: PMU_WRITE64(minstret, value); break;
+#define PMU_WRITE_HPMCOUNTER(n) case n: PMU_WRITE64(mhpmcounter##n, value); break;
+    PMU_FOR_EACH_HPM(PMU_WRITE_HPMCOUNTER)
+#undef PMU_WRITE_HPMCOUNTER
+  }
+}
+
+static struct pmu_hart* pmu_this_hart()
+{
+  return &pmu_harts[read_const_csr(mhartid)];
+}
+
+uintptr_t mcall_pmu_num_counters()
+{
+  return pmu_num_hw + PMU_FW_COUNTERS;
+}
+
+static int pmu_is_fw(uintptr_t i)
+{
+  return i >= pmu_num_hw;
+}
+
+static uint64_t pmu_fw_value(struct pmu_hart* p, uintptr_t i)
+{
+  uintptr_t f = i - pmu_num_hw;
+
+  if (!((p->started >> i) & 1))
+    return p->fw_value[f];
+  return p->fw_value[f] + p->fw_events[SBI_PMU_EVENT_CODE(p->event[i])] -
+         p->fw_base[f];
+}
+
+// the counters named by a (base, mask) pair, 0 if none of them exist
+static uint64_t pmu_counters(uintptr_t base, uintptr_t mask)
+{
+  uintptr_t n = mcall_pmu_num_counters();
+
+  if (base >= n)
+    return 0;
+  return ((uint64_t)mask << base) & ((1ULL << n) - 1);
+}
+
+static uintptr_t pmu_first(uint64_t counters)
+{
+  uintptr_t i = 0;
+  while (!(counters & 1)) {
+    counters >>= 1;
+    i++;
+  }
+  return i;
+}
+
+// Counters able to count 'event_idx', and what to put in mhpmevent for it
+static uint64_t pmu_allowed(uintptr_t event_idx, uint64_t event_data,
+                            uint64_t* select)
+{
+  uint64_t counters = 0, hpm;
+  int i, found = 0;
+
+  switch (SBI_PMU_EVENT_TYPE(event_idx)) {
+    case SBI_PMU_TYPE_HW:
+    case SBI_PMU_TYPE_HW_CACHE:
+      if (event_idx == SBI_PMU_HW_CPU_CYCLES)
+        counters |= 1 << 0;
+      if (event_idx == SBI_PMU_HW_INSTRUCTIONS)
+        counters |= 1 << 2;
+
+      for (i = 0; i < pmu_n_select_maps; i++) {
+        if (pmu_select_maps[i].event == event_idx) {
+          *select = pmu_select_maps[i].select;
+          found = 1;
+        }
+      }
+      for (hpm = 0, i = 0; i < pmu_n_event_maps; i++)
+        if (pmu_event_maps[i].first <= event_idx && event_idx <= pmu_event_maps[i].last)
+          hpm |= pmu_event_maps[i].counters;
+      // an hpm counter is no use without a selector for the event
+      return found ? counters | hpm : counters;
+
+    case SBI_PMU_TYPE_HW_RAW:
+      for (i = 0; i < pmu_n_raw_maps; i++)
+        if ((event_data & pmu_raw_maps[i].mask) == pmu_raw_maps[i].select)
+          counters |= pmu_raw_maps[i].counters;
+      *select = event_data;
+      return counters;
+
+    case SBI_PMU_TYPE_FW:
+      if (SBI_PMU_EVENT_CODE(event_idx) >= SBI_PMU_FW_MAX ||
+          !((PMU_FW_SUPPORTED >> SBI_PMU_EVENT_CODE(event_idx)) & 1))
+        return 0;
+      return ((1ULL << PMU_FW_COUNTERS) - 1) << pmu_num_hw;
+  }
+  return 0;
+}
+
+static void pmu_set(struct pmu_hart* p, uintptr_t i, uint64_t value)
+{
+  if (pmu_is_fw(i)) {
+    uintptr_t f = i - pmu_num_hw;
+    p->fw_value[f] = value;
+    p->fw_base[f] = p->fw_events[SBI_PMU_EVENT_CODE(p->event[i])];
+  } else {
+    pmu_write_counter(i, value);
+  }
+}
+
+// cycle and instret are never stopped: there is no mcountinhibit before
+// priv 1.11, so starting and stopping them only tracks the state
+static void pmu_start(struct pmu_hart* p, uintptr_t i)
+{
+  if (pmu_is_fw(i))
+    p->fw_base[i - pmu_num_hw] = p->fw_events[SBI_PMU_EVENT_CODE(p->event[i])];
+  else
+    pmu_write_hpmevent(i, p->hpm_select[i]);
+  p->started |= 1ULL << i;
+}
+
+static void pmu_stop(struct pmu_hart* p, uintptr_t i)
+{
+  if (pmu_is_fw(i))
+    p->fw_value[i - pmu_num_hw] = pmu_fw_value(p, i);
+  else
+    pmu_write_hpmevent(i, 0);
+  p->started &= ~(1ULL << i);
+}
+
+uintptr_t mcall_pmu_counter_get_info(uintptr_t i, uintptr_t* info)
+{
+  if (i < pmu_num_hw) {
+    if (!((pmu_hw_mask >> i) & 1))
+      return SBI_ERR_INVALID_PARAM;
+    // widths aren't probed; all counters are reported as 64 bits
+    *info = (CSR_CYCLE + i) | (63 << 12);
+  } else if (i < mcall_pmu_num_counters()) {
+    *info = 1UL << (__riscv_xlen - 1);
+  } else {
+    return SBI_ERR_INVALID_PARAM;
+  }
+  return SBI_SUCCESS;
+}
+
+uintptr_t mcall_pmu_counter_config_matching(uintptr_t base, uintptr_t mask,
+                                            uintptr_t flags, uintptr_t event_idx,
+                                            uint64_t event_data, uintptr_t* idx)
+{
+  struct pmu_hart* p = pmu_this_hart();
+  uint64_t counters = pmu_counters(base, mask), select = 0;
+  uintptr_t i;
+
+  if (!counters)
+    return SBI_ERR_INVALID_PARAM;
+
+  if (flags & SBI_PMU_CFG_FLAG_SKIP_MATCH) {
+    counters &= p->configured;
+    if (!counters)
+      return SBI_ERR_INVALID_PARAM;
+    i = pmu_first(counters);
+  } else {
+    counters &= pmu_allowed(event_idx, event_data, &select) & ~p->configured;
+    if (!counters)
+      return SBI_ERR_NOT_SUPPORTED;
+    i = pmu_first(counters);
+    p->configured |= 1ULL << i;
+    p->event[i] = event_idx;
+    if (!pmu_is_fw(i)) {
+      p->hpm_select[i] = select;
+      pmu_write_hpmevent(i, 0);
+    }
+  }
+
+  if (flags & SBI_PMU_CFG_FLAG_CLEAR_VALUE)
+    pmu_set(p, i, 0);
+  if ((flags & SBI_PMU_CFG_FLAG_AUTO_START) && !((p->started >> i) & 1))
+    pmu_start(p, i);
+
+  *idx = i;
+  return SBI_SUCCESS;
+}
+
+uintptr_t mcall_pmu_counter_start(uintptr_t base, uintptr_t mask,
+                                  uintptr_t flags, uint64_t value)
+{
+  struct pmu_hart* p = pmu_this_hart();
+  uint64_t counters = pmu_counters(base, mask);
+  uintptr_t i;
+
+  if (!counters || (counters & ~p->configured))
+    return SBI_ERR_INVALID_PARAM;
+  if (counters & p->started)
+    return SBI_ERR_ALREADY_STARTED;
+
+  for (i = 0; counters >> i; i++) {
+    if (!((counters >> i) & 1))
+      continue;
+    if (flags & SBI_PMU_START_SET_INIT_VALUE)
+      pmu_set(p, i, value);
+    pmu_start(p, i);
+  }
+  return SBI_SUCCESS;
+}
+
+uintptr_t mcall_pmu_counter_stop(uintptr_t base, uintptr_t mask,
+                                 uintptr_t flags)
+{
+  struct pmu_hart* p = pmu_this_hart();
+  uint64_t counters = pmu_counters(base, mask);
+  uintptr_t i;
+
+  if (!counters || (counters & ~p->configured))
+    return SBI_ERR_INVALID_PARAM;
+  if (counters & ~p->started)
+    return SBI_ERR_ALREADY_STOPPED;
+
+  for (i = 0; counters >> i; i++)
+    if ((counters >> i) & 1)
+      pmu_stop(p, i);
+  if (flags & SBI_PMU_STOP_FLAG_RESET)
+    p->configured &= ~counters;
+  return SBI_SUCCESS;
+}
+
+uintptr_t mcall_pmu_counter_fw_read(uintptr_t i, uint64_t* value)
+{
+  struct pmu_hart* p = pmu_this_hart();
+
+  if (!pmu_is_fw(i) || i >= mcall_pmu_num_counters() ||
+      !((p->configured >> i) & 1))
+    return SBI_ERR_INVALID_PARAM;
+  *value = pmu_fw_value(p, i);
+  return SBI_SUCCESS;
+}
@@ -0,0 +1,73 @@
+#ifndef _RISCV_PMU_H
+#define _RISCV_PMU_H
+
+#include <stdint.h>
+#include "mtrap.h"
+
+// SBI PMU event_idx: type in [19:16], code in [15:0]
+#define SBI_PMU_EVENT_TYPE(idx) (((idx) >> 16) & 0xf)
+#define SBI_PMU_EVENT_CODE(idx) ((idx) & 0xffff)
+#define SBI_PMU_TYPE_HW         0
+#define SBI_PMU_TYPE_HW_CACHE   1
+#define SBI_PMU_TYPE_HW_RAW     2
+#define SBI_PMU_TYPE_FW         0xf
+
+#define SBI_PMU_HW_CPU_CYCLES   1
+#define SBI_PMU_HW_INSTRUCTIONS 2
+
+// firmware events bbl counts
+#define SBI_PMU_FW_MISALIGNED_LOAD     0
+#define SBI_PMU_FW_MISALIGNED_STORE    1
+#define SBI_PMU_FW_ACCESS_LOAD         2
+#define SBI_PMU_FW_ACCESS_STORE        3
+#define SBI_PMU_FW_ILLEGAL_INSN        4
+#define SBI_PMU_FW_SET_TIMER           5
+#define SBI_PMU_FW_IPI_SENT            6
+#define SBI_PMU_FW_FENCE_I_SENT        8
+#define SBI_PMU_FW_SFENCE_VMA_SENT     10
+#define SBI_PMU_FW_SFENCE_VMA_ASID_SENT 12
+#define SBI_PMU_FW_MAX                 16
+
+// cfg_match, start and stop flags
+#define SBI_PMU_CFG_FLAG_SKIP_MATCH  0x1
+#define SBI_PMU_CFG_FLAG_CLEAR_VALUE 0x2
+#define SBI_PMU_CFG_FLAG_AUTO_START  0x4
+#define SBI_PMU_START_SET_INIT_VALUE 0x1
+#define SBI_PMU_STOP_FLAG_RESET      0x1
+
+// Logical counters: 0..31 are cycle, time, instret and hpmcounter3..31
+// (those the device tree names), then the firmware counters.
+#define PMU_HW_COUNTERS 32
+#define PMU_FW_COUNTERS SBI_PMU_FW_MAX
+
+struct pmu_hart {
+  uint64_t fw_events[SBI_PMU_FW_MAX]; // always counting
+  uint64_t fw_base[PMU_FW_COUNTERS];  // fw_events[] when the counter started
+  uint64_t fw_value[PMU_FW_COUNTERS]; // value when it started or stopped
+  uint64_t hpm_select[PMU_HW_COUNTERS]; // mhpmevent value while running
+  uint32_t event[PMU_HW_COUNTERS + PMU_FW_COUNTERS];
+  uint64_t configured; // counters handed out by cfg_match
+  uint64_t started;
+} __attribute__((aligned(1 << PMU_HART_SHIFT)));
+
+extern struct pmu_hart pmu_harts[];
+
+static inline void pmu_fw_count(int event)
+{
+  pmu_harts[read_const_csr(mhartid)].fw_events[event]++;
+}
+
+void query_pmu(uintptr_t fdt);
+extern const struct fdt_cb query_pmu_cb; // for fdt_scan_all
+uintptr_t mcall_pmu_num_counters();
+uintptr_t mcall_pmu_counter_get_info(uintptr_t idx, uintptr_t* info);
+uintptr_t mcall_pmu_counter_config_matching(uintptr_t base, uintptr_t mask,
+                                            uintptr_t flags, uintptr_t event_idx,
+                                            uint64_t event_data, uintptr_t* idx);
+uintptr_t mcall_pmu_counter_start(uintptr_t base, uintptr_t mask,
+                                  uintptr_t flags, uint64_t value);
+uintptr_t mcall_pmu_counter_stop(uintptr_t base, uintptr_t mask,
+                                 uintptr_t flags);
+uintptr_t mcall_pmu_counter_fw_read(uintptr_t idx, uint64_t* value);
+
+#endif
@@ -0,0 +1,234 @@
+// See LICENSE for license details.
+
+// M-mode trap profiler. mentry.S times each trap_table handler with rdcycle
+// and reports here on the way out; mcall_trap does the same per SBI call.
+// Counters are per hart and only touched by their own hart, so updates
+// need no atomics; a reader on another hart may see a torn snapshot.
+
+#include "trap_profile.h"
+#include "mtrap.h"
+#include "mcall.h"
+#include "fdt.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef PK_ENABLE_TRAP_PROFILE
+
+static struct trap_profile trap_profile[MAX_HARTS];
+
+static struct trap_hotspot_table {
+  struct trap_hotspot slots[TRAP_HOTSPOT_SLOTS];
+  uintptr_t countdown; // traps to skip before the next sample
+} trap_hotspots[MAX_HARTS];
+
+static const char* const trap_profile_names[TRAP_PROFILE_VECTORS] = {
+  [0]  = "bad trap",
+  [1]  = "fetch access",
+  [2]  = "illegal insn",
+  [4]  = "misaligned load",
+  [5]  = "load access",
+  [6]  = "misaligned store",
+  [7]  = "store access",
+  [9]  = "ecall",
+  [13] = "trap from M-mode",
+  [16] = "pmp ipi",
+  [17] = "external irq",
+};
+
+struct trap_profile* trap_profile_get(uintptr_t hartid)
+{
+  if (hartid >= MAX_HARTS || !((hart_mask >> hartid) & 1))
+    return NULL;
+  return &trap_profile[hartid];
+}
+
+static void trap_profile_count(struct trap_profile_counter* c, uintptr_t cycles)
+{
+  uintptr_t b = 0, v = cycles >> TRAP_PROFILE_HIST_SHIFT;
+
+  // bucket = bit length of v; without Zbb clz comes from libgcc
+  if (v)
+    b = __riscv_xlen - __builtin_clzl(v);
+  if (b > TRAP_PROFILE_BUCKETS - 1)
+    b = TRAP_PROFILE_BUCKETS - 1;
+
+  c->count++;
+  c->cycles += cycles;
+  c->hist[b]++;
+}
+
+void trap_profile_record(uintptr_t vector, uintptr_t cycles)
+{
+  struct trap_profile* p = &trap_profile[read_const_csr(mhartid)];
+  trap_profile_count(&p->vectors[vector % TRAP_PROFILE_VECTORS], cycles);
+}
+
+// Handlers that hand the trap to S-mode leave through __redirect_trap and
+// never get back to mentry.S; charge them to the outermost trap, whose
+// vector and start time mentry.S also left in the HLS.
+void trap_profile_redirect()
+{
+  trap_profile_record(HLS()->prof_vector, rdcycle() - HLS()->prof_start);
+}
+
+void trap_profile_sbi(uintptr_t eid, uintptr_t fid, uintptr_t cycles)
+{
+  struct trap_profile* p = &trap_profile[read_const_csr(mhartid)];
+  uintptr_t i, h;
+
+  if (eid < SBI_EXT_BASE)
+    fid = 0; // legacy calls don't pass one
+
+  // open addressing; entries are never removed until a reset
+  h = (eid * 31 + fid) % TRAP_PROFILE_SBI_SLOTS;
+  for (i = 0; i < TRAP_PROFILE_SBI_SLOTS; i++) {
+    struct trap_profile_sbi* s = &p->sbi[(h + i) % TRAP_PROFILE_SBI_SLOTS];
+    if (!s->c.count) {
+      s->eid = eid;
+      s->fid = fid;
+    } else if (s->eid != eid || s->fid != fid) {
+      continue;
+    }
+    trap_profile_count(&s->c, cycles);
+    return;
+  }
+  p->sbi_dropped++;
+}
+
+void trap_profile_decode(int hit)
+{
+  struct trap_profile* p = &trap_profile[read_const_csr(mhartid)];
+  if (hit)
+    p->decode_hits++;
+  else
+    p->decode_misses++;
+}
+
+void trap_hotspot_record(uintptr_t cause, uintptr_t mepc)
+{
+  struct trap_hotspot_table* t = &trap_hotspots[read_const_csr(mhartid)];
+  struct trap_hotspot *s, *victim = NULL;
+  uintptr_t i, h, satp;
+
+  if (t->countdown) {
+    t->countdown--;
+    return;
+  }
+  t->countdown = TRAP_HOTSPOT_PERIOD - 1;
+
+  satp = supports_extension('S') ? read_csr(sptbr) : 0;
+  h = mepc_satp_hash(mepc, satp) % TRAP_HOTSPOT_SLOTS;
+  for (i = 0; i < TRAP_HOTSPOT_PROBE; i++) {
+    s = &t->slots[(h + i) % TRAP_HOTSPOT_SLOTS];
+    if (s->samples && s->mepc == mepc && s->satp == satp && s->cause == cause) {
+      s->samples++;
+      return;
+    }
+    if (!victim || s->samples < victim->samples)
+      victim = s;
+  }
+
+  victim->mepc = mepc;
+  victim->satp = satp;
+  victim->cause = cause;
+  victim->samples++;
+}
+
+// Point top[] at the n busiest locations of a hart, busiest first
+uintptr_t trap_hotspot_top(uintptr_t hartid, const struct trap_hotspot** top,
+                           uintptr_t n)
+{
+  struct trap_hotspot* slots = trap_hotspots[hartid].slots;
+  uint64_t taken = 0;
+  uintptr_t i, j, best;
+
+  _Static_assert(TRAP_HOTSPOT_SLOTS <= 64, "taken is a 64-bit mask");
+
+  for (i = 0; i < n; i++) {
+    best = TRAP_HOTSPOT_SLOTS;
+    for (j = 0; j < TRAP_HOTSPOT_SLOTS; j++) {
+      if (((taken >> j) & 1) || !slots[j].samples)
+        continue;
+      if (best == TRAP_HOTSPOT_SLOTS || slots[j].samples > slots[best].samples)
+        best = j;
+    }
+    if (best == TRAP_HOTSPOT_SLOTS)
+      break;
+    taken |= 1ULL << best;
+    top[i] = &slots[best];
+  }
+  return i;
+}
+
+void trap_profile_reset()
+{
+  memset(trap_profile, 0, sizeof(trap_profile));
+  memset(trap_hotspots, 0, sizeof(trap_hotspots));
+}
+
+static void trap_profile_dump_counter(const char* prefix,
+                                      struct trap_profile_counter* c)
+{
+  char hist[TRAP_PROFILE_BUCKETS * 21 + 1];
+  size_t pos = 0;
+  int i, last = 0;
+
+  for (i = 0; i < TRAP_PROFILE_BUCKETS; i++)
+    if (c->hist[i])
+      last = i;
+  hist[0] = 0;
+  for (i = 0; i <= last; i++)
+    pos += snprintf(hist + pos, sizeof(hist) - pos, " %ld", (long)c->hist[i]);
+
+  printm("%s: %ld, avg %ld cycles, hist%s\r\n", prefix, (long)c->count,
+         (long)(c->cycles / c->count), hist);
+}
+
+void trap_profile_dump()
+{
+  char prefix[48];
+  uintptr_t hart;
+  int i;
+
+  for (hart = 0; hart < MAX_HARTS; hart++) {
+    struct trap_profile* p = trap_profile_get(hart);
+    if (!p)
+      continue;
+
+    for (i = 0; i < TRAP_PROFILE_VECTORS; i++) {
+      if (!p->vectors[i].count)
+        continue;
+      if (trap_profile_names[i])
+        snprintf(prefix, sizeof(prefix), "trap profile: hart %ld %s",
+                 (long)hart, trap_profile_names[i]);
+      else
+        snprintf(prefix, sizeof(prefix), "trap profile: hart %ld vector %d",
+                 (long)hart, i);
+      trap_profile_dump_counter(prefix, &p->vectors[i]);
+    }
+
+    for (i = 0; i < TRAP_PROFILE_SBI_SLOTS; i++) {
+      if (!p->sbi[i].c.count)
+        continue;
+      snprintf(prefix, sizeof(prefix), "trap profile: hart %ld sbi %x/%d",
+               (long)hart, (int)p->sbi[i].eid, (int)p->sbi[i].fid);
+      trap_profile_dump_counter(prefix, &p->sbi[i].c);
+    }
+    if (p->sbi_dropped)
+      printm("trap profile: hart %ld sbi: %ld calls not recorded\r\n",
+             (long)hart, (long)p->sbi_dropped);
+    if (p->decode_hits + p->decode_misses)
+      printm("trap profile: hart %ld decode cache: %ld hits, %ld misses (%d percent)\r\n",
+             (long)hart, (long)p->decode_hits, (long)p->decode_misses,
+             (int)(p->decode_hits * 100 / (p->decode_hits + p->decode_misses)));
+
+    const struct trap_hotspot* top[8];
+    uintptr_t n = trap_hotspot_top(hart, top, sizeof(top) / sizeof(top[0]));
+    for (i = 0; i < n; i++)
+      printm("trap profile: hart %ld hotspot pc %lx satp %lx cause %d: ~%ld\r\n",
+             (long)hart, (long)top[i]->mepc, (long)top[i]->satp,
+             (int)top[i]->cause, (long)(top[i]->samples * TRAP_HOTSPOT_PERIOD));
+  }
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef _RISCV_TRAP_PROFILE_H
+#define _RISCV_TRAP_PROFILE_H
+
+#include <stdint.h>
+#include "config.h"
+
+// Per-hart M-mode trap profile (--enable-trap-profile). Every trap that
+// reaches a trap_table handler is counted under its vector (the mcause for
+// exceptions) together with the cycles its handler took; SBI calls are
+// counted a second time under their (EID, FID). An S-mode caller gets a
+// copy with SBI_EXT_BBL_TRAP_PROFILE_READ, so the layout below is ABI.
+//
+// The timer, IPI and rdtime fast paths in mentry.S never reach a handler
+// and are not counted.
+
+#define TRAP_PROFILE_VECTORS   32
+#define TRAP_PROFILE_SBI_SLOTS 32
+// histogram bucket 0 is < 32 cycles, bucket i is [2^(i+4), 2^(i+5)) and
+// the last one is open-ended
+#define TRAP_PROFILE_BUCKETS   16
+#define TRAP_PROFILE_HIST_SHIFT 5
+
+struct trap_profile_counter {
+  uint64_t count;
+  uint64_t cycles;
+  uint64_t hist[TRAP_PROFILE_BUCKETS];
+};
+
+struct trap_profile_sbi {
+  uint64_t eid;
+  uint64_t fid; // 0 for legacy calls
+  struct trap_profile_counter c;
+};
+
+struct trap_profile {
+  struct trap_profile_counter vectors[TRAP_PROFILE_VECTORS];
+  struct trap_profile_sbi sbi[TRAP_PROFILE_SBI_SLOTS];
+  uint64_t sbi_dropped; // calls that found the SBI table full
+  uint64_t decode_hits; // decode_cache_lookup() outcomes
+  uint64_t decode_misses;
+};
+
+// Where misaligned accesses and emulated instructions come from: every
+// TRAP_HOTSPOT_PERIOD-th such trap on a hart is sampled into a small
+// table keyed by (mepc, satp, cause). When the table is full a new key
+// takes over the least-sampled entry it probes, inheriting its count
+// (space-saving), so the heavy hitters stay while the tail churns.
+// SBI_EXT_BBL_TRAP_HOTSPOT_READ copies out the top entries. rdtime is
+// emulated in mentry.S without sampling, so it never shows up here; its
+// traps are still counted by the PMU's SBI_PMU_FW_ILLEGAL_INSN.
+#define TRAP_HOTSPOT_SLOTS  64
+#define TRAP_HOTSPOT_PROBE  8
+#define TRAP_HOTSPOT_PERIOD 4
+
+struct trap_hotspot {
+  uint64_t mepc;
+  uint64_t satp;    // S-mode satp at the time; identifies the address space
+  uint64_t cause;   // mcause of the trap
+  uint64_t samples; // times sampled; multiply by TRAP_HOTSPOT_PERIOD
+};
+
+#ifdef PK_ENABLE_TRAP_PROFILE
+struct trap_profile* trap_profile_get(uintptr_t hartid);
+void trap_profile_record(uintptr_t vector, uintptr_t cycles);
+void trap_profile_sbi(uintptr_t eid, uintptr_t fid, uintptr_t cycles);
+void trap_profile_redirect();
+void trap_profile_reset();
+void trap_profile_dump();
+void trap_hotspot_record(uintptr_t cause, uintptr_t mepc);
+void trap_profile_decode(int hit);
+uintptr_t trap_hotspot_top(uintptr_t hartid, const struct trap_hotspot** top,
+                           uintptr_t n);
+#else
+static inline void trap_hotspot_record(uintptr_t cause, uintptr_t mepc) {}
+static inline void trap_profile_decode(int hit) {}
+#endif
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _RISCV_TX_RING_H
+#define _RISCV_TX_RING_H
+
+#include "atomic.h"
+#include <stddef.h>
+
+// Transmit buffer between M-mode console writers and a UART. Writers
+// queue bytes and return; the driver moves them into the hardware FIFO
+// in bursts whenever it gets the chance. All fields are protected by
+// 'lock' except that tx_ring_count() may be read without it as a hint.
+
+#define TX_RING_SIZE 2048 // power of two
+
+struct tx_ring {
+  spinlock_t lock;
+  volatile unsigned int head; // next byte to queue
+  volatile unsigned int tail; // next byte to send
+  char buf[TX_RING_SIZE];
+};
+
+static inline unsigned int tx_ring_count(struct tx_ring* r)
+{
+  return r->head - r->tail;
+}
+
+static inline unsigned int tx_ring_space(struct tx_ring* r)
+{
+  return TX_RING_SIZE - tx_ring_count(r);
+}
+
+static inline void tx_ring_put(struct tx_ring* r, char ch)
+{
+  r->buf[r->head & (TX_RING_SIZE - 1)] = ch;
+  r->head++;
+}
+
+static inline char tx_ring_peek(struct tx_ring* r)
+{
+  return r->buf[r->tail & (TX_RING_SIZE - 1)];
+}
+
+static inline void tx_ring_pop(struct tx_ring* r)
+{
+  r->tail++;
+}
+
+#endif
@@ -1,26 +1,89 @@
 #include <string.h>
 #include "uart.h"
 #include "fdt.h"
+#include "tx_ring.h"
 
 volatile uint32_t* uart;
+uint32_t uart_irq;
 
-void uart_putchar(uint8_t ch)
+static struct tx_ring tx;
+static int tx_irq_enabled;
+
+// Try to hand one byte to the TX FIFO; nonzero if the FIFO was full
+static int uart_try_putchar(uint8_t ch)
 {
 #ifdef __riscv_atomic
     int32_t r;
-    do {
-      __asm__ __volatile__ (
-        "amoor.w %0, %2, %1\n"
-        : "=r" (r), "+A" (uart[UART_REG_TXFIFO])
-        : "r" (ch));
-    } while (r < 0);
+    __asm__ __volatile__ (
+      "amoor.w %0, %2, %1\n"
+      : "=r" (r), "+A" (uart[UART_REG_TXFIFO])
+      : "r" (ch));
+    return r < 0;
 #else
     volatile uint32_t *tx = uart + UART_REG_TXFIFO;
-    while ((int32_t)(*tx) < 0);
+    if ((int32_t)(*tx) < 0)
+      return 1;
     *tx = ch;
+    return 0;
 #endif
 }
 
+// Fill the TX FIFO from the ring until it is full. Call with tx.lock.
+static void uart_burst()
+{
+  while (tx_ring_count(&tx) && !uart_try_putchar(tx_ring_peek(&tx)))
+    tx_ring_pop(&tx);
+
+  // the TX watermark interrupt calls us back for the rest
+  if (tx_irq_enabled)
+    uart[UART_REG_IE] = tx_ring_count(&tx) ? UART_IP_TXWM : 0;
+}
+
+void uart_write(const char* buf, size_t len)
+{
+  spinlock_lock(&tx.lock);
+  while (len) {
+    // ring full: wait for the FIFO to make room
+    while (!tx_ring_space(&tx))
+      uart_burst();
+    for (; len && tx_ring_space(&tx); len--)
+      tx_ring_put(&tx, *buf++);
+  }
+  uart_burst();
+  spinlock_unlock(&tx.lock);
+}
+
+void uart_putchar(uint8_t ch)
+{
+  char c = ch;
+  uart_write(&c, 1);
+}
+
+// Opportunistic: skip it if someone else is already at the UART
+void uart_drain()
+{
+  if (!tx_ring_count(&tx) || spinlock_trylock(&tx.lock))
+    return;
+  uart_burst();
+  spinlock_unlock(&tx.lock);
+}
+
+void uart_flush()
+{
+  spinlock_lock(&tx.lock);
+  while (tx_ring_count(&tx))
+    uart_burst();
+  spinlock_unlock(&tx.lock);
+}
+
+void uart_enable_tx_irq()
+{
+  // interrupt once the FIFO has drained below one entry
+  uart[UART_REG_TXCTRL] = UART_TXEN | UART_TXCNT(1);
+  tx_irq_enabled = 1;
+  uart_drain();
+}
+
 int uart_getchar()
 {
   int32_t ch = uart[UART_REG_RXFIFO];
@@ -32,6 +95,9 @@ struct uart_scan
 {
   int compat;
   uint64_t reg;
+  uint32_t irq;
+  uint32_t clock;
+  uint32_t baud;
 };
 
 static void uart_open(const struct fdt_scan_node *node, void *extra)
@@ -43,10 +109,16 @@ static void uart_open(const struct fdt_scan_node *node, void *extra)
 static void uart_prop(const struct fdt_scan_prop *prop, void *extra)
 {
   struct uart_scan *scan = (struct uart_scan *)extra;
-  if (!strcmp(prop->name, "compatible") && !strcmp((const char*)prop->value, "sifive,uart0")) {
+  if (prop->key == FDT_KEY_COMPATIBLE && !strcmp((const char*)prop->value, "sifive,uart0")) {
     scan->compat = 1;
-  } else if (!strcmp(prop->name, "reg")) {
+  } else if (prop->key == FDT_KEY_REG) {
     fdt_get_address(prop->node->parent, prop->value, &scan->reg);
+  } else if (!strcmp(prop->name, "interrupts")) {
+    scan->irq = fdt_get_u32(prop);
+  } else if (!strcmp(prop->name, "clock-frequency")) {
+    scan->clock = fdt_get_u32(prop);
+  } else if (!strcmp(prop->name, "current-speed")) {
+    scan->baud = fdt_get_u32(prop);
   }
 }
 
@@ -57,20 +129,25 @@ static void uart_done(const struct fdt_scan_node *node, void *extra)
 
   // Enable Rx/Tx channels
   uart = (void*)(uintptr_t)scan->reg;
+  uart_irq = scan->irq;
   uart[UART_REG_TXCTRL] = UART_TXEN;
   uart[UART_REG_RXCTRL] = UART_RXEN;
+
+  // baud = clock / (div + 1); otherwise keep what the boot ROM set
+  if (scan->clock && scan->baud && scan->clock / scan->baud)
+    uart[UART_REG_DIV] = scan->clock / scan->baud - 1;
 }
 
-void query_uart(uintptr_t fdt)
-{
-  struct fdt_cb cb;
-  struct uart_scan scan;
+static struct uart_scan uart_scan;
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = uart_open;
-  cb.prop = uart_prop;
-  cb.done = uart_done;
-  cb.extra = &scan;
+const struct fdt_cb query_uart_cb = {
+  .open = uart_open,
+  .prop = uart_prop,
+  .done = uart_done,
+  .extra = &uart_scan,
+};
 
-  fdt_scan(fdt, &cb);
+void query_uart(uintptr_t fdt)
+{
+  fdt_scan(fdt, &query_uart_cb);
 }
@@ -2,20 +2,31 @@
 #define _RISCV_UART_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 extern volatile uint32_t* uart;
+extern uint32_t uart_irq; // PLIC source, 0 if unknown
 
 #define UART_REG_TXFIFO		0
 #define UART_REG_RXFIFO		1
 #define UART_REG_TXCTRL		2
 #define UART_REG_RXCTRL		3
-#define UART_REG_DIV		4
+#define UART_REG_IE		4
+#define UART_REG_IP		5
+#define UART_REG_DIV		6
 
 #define UART_TXEN		 0x1
 #define UART_RXEN		 0x1
+#define UART_TXCNT(n)		 ((n) << 16)
+#define UART_IP_TXWM		 0x1
 
 void uart_putchar(uint8_t ch);
+void uart_write(const char* buf, size_t len);
+void uart_drain();
+void uart_flush();
+void uart_enable_tx_irq();
 int uart_getchar();
 void query_uart(uintptr_t dtb);
+extern const struct fdt_cb query_uart_cb; // for fdt_scan_all
 
 #endif
@@ -1,18 +1,87 @@
 #include <string.h>
 #include "uart16550.h"
 #include "fdt.h"
+#include "tx_ring.h"
 
 volatile uint8_t* uart16550;
+uint32_t uart16550_irq;
 
 #define UART_REG_QUEUE     0
+#define UART_REG_DLL       0
+#define UART_REG_IER       1
+#define UART_REG_DLM       1
+#define UART_REG_FCR       2
+#define UART_REG_LCR       3
 #define UART_REG_LINESTAT  5
 #define UART_REG_STATUS_RX 0x01
 #define UART_REG_STATUS_TX 0x20
+#define UART_IER_THRE      0x02
+#define UART_LCR_DLAB      0x80
+#define UART16550_FIFO_SIZE 16
+
+#define UART16550_DEFAULT_DIVISOR 3 // 38400 baud off a 1.8432 MHz clock
+
+static struct tx_ring tx;
+static int tx_irq_enabled;
+
+// Move one FIFO's worth of queued bytes into the UART, if it can take
+// them. THRE means the whole transmit FIFO is empty. Call with tx.lock.
+static void uart16550_burst()
+{
+  if (!(uart16550[UART_REG_LINESTAT] & UART_REG_STATUS_TX))
+    return;
+
+  for (int n = 0; n < UART16550_FIFO_SIZE && tx_ring_count(&tx); n++) {
+    uart16550[UART_REG_QUEUE] = tx_ring_peek(&tx);
+    tx_ring_pop(&tx);
+  }
+
+  // let THRE call us back for the rest
+  if (tx_irq_enabled)
+    uart16550[UART_REG_IER] = tx_ring_count(&tx) ? UART_IER_THRE : 0;
+}
+
+void uart16550_write(const char* buf, size_t len)
+{
+  spinlock_lock(&tx.lock);
+  while (len) {
+    // ring full: wait for the FIFO to make room
+    while (!tx_ring_space(&tx))
+      uart16550_burst();
+    for (; len && tx_ring_space(&tx); len--)
+      tx_ring_put(&tx, *buf++);
+  }
+  uart16550_burst();
+  spinlock_unlock(&tx.lock);
+}
 
 void uart16550_putchar(uint8_t ch)
 {
-  while ((uart16550[UART_REG_LINESTAT] & UART_REG_STATUS_TX) == 0);
-  uart16550[UART_REG_QUEUE] = ch;
+  char c = ch;
+  uart16550_write(&c, 1);
+}
+
+// Opportunistic: skip it if someone else is already at the UART
+void uart16550_drain()
+{
+  if (!tx_ring_count(&tx) || spinlock_trylock(&tx.lock))
+    return;
+  uart16550_burst();
+  spinlock_unlock(&tx.lock);
+}
+
+void uart16550_flush()
+{
+  spinlock_lock(&tx.lock);
+  while (tx_ring_count(&tx))
+    uart16550_burst();
+  spinlock_unlock(&tx.lock);
+}
+
+void uart16550_enable_tx_irq()
+{
+  tx_irq_enabled = 1;
+  uart16550_drain();
 }
 
 int uart16550_getchar()
@@ -26,6 +95,9 @@ struct uart16550_scan
 {
   int compat;
   uint64_t reg;
+  uint32_t irq;
+  uint32_t clock;
+  uint32_t baud;
 };
 
 static void uart16550_open(const struct fdt_scan_node *node, void *extra)
@@ -37,10 +109,16 @@ static void uart16550_open(const struct fdt_scan_node *node, void *extra)
 static void uart16550_prop(const struct fdt_scan_prop *prop, void *extra)
 {
   struct uart16550_scan *scan = (struct uart16550_scan *)extra;
-  if (!strcmp(prop->name, "compatible") && !strcmp((const char*)prop->value, "ns16550a")) {
+  if (prop->key == FDT_KEY_COMPATIBLE && !strcmp((const char*)prop->value, "ns16550a")) {
     scan->compat = 1;
-  } else if (!strcmp(prop->name, "reg")) {
+  } else if (prop->key == FDT_KEY_REG) {
     fdt_get_address(prop->node->parent, prop->value, &scan->reg);
+  } else if (!strcmp(prop->name, "interrupts")) {
+    scan->irq = fdt_get_u32(prop);
+  } else if (!strcmp(prop->name, "clock-frequency")) {
+    scan->clock = fdt_get_u32(prop);
+  } else if (!strcmp(prop->name, "current-speed")) {
+    scan->baud = fdt_get_u32(prop);
   }
 }
 
@@ -49,26 +127,31 @@ static void uart16550_done(const struct fdt_scan_node *node, void *extra)
   struct uart16550_scan *scan = (struct uart16550_scan *)extra;
   if (!scan->compat || !scan->reg || uart16550) return;
 
+  uint32_t divisor = UART16550_DEFAULT_DIVISOR;
+  if (scan->clock && scan->baud && scan->clock / (16 * scan->baud))
+    divisor = scan->clock / (16 * scan->baud);
+
   uart16550 = (void*)(uintptr_t)scan->reg;
+  uart16550_irq = scan->irq;
   // http://wiki.osdev.org/Serial_Ports
-  uart16550[1] = 0x00;    // Disable all interrupts
-  uart16550[3] = 0x80;    // Enable DLAB (set baud rate divisor)
-  uart16550[0] = 0x03;    // Set divisor to 3 (lo byte) 38400 baud
-  uart16550[1] = 0x00;    //                  (hi byte)
-  uart16550[3] = 0x03;    // 8 bits, no parity, one stop bit
-  uart16550[2] = 0xC7;    // Enable FIFO, clear them, with 14-byte threshold
+  uart16550[UART_REG_IER] = 0x00;          // Disable all interrupts
+  uart16550[UART_REG_LCR] = UART_LCR_DLAB; // Enable DLAB (set baud rate divisor)
+  uart16550[UART_REG_DLL] = divisor & 0xff;
+  uart16550[UART_REG_DLM] = divisor >> 8;
+  uart16550[UART_REG_LCR] = 0x03;          // 8 bits, no parity, one stop bit
+  uart16550[UART_REG_FCR] = 0xC7;          // Enable FIFO, clear them, with 14-byte threshold
 }
 
-void query_uart16550(uintptr_t fdt)
-{
-  struct fdt_cb cb;
-  struct uart16550_scan scan;
+static struct uart16550_scan uart16550_scan;
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = uart16550_open;
-  cb.prop = uart16550_prop;
-  cb.done = uart16550_done;
-  cb.extra = &scan;
+const struct fdt_cb query_uart16550_cb = {
+  .open = uart16550_open,
+  .prop = uart16550_prop,
+  .done = uart16550_done,
+  .extra = &uart16550_scan,
+};
 
-  fdt_scan(fdt, &cb);
+void query_uart16550(uintptr_t fdt)
+{
+  fdt_scan(fdt, &query_uart16550_cb);
 }
@@ -2,11 +2,18 @@
 #define _RISCV_16550_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 extern volatile uint8_t* uart16550;
+extern uint32_t uart16550_irq; // PLIC source, 0 if unknown
 
 void uart16550_putchar(uint8_t ch);
+void uart16550_write(const char* buf, size_t len);
+void uart16550_drain();
+void uart16550_flush();
+void uart16550_enable_tx_irq();
 int uart16550_getchar();
 void query_uart16550(uintptr_t dtb);
+extern const struct fdt_cb query_uart16550_cb; // for fdt_scan_all
 
 #endif
@@ -0,0 +1,146 @@
+//******************************************************************************
+// Copyright (c) 2018, The Regents of the University of California (Regents).
+// All Rights Reserved. See LICENSE for license details.
+//------------------------------------------------------------------------------
+#ifndef _EDGE_RING_H_
+#define _EDGE_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* Exit-less edge call ring
+ *
+ * A single-producer/single-consumer ring living in the UTM. The enclave
+ * runtime is the only producer, a host worker thread (usually on another
+ * hart) the only consumer. The SM places and initializes the ring at
+ * create time, from params.edge_ring_offset/edge_ring_size; after that
+ * both sides use it without the SM. The enclave only stops
+ * (STOP_EDGE_RING_BLOCK) when the ring is full or when it has to wait
+ * for the host.
+ *
+ * This header is shared by the SM, the enclave runtime and the host, so
+ * it only depends on the compiler's __atomic builtins.
+ */
+
+#define EDGE_RING_MAGIC       0x676e6972656764ULL /* "dgering" */
+#define EDGE_RING_ALIGN       64
+#define EDGE_RING_SLOT_SIZE   128
+#define EDGE_RING_DATA_SIZE   (EDGE_RING_SLOT_SIZE - 2 * sizeof(uint64_t))
+
+struct edge_ring_slot
+{
+  uint64_t call_id;
+  uint64_t size;
+  uint8_t data[EDGE_RING_DATA_SIZE];
+};
+
+struct edge_ring
+{
+  uint64_t magic;
+  uint64_t nslots; /* power of two */
+
+  /* producer and consumer indices live on their own cache lines */
+  uint64_t head __attribute__((aligned(EDGE_RING_ALIGN)));
+  uint64_t tail __attribute__((aligned(EDGE_RING_ALIGN)));
+
+  struct edge_ring_slot slots[] __attribute__((aligned(EDGE_RING_ALIGN)));
+};
+
+#define EDGE_RING_MIN_SIZE (sizeof(struct edge_ring) + EDGE_RING_SLOT_SIZE)
+
+/* Number of slots a ring of 'size' bytes holds, 0 if it is too small */
+static inline uint64_t edge_ring_nslots(size_t size)
+{
+  uint64_t n, nslots = 1;
+
+  if(size < EDGE_RING_MIN_SIZE)
+    return 0;
+
+  n = (size - sizeof(struct edge_ring)) / EDGE_RING_SLOT_SIZE;
+  while(nslots * 2 <= n)
+    nslots *= 2;
+  return nslots;
+}
+
+/* Called by the SM on the (zeroed) UTM */
+static inline int edge_ring_init(struct edge_ring* ring, size_t size)
+{
+  uint64_t nslots = edge_ring_nslots(size);
+
+  if(!nslots)
+    return -1;
+
+  ring->nslots = nslots;
+  ring->head = 0;
+  ring->tail = 0;
+  __atomic_store_n(&ring->magic, EDGE_RING_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*** producer (enclave) ***/
+
+/* Returns 0 if the call was posted, -1 if the ring is full */
+static inline int edge_ring_post(struct edge_ring* ring, uint64_t call_id,
+                                 const void* data, size_t size)
+{
+  uint64_t head = ring->head;
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  struct edge_ring_slot* slot;
+
+  if(size > EDGE_RING_DATA_SIZE || head - tail >= ring->nslots)
+    return -1;
+
+  slot = &ring->slots[head & (ring->nslots - 1)];
+  slot->call_id = call_id;
+  slot->size = size;
+  memcpy(slot->data, data, size);
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Nonzero once the consumer has caught up with everything posted */
+static inline int edge_ring_empty(struct edge_ring* ring)
+{
+  return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head;
+}
+
+/*** consumer (host) ***/
+
+/* Next request, or NULL if there is none. The slot stays valid until
+ * edge_ring_release(). */
+static inline struct edge_ring_slot* edge_ring_peek(struct edge_ring* ring)
+{
+  uint64_t tail = ring->tail;
+
+  if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+    return NULL;
+
+  return &ring->slots[tail & (ring->nslots - 1)];
+}
+
+static inline void edge_ring_release(struct edge_ring* ring)
+{
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Reference consumer: hand every pending request to 'handler' and
+ * return how many were serviced. A host worker thread calls this in a
+ * loop; the driver also calls it once when the enclave stops with
+ * ENCLAVE_EDGE_RING_BLOCKED before resuming it. */
+static inline unsigned long edge_ring_drain(struct edge_ring* ring,
+    void (*handler)(void* ctx, struct edge_ring_slot* slot), void* ctx)
+{
+  struct edge_ring_slot* slot;
+  unsigned long n = 0;
+
+  while((slot = edge_ring_peek(ring)) != NULL) {
+    handler(ctx, slot);
+    edge_ring_release(ring);
+    n++;
+  }
+  return n;
+}
+
+#endif
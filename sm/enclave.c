@@ -3,6 +3,7 @@
 // All Rights Reserved. See LICENSE for license details.
 //------------------------------------------------------------------------------
 #include "enclave.h"
+#include "edge_ring.h"
 #include "mprv.h"
 #include "pmp.h"
 #include "page.h"
@@ -10,15 +11,44 @@
 #include <string.h>
 #include "atomic.h"
 #include "platform.h"
+#include "plugins/plugins.h"
 
-#define ENCL_MAX  16
 #define ENCL_TIME_SLICE 100000
+/* Longest slice the host may ask for; also keeps now + slice from wrapping */
+#define ENCL_TIME_SLICE_MAX (100 * ENCL_TIME_SLICE)
+#define ENCL_TIMER_INTERRUPT_CAUSE ((1UL << (__riscv_xlen - 1)) | IRQ_M_TIMER)
 
 struct enclave enclaves[ENCL_MAX];
 #define ENCLAVE_EXISTS(eid) (eid >= 0 && eid < ENCL_MAX && enclaves[eid].state >= 0)
 
 static spinlock_t encl_lock = SPINLOCK_INIT;
 
+/* Per-hart time slice bookkeeping for the enclave currently running.
+ * slice_end is the mtime value at which the enclave must give the hart
+ * back; host_timecmp holds the host's timer deadline while the SM has
+ * mtimecmp programmed to the earlier of the two. */
+struct enclave_slice
+{
+  uint64_t slice_end;
+  uint64_t host_timecmp;
+  int host_timecmp_saved;
+};
+static struct enclave_slice slices[MAX_HARTS];
+
+/* mtime at which a slice of time_slice ticks starting now runs out, or 0
+ * for no slicing */
+static uint64_t enclave_slice_end(uint64_t now, uint64_t time_slice)
+{
+  return time_slice ? now + time_slice : 0;
+}
+
+/* What mtimecmp is set to while the enclave runs: the slice may end the
+ * run early, but never pushes the host's deadline back. */
+static uint64_t enclave_timer_deadline(uint64_t slice_end, uint64_t host_timecmp)
+{
+  return slice_end && slice_end < host_timecmp ? slice_end : host_timecmp;
+}
+
 extern void save_host_regs(void);
 extern void restore_host_regs(void);
 extern byte dev_public_key[PUBLIC_KEY_SIZE];
@@ -84,6 +114,15 @@ static inline enclave_ret_code context_switch_to_enclave(uintptr_t* regs,
     }
   }
 
+  // Start a new time slice
+  struct enclave_slice* slice = &slices[read_csr(mhartid)];
+  slice->slice_end = enclave_slice_end(*mtime, enclaves[eid].time_slice);
+  slice->host_timecmp = *HLS()->timecmp;
+  slice->host_timecmp_saved = slice->slice_end != 0;
+  if(slice->host_timecmp_saved)
+    *HLS()->timecmp = enclave_timer_deadline(slice->slice_end,
+                                             slice->host_timecmp);
+
   // Setup any platform specific defenses
   platform_switch_to_enclave(&(enclaves[eid]));
   cpu_enter_enclave_context(eid);
@@ -113,6 +152,14 @@ static inline void context_switch_to_host(uintptr_t* encl_regs,
 
   switch_vector_host();
 
+  // Give the host its timer deadline back; if it already passed,
+  // MTIP is raised again and delivered once we return to the host
+  struct enclave_slice* slice = &slices[read_csr(mhartid)];
+  if(slice->host_timecmp_saved) {
+    *HLS()->timecmp = slice->host_timecmp;
+    slice->host_timecmp_saved = 0;
+  }
+
   uintptr_t pending = read_csr(mip);
 
   if (pending & MIP_MTIP) {
@@ -162,6 +209,20 @@ void enclave_init_metadata(){
 
 }
 
+/* A timer tick may be absorbed only while the current slice has time
+ * left and the host's deadline hasn't come. A zero slice_end means
+ * slicing is disabled. */
+static int enclave_slice_has_time_left(uint64_t now, uint64_t slice_end)
+{
+  return slice_end != 0 && now < slice_end;
+}
+
+static int enclave_timer_absorbs(uint64_t now, uint64_t slice_end,
+                                 uint64_t host_timecmp)
+{
+  return enclave_slice_has_time_left(now, slice_end) && now < host_timecmp;
+}
+
 static enclave_ret_code clean_enclave_memory(uintptr_t utbase, uintptr_t utsize)
 {
 
@@ -235,6 +296,50 @@ uintptr_t get_enclave_region_base(enclave_id eid, int memid)
   return 0;
 }
 
+/* Adds a PMP region to a live enclave. If the enclave is the one running
+ * on this hart the region is opened right away, otherwise it is picked
+ * up by the next context switch. Returns the memid or -1 if full. */
+int enclave_region_attach(enclave_id eid, region_id rid, enum enclave_region_type type)
+{
+  int memid;
+
+  spinlock_lock(&encl_lock);
+  memid = get_enclave_region_index(eid, REGION_INVALID);
+  if(memid >= 0) {
+    enclaves[eid].regions[memid].pmp_rid = rid;
+    enclaves[eid].regions[memid].type = type;
+  }
+  spinlock_unlock(&encl_lock);
+
+  if(memid >= 0 && cpu_is_enclave_context() && cpu_get_enclave_id() == eid)
+    pmp_set(rid, PMP_ALL_PERM);
+
+  return memid;
+}
+
+/* Reverse of enclave_region_attach. Returns -1 if the region is not
+ * attached to the enclave. */
+int enclave_region_detach(enclave_id eid, region_id rid)
+{
+  int memid, found = -1;
+
+  spinlock_lock(&encl_lock);
+  for(memid = 0; memid < ENCLAVE_REGIONS_MAX; memid++) {
+    if(enclaves[eid].regions[memid].type != REGION_INVALID &&
+       enclaves[eid].regions[memid].pmp_rid == rid) {
+      enclaves[eid].regions[memid].type = REGION_INVALID;
+      found = memid;
+      break;
+    }
+  }
+  spinlock_unlock(&encl_lock);
+
+  if(found >= 0 && cpu_is_enclave_context() && cpu_get_enclave_id() == eid)
+    pmp_set(rid, PMP_NO_PERM);
+
+  return found;
+}
+
 /* Ensures that dest ptr is in host, not in enclave regions
  */
 static enclave_ret_code copy_word_to_host(uintptr_t dest_ptr, uintptr_t value)
@@ -309,6 +414,25 @@ static enclave_ret_code copy_enclave_report(struct enclave* enclave,
     return ENCLAVE_SUCCESS;
 }
 
+/* The edge call ring is optional; if present it must sit inside the UTM,
+ * cache-line aligned and large enough for at least one slot */
+static int is_edge_ring_valid(struct runtime_va_params_t* params, size_t utsize)
+{
+  if (params->edge_ring_size == 0)
+    return 1;
+
+  if (params->edge_ring_offset % EDGE_RING_ALIGN)
+    return 0;
+  if (params->edge_ring_size < EDGE_RING_MIN_SIZE)
+    return 0;
+  if (params->edge_ring_offset + params->edge_ring_size < params->edge_ring_offset)
+    return 0;
+  if (params->edge_ring_offset + params->edge_ring_size > utsize)
+    return 0;
+
+  return 1;
+}
+
 static int is_create_args_valid(struct keystone_sbi_create* args)
 {
   uintptr_t epm_start, epm_end;
@@ -355,6 +479,9 @@ static int is_create_args_valid(struct keystone_sbi_create* args)
   if (args->user_paddr > args->free_paddr)
     return 0;
 
+  if (!is_edge_ring_valid(&args->params, args->utm_region.size))
+    return 0;
+
   return 1;
 }
 
@@ -422,6 +549,11 @@ enclave_ret_code create_enclave(struct keystone_sbi_create create_args)
   // cleanup some memory regions for sanity See issue #38
   clean_enclave_memory(utbase, utsize);
 
+  // lay out the edge call ring, if any, in the freshly zeroed UTM
+  if(params.edge_ring_size)
+    edge_ring_init((struct edge_ring*)(utbase + params.edge_ring_offset),
+                   params.edge_ring_size);
+
 
   // initialize enclave metadata
   enclaves[eid].eid = eid;
@@ -432,6 +564,7 @@ enclave_ret_code create_enclave(struct keystone_sbi_create create_args)
   enclaves[eid].regions[1].type = REGION_UTM;
 
   enclaves[eid].encl_satp = ((base >> RISCV_PGSHIFT) | SATP_MODE_CHOICE);
+  enclaves[eid].time_slice = ENCL_TIME_SLICE;
   enclaves[eid].n_thread = 0;
   enclaves[eid].params = params;
   enclaves[eid].pa_params = pa_params;
@@ -502,8 +635,9 @@ enclave_ret_code destroy_enclave(enclave_id eid)
     return ENCLAVE_NOT_DESTROYABLE;
 
 
-  // 0. Let the platform specifics do cleanup/modifications
+  // 0. Let the platform specifics and plugins do cleanup/modifications
   platform_destroy_enclave(&enclaves[eid]);
+  plugins_destroy_enclave(eid);
 
 
   // 1. clear all the data in the enclave pages
@@ -514,7 +648,8 @@ enclave_ret_code destroy_enclave(enclave_id eid)
   region_id rid;
   for(i = 0; i < ENCLAVE_REGIONS_MAX; i++){
     if(enclaves[eid].regions[i].type == REGION_INVALID ||
-       enclaves[eid].regions[i].type == REGION_UTM)
+       enclaves[eid].regions[i].type == REGION_UTM ||
+       enclaves[eid].regions[i].type == REGION_SHARED)
       continue;
     //1.a Clear all pages
     rid = enclaves[eid].regions[i].pmp_rid;
@@ -533,6 +668,7 @@ enclave_ret_code destroy_enclave(enclave_id eid)
     pmp_region_free_atomic(enclaves[eid].regions[rid].pmp_rid);
 
   enclaves[eid].encl_satp = 0;
+  enclaves[eid].time_slice = 0;
   enclaves[eid].n_thread = 0;
   enclaves[eid].params = (struct runtime_va_params_t) {0};
   enclaves[eid].pa_params = (struct runtime_pa_params) {0};
@@ -605,13 +741,17 @@ enclave_ret_code stop_enclave(uintptr_t* encl_regs, uint64_t request, enclave_id
   if(!stoppable)
     return ENCLAVE_NOT_RUNNING;
 
-  context_switch_to_host(encl_regs, eid, request == STOP_EDGE_CALL_HOST);
+  context_switch_to_host(encl_regs, eid,
+                         request == STOP_EDGE_CALL_HOST ||
+                         request == STOP_EDGE_RING_BLOCK);
 
   switch(request) {
   case(STOP_TIMER_INTERRUPT):
     return ENCLAVE_INTERRUPTED;
   case(STOP_EDGE_CALL_HOST):
     return ENCLAVE_EDGE_CALL_HOST;
+  case(STOP_EDGE_RING_BLOCK):
+    return ENCLAVE_EDGE_RING_BLOCKED;
   default:
     return ENCLAVE_UNKNOWN_ERROR;
   }
@@ -638,6 +778,49 @@ enclave_ret_code resume_enclave(uintptr_t* host_regs, enclave_id eid)
   return context_switch_to_enclave(host_regs, eid, 0);
 }
 
+enclave_ret_code set_enclave_time_slice(enclave_id eid, uint64_t ticks)
+{
+  int settable;
+
+  if(ticks > ENCL_TIME_SLICE_MAX)
+    ticks = ENCL_TIME_SLICE_MAX;
+
+  spinlock_lock(&encl_lock);
+  settable = (ENCLAVE_EXISTS(eid)
+              && enclaves[eid].state >= FRESH);
+  if(settable)
+    enclaves[eid].time_slice = ticks;
+  spinlock_unlock(&encl_lock);
+
+  if(!settable)
+    return ENCLAVE_INVALID_ID;
+
+  return ENCLAVE_SUCCESS;
+}
+
+/* Every interrupt taken while an enclave runs lands here.
+ *
+ * While a slice runs, mtimecmp holds the earlier of the slice end and the
+ * host's deadline, so the host always gets the hart back by its deadline.
+ * A timer interrupt that arrives before both (mtimecmp can fire early,
+ * e.g. on a tick that was already pending on entry) is absorbed: mtimecmp
+ * is re-armed and the enclave keeps running. Anything else stops the
+ * enclave as before.
+ */
+void enclave_interrupt(uintptr_t* encl_regs, uintptr_t mcause, enclave_id eid)
+{
+  struct enclave_slice* slice = &slices[read_csr(mhartid)];
+
+  if(mcause == ENCL_TIMER_INTERRUPT_CAUSE &&
+     enclave_timer_absorbs(*mtime, slice->slice_end, slice->host_timecmp)) {
+    *HLS()->timecmp = enclave_timer_deadline(slice->slice_end,
+                                             slice->host_timecmp);
+    return;
+  }
+
+  encl_regs[10] = stop_enclave(encl_regs, STOP_TIMER_INTERRUPT, eid);
+}
+
 enclave_ret_code attest_enclave(uintptr_t report_ptr, uintptr_t data, uintptr_t size, enclave_id eid)
 {
   int attestable;
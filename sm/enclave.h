@@ -19,6 +19,7 @@
 // Special target platform header, set by configure script
 #include TARGET_PLATFORM_HEADER
 
+#define ENCL_MAX  16
 #define ATTEST_DATA_MAXLEN  1024
 #define ENCLAVE_REGIONS_MAX 8
 /* TODO: does not support multithreaded enclave yet */
@@ -37,6 +38,7 @@ typedef enum {
 #define STOP_TIMER_INTERRUPT  0
 #define STOP_EDGE_CALL_HOST   1
 #define STOP_EXIT_ENCLAVE     2
+#define STOP_EDGE_RING_BLOCK  3
 
 /* For now, eid's are a simple unsigned int */
 typedef unsigned int enclave_id;
@@ -45,6 +47,7 @@ typedef unsigned int enclave_id;
  * EPM is the 'home' for the enclave, contains runtime code/etc
  * UTM is the untrusted shared pages
  * OTHER is managed by some other component (e.g. platform_)
+ * SHARED is an enclave-to-enclave channel owned by the shmem plugin
  * INVALID is an unused index
  */
 enum enclave_region_type{
@@ -52,6 +55,7 @@ enum enclave_region_type{
   REGION_EPM,
   REGION_UTM,
   REGION_OTHER,
+  REGION_SHARED,
 };
 
 struct enclave_region
@@ -79,6 +83,10 @@ struct enclave
   struct runtime_va_params_t params;
   struct runtime_pa_params pa_params;
 
+  /* scheduling: timer ticks the SM may hold back the host's timer
+   * interrupt for, measured from the last run/resume (0 disables) */
+  uint64_t time_slice;
+
   /* enclave execution context */
   unsigned int n_thread;
   struct thread_state threads[MAX_ENCL_THREADS];
@@ -121,10 +129,13 @@ enclave_ret_code create_enclave(struct keystone_sbi_create create_args);
 enclave_ret_code destroy_enclave(enclave_id eid);
 enclave_ret_code run_enclave(uintptr_t* host_regs, enclave_id eid);
 enclave_ret_code resume_enclave(uintptr_t* regs, enclave_id eid);
+enclave_ret_code set_enclave_time_slice(enclave_id eid, uint64_t ticks);
 // callables from the enclave
 enclave_ret_code exit_enclave(uintptr_t* regs, unsigned long retval, enclave_id eid);
 enclave_ret_code stop_enclave(uintptr_t* regs, uint64_t request, enclave_id eid);
 enclave_ret_code attest_enclave(uintptr_t report, uintptr_t data, uintptr_t size, enclave_id eid);
+// called from trap_vector_enclave
+void enclave_interrupt(uintptr_t* encl_regs, uintptr_t mcause, enclave_id eid);
 /* attestation and virtual mapping validation */
 enclave_ret_code validate_and_hash_enclave(struct enclave* enclave);
 // TODO: These functions are supposed to be internal functions.
@@ -133,5 +144,7 @@ enclave_ret_code copy_enclave_create_args(uintptr_t src, struct keystone_sbi_cre
 int get_enclave_region_index(enclave_id eid, enum enclave_region_type type);
 uintptr_t get_enclave_region_base(enclave_id eid, int memid);
 uintptr_t get_enclave_region_size(enclave_id eid, int memid);
+int enclave_region_attach(enclave_id eid, region_id rid, enum enclave_region_type type);
+int enclave_region_detach(enclave_id eid, region_id rid);
 enclave_ret_code get_sealing_key(uintptr_t seal_key, uintptr_t key_ident, size_t key_ident_size, enclave_id eid);
 #endif
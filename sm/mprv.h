@@ -1,6 +1,7 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 int copy1_from_sm(uintptr_t dst, const uint8_t *src);
 int copy8_from_sm(uintptr_t dst, const uint64_t *src);
@@ -10,7 +11,7 @@ int copy1_to_sm(uint8_t *dst, uintptr_t src);
 int copy8_to_sm(uint64_t *dst, uintptr_t src);
 int copy64_to_sm(uint64_t *dst, uintptr_t src);
 
-int copy_from_sm(uintptr_t dst, void *src_buf, size_t len)
+static inline int copy_from_sm(uintptr_t dst, void *src_buf, size_t len)
 {
     uintptr_t src = (uintptr_t)src_buf;
 
@@ -49,7 +50,7 @@ int copy_from_sm(uintptr_t dst, void *src_buf, size_t len)
     return 0;
 }
 
-int copy_to_sm(void *dst_buf, uintptr_t src, size_t len)
+static inline int copy_to_sm(void *dst_buf, uintptr_t src, size_t len)
 {
     uintptr_t dst = (uintptr_t)dst_buf;
 
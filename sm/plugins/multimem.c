@@ -1,19 +1,20 @@
 #include "plugins/multimem.h"
 #include "sm.h"
 
-uintptr_t multimem_get_other_region_size(enclave_id eid)
+static uintptr_t multimem_get_other_region_size(enclave_id eid)
 {
   int mem_id = get_enclave_region_index(eid, REGION_OTHER);
   return get_enclave_region_size(eid, mem_id);
 }
 
-uintptr_t multimem_get_other_region_addr(enclave_id eid)
+static uintptr_t multimem_get_other_region_addr(enclave_id eid)
 {
   int mem_id = get_enclave_region_index(eid, REGION_OTHER);
   return get_enclave_region_base(eid, mem_id);
 }
 
-uintptr_t do_sbi_multimem(enclave_id eid, uintptr_t call_id)
+static uintptr_t do_sbi_multimem(enclave_id eid, uintptr_t call_id,
+                                 uintptr_t arg0, uintptr_t arg1)
 {
   switch(call_id)
   {
@@ -26,3 +27,5 @@ uintptr_t do_sbi_multimem(enclave_id eid, uintptr_t call_id)
   }
   return 0;
 }
+
+SM_PLUGIN_REGISTER(multimem, PLUGIN_ID_MULTIMEM, do_sbi_multimem);
@@ -7,6 +7,4 @@
 #define MULTIMEM_GET_OTHER_REGION_SIZE 0x1
 #define MULTIMEM_GET_OTHER_REGION_ADDR 0x2
 
-uintptr_t do_sbi_multimem(enclave_id id, uintptr_t call_id);
-
 #endif
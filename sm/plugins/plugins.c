@@ -1,8 +1,64 @@
 #include "plugins/plugins.h"
+#include "mtrap.h"
+#include <string.h>
 
-#ifdef PLUGIN_ENABLE_MULTIMEM
-  #include "plugins/multimem.c"
-#endif
+/* provided by the linker (bbl.lds, or automatically for C-named sections) */
+extern const struct sm_plugin __start_sm_plugins[] __attribute__((weak));
+extern const struct sm_plugin __stop_sm_plugins[] __attribute__((weak));
+
+static const struct sm_plugin* plugins[PLUGIN_ID_MAX];
+
+/* per-enclave, per-plugin: an enclave only ever sees its own numbers.
+ * An enclave runs on one hart at a time (MAX_ENCL_THREADS), so its row
+ * needs no lock. */
+struct plugin_stats
+{
+  uint64_t calls;
+  uint64_t cycles;
+};
+static struct plugin_stats plugin_stats[ENCL_MAX][PLUGIN_ID_MAX];
+
+static uintptr_t do_sbi_management(enclave_id eid, uintptr_t call_id,
+                                   uintptr_t arg0, uintptr_t arg1)
+{
+  switch(call_id)
+  {
+    case PLUGIN_MGMT_GET_CALLS:
+      return arg0 < PLUGIN_ID_MAX ? plugin_stats[eid][arg0].calls : 0;
+    case PLUGIN_MGMT_GET_CYCLES:
+      return arg0 < PLUGIN_ID_MAX ? plugin_stats[eid][arg0].cycles : 0;
+    default:
+      return ENCLAVE_NOT_IMPLEMENTED;
+  }
+}
+
+SM_PLUGIN_REGISTER(management, PLUGIN_ID_MANAGEMENT, do_sbi_management);
+
+/* Build the id-indexed table and run each plugin's init. Called once,
+ * by the boot hart through sm_init_global. */
+void plugins_init(void)
+{
+  const struct sm_plugin* p;
+
+  plugins[PLUGIN_ID_MANAGEMENT] = &sm_plugin_management;
+
+  if(!__start_sm_plugins)
+    return;
+
+  for(p = __start_sm_plugins; p < __stop_sm_plugins; p++) {
+    if(p->id >= PLUGIN_ID_MAX || !p->handler) {
+      printm("sm: ignoring bad plugin entry (id %ld)\r\n", (long)p->id);
+      continue;
+    }
+    if(plugins[p->id] && plugins[p->id] != p) {
+      printm("sm: duplicate plugin id %ld\r\n", (long)p->id);
+      continue;
+    }
+    plugins[p->id] = p;
+    if(p->init)
+      p->init();
+  }
+}
 
 uintptr_t
 call_plugin(
@@ -12,15 +68,31 @@ call_plugin(
     uintptr_t arg0,
     uintptr_t arg1)
 {
-  switch(plugin_id) {
-#ifdef PLUGIN_ENABLE_MULTIMEM
-    case PLUGIN_ID_MULTIMEM:
-      return do_sbi_multimem(id, call_id);
-      break;
-#endif
-    default:
-      // TOO fix it
-      return -ENOSYS;
-  }
+  const struct sm_plugin* p;
+  struct plugin_stats* stats;
+  uint64_t start;
+  uintptr_t ret;
+
+  if(plugin_id >= PLUGIN_ID_MAX || !(p = plugins[plugin_id]) ||
+     id >= ENCL_MAX)
+    return -ENOSYS;
+
+  stats = &plugin_stats[id][plugin_id];
+  start = rdcycle();
+  ret = p->handler(id, call_id, arg0, arg1);
+  stats->cycles += rdcycle() - start;
+  stats->calls++;
+
+  return ret;
 }
 
+/* Called by destroy_enclave before the enclave memory is scrubbed */
+void plugins_destroy_enclave(enclave_id id)
+{
+  int i;
+  for(i = 0; i < PLUGIN_ID_MAX; i++) {
+    if(plugins[i] && plugins[i]->on_enclave_destroy)
+      plugins[i]->on_enclave_destroy(id);
+  }
+  memset(plugin_stats[id], 0, sizeof(plugin_stats[id]));
+}
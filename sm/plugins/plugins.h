@@ -6,11 +6,42 @@
 #include "enclave.h"
 
 /* PLUGIN IDs */
-#define PLUGIN_ID_MULTIMEM  0x1
+#define PLUGIN_ID_MANAGEMENT 0x0
+#define PLUGIN_ID_MULTIMEM   0x1
+#define PLUGIN_ID_SHMEM      0x2
+#define PLUGIN_ID_MAX        16
 
-#ifdef PLUGIN_ENABLE_MULTIMEM
-  #include "plugins/multimem.h"
-#endif
+/* Management plugin calls: arg0 is the plugin id to query. The counts
+ * cover the calling enclave's own plugin calls since it was created. */
+#define PLUGIN_MGMT_GET_CALLS   0x1
+#define PLUGIN_MGMT_GET_CYCLES  0x2
+
+/* Plugin registry
+ *
+ * A plugin is a separate object that registers itself with
+ * SM_PLUGIN_REGISTER; the entries are collected by the linker into the
+ * sm_plugins section and indexed by id when the SM starts. Since the SM
+ * is linked from a static library, a plugin object is only pulled in when
+ * something references its entry: configure adds -Wl,-u,sm_plugin_<name>
+ * for each enabled plugin.
+ */
+typedef uintptr_t (*sm_plugin_handler_t)(enclave_id eid, uintptr_t call_id,
+                                         uintptr_t arg0, uintptr_t arg1);
+
+struct sm_plugin
+{
+  uintptr_t id;
+  sm_plugin_handler_t handler;
+  void (*init)(void);                          /* optional */
+  void (*on_enclave_destroy)(enclave_id eid);  /* optional */
+};
+
+#define SM_PLUGIN_REGISTER(name, ...) \
+  const struct sm_plugin sm_plugin_##name \
+  __attribute__((section("sm_plugins"), used, aligned(sizeof(void*)))) = \
+  { __VA_ARGS__ }
+
+void plugins_init(void);
 
 uintptr_t
 call_plugin(
@@ -21,4 +52,6 @@ call_plugin(
     uintptr_t arg1
     );
 
+void plugins_destroy_enclave(enclave_id id);
+
 #endif
@@ -0,0 +1,299 @@
+#include "plugins/shmem.h"
+#include "sm.h"
+#include "atomic.h"
+#include "mtrap.h"
+#include <string.h>
+
+enum shmem_state
+{
+  SHMEM_FREE = 0,
+  SHMEM_APPROVED, /* the host offered [paddr, paddr + size) to owner */
+  SHMEM_CLAIMED,  /* owner's SHMEM_CREATE is setting it up */
+  SHMEM_ACTIVE,
+};
+
+struct shmem_channel
+{
+  enum shmem_state state;
+  uintptr_t paddr;
+  size_t size;
+  region_id rid;
+  enclave_id owner;
+  enclave_id peer;
+  int owner_attached;
+  int peer_granted;
+  int peer_attached;
+};
+
+static struct shmem_channel channels[SHMEM_CHANNELS_MAX];
+static spinlock_t shmem_lock = SPINLOCK_INIT;
+
+static struct shmem_channel* shmem_find(uintptr_t paddr)
+{
+  int i;
+  for(i = 0; i < SHMEM_CHANNELS_MAX; i++) {
+    if(channels[i].state == SHMEM_ACTIVE && channels[i].paddr == paddr)
+      return &channels[i];
+  }
+  return NULL;
+}
+
+static int shmem_is_member(struct shmem_channel* ch, enclave_id eid)
+{
+  return ch->owner == eid || (ch->peer_granted && ch->peer == eid);
+}
+
+static int shmem_is_attached(struct shmem_channel* ch, enclave_id eid)
+{
+  return (ch->owner == eid && ch->owner_attached) ||
+         (ch->peer_granted && ch->peer == eid && ch->peer_attached);
+}
+
+/* Scrub the region and give it back to the host. Called without
+ * shmem_lock, once the channel has no attached enclave left. */
+static void shmem_release(struct shmem_channel* ch)
+{
+  memset((void*) ch->paddr, 0, ch->size);
+  pmp_unset_global(ch->rid);
+  pmp_region_free_atomic(ch->rid);
+
+  spinlock_lock(&shmem_lock);
+  ch->state = SHMEM_FREE;
+  spinlock_unlock(&shmem_lock);
+}
+
+/* Host side: offer [paddr, paddr + size) of DRAM to enclave eid for one
+ * channel. Nothing changes hands until the enclave creates the channel. */
+uintptr_t shmem_approve(enclave_id eid, uintptr_t paddr, size_t size)
+{
+  struct shmem_channel* ch = NULL;
+  uintptr_t ret = ENCLAVE_SUCCESS;
+  int i, owned = 0;
+
+  if(eid >= ENCL_MAX)
+    return ENCLAVE_INVALID_ID;
+  if(!size || (paddr & (RISCV_PGSIZE-1)) || (size & (RISCV_PGSIZE-1)))
+    return ENCLAVE_ILLEGAL_ARGUMENT;
+  if(paddr < DRAM_BASE || paddr - DRAM_BASE > mem_size ||
+     size > DRAM_BASE + mem_size - paddr)
+    return ENCLAVE_ILLEGAL_ARGUMENT;
+
+  spinlock_lock(&shmem_lock);
+  for(i = 0; i < SHMEM_CHANNELS_MAX; i++) {
+    struct shmem_channel* c = &channels[i];
+    if(c->state == SHMEM_FREE) {
+      if(!ch)
+        ch = c;
+      continue;
+    }
+    if(c->owner == eid)
+      owned++;
+    if(paddr < c->paddr + c->size && c->paddr < paddr + size)
+      ret = ENCLAVE_REGION_OVERLAPS;
+  }
+  if(ret == ENCLAVE_SUCCESS && (!ch || owned >= SHMEM_ENCLAVE_CHANNELS_MAX))
+    ret = ENCLAVE_NO_FREE_RESOURCE;
+  if(ret == ENCLAVE_SUCCESS) {
+    ch->state = SHMEM_APPROVED;
+    ch->paddr = paddr;
+    ch->size = size;
+    ch->owner = eid;
+  }
+  spinlock_unlock(&shmem_lock);
+
+  return ret;
+}
+
+static uintptr_t shmem_create(enclave_id eid, uintptr_t paddr, size_t size)
+{
+  struct shmem_channel* ch = NULL;
+  region_id rid;
+  int i;
+
+  /* only a range the host approved for this enclave */
+  spinlock_lock(&shmem_lock);
+  for(i = 0; i < SHMEM_CHANNELS_MAX; i++) {
+    if(channels[i].state == SHMEM_APPROVED && channels[i].owner == eid &&
+       channels[i].paddr == paddr && channels[i].size == size) {
+      ch = &channels[i];
+      ch->state = SHMEM_CLAIMED;
+      break;
+    }
+  }
+  spinlock_unlock(&shmem_lock);
+
+  if(!ch)
+    return ENCLAVE_NOT_ACCESSIBLE;
+
+  /* the region must not overlap the SM or any enclave */
+  if(pmp_region_init_atomic(paddr, size, PMP_PRI_ANY, &rid, 0))
+    goto unclaim;
+
+  /* take it away from the host before anything goes in */
+  if(pmp_set_global(rid, PMP_NO_PERM))
+    goto free_region;
+  memset((void*) paddr, 0, size);
+
+  ch->rid = rid;
+  ch->peer_granted = 0;
+  ch->peer_attached = 0;
+
+  if(enclave_region_attach(eid, rid, REGION_SHARED) < 0)
+    goto unset_region;
+  ch->owner_attached = 1;
+
+  spinlock_lock(&shmem_lock);
+  ch->state = SHMEM_ACTIVE;
+  spinlock_unlock(&shmem_lock);
+  return ENCLAVE_SUCCESS;
+
+unset_region:
+  pmp_unset_global(rid);
+free_region:
+  pmp_region_free_atomic(rid);
+unclaim:
+  spinlock_lock(&shmem_lock);
+  ch->state = SHMEM_APPROVED;
+  spinlock_unlock(&shmem_lock);
+  return ENCLAVE_PMP_FAILURE;
+}
+
+static uintptr_t shmem_grant(enclave_id eid, uintptr_t paddr, enclave_id peer)
+{
+  struct shmem_channel* ch;
+  uintptr_t ret = ENCLAVE_SUCCESS;
+
+  spinlock_lock(&shmem_lock);
+  ch = shmem_find(paddr);
+  if(!ch || ch->owner != eid || !ch->owner_attached)
+    ret = ENCLAVE_NOT_ACCESSIBLE;
+  else if(ch->peer_granted || peer == eid)
+    ret = ENCLAVE_ILLEGAL_ARGUMENT;
+  else {
+    ch->peer = peer;
+    ch->peer_granted = 1;
+  }
+  spinlock_unlock(&shmem_lock);
+
+  return ret;
+}
+
+static uintptr_t shmem_attach(enclave_id eid, uintptr_t paddr)
+{
+  struct shmem_channel* ch;
+  int attachable;
+
+  spinlock_lock(&shmem_lock);
+  ch = shmem_find(paddr);
+  attachable = ch && ch->peer_granted && ch->peer == eid && !ch->peer_attached;
+  if(attachable)
+    ch->peer_attached = 1;
+  spinlock_unlock(&shmem_lock);
+
+  if(!attachable)
+    return ENCLAVE_NOT_ACCESSIBLE;
+
+  if(enclave_region_attach(eid, ch->rid, REGION_SHARED) < 0) {
+    spinlock_lock(&shmem_lock);
+    ch->peer_attached = 0;
+    spinlock_unlock(&shmem_lock);
+    return ENCLAVE_NO_FREE_RESOURCE;
+  }
+
+  return ENCLAVE_SUCCESS;
+}
+
+static uintptr_t shmem_detach(enclave_id eid, uintptr_t paddr)
+{
+  struct shmem_channel* ch;
+  int detached = 0, last = 0;
+
+  spinlock_lock(&shmem_lock);
+  ch = shmem_find(paddr);
+  if(ch && ch->owner == eid && ch->owner_attached) {
+    ch->owner_attached = 0;
+    detached = 1;
+  } else if(ch && ch->peer_granted && ch->peer == eid && ch->peer_attached) {
+    ch->peer_attached = 0;
+    detached = 1;
+  }
+  if(detached) {
+    /* a grant without an attach does not keep the region alive */
+    last = !ch->owner_attached && !ch->peer_attached;
+    if(!ch->owner_attached)
+      ch->peer_granted = ch->peer_attached;
+  }
+  spinlock_unlock(&shmem_lock);
+
+  if(!detached)
+    return ENCLAVE_NOT_ACCESSIBLE;
+
+  enclave_region_detach(eid, ch->rid);
+  if(last)
+    shmem_release(ch);
+
+  return ENCLAVE_SUCCESS;
+}
+
+static uintptr_t shmem_get_size(enclave_id eid, uintptr_t paddr)
+{
+  struct shmem_channel* ch;
+  uintptr_t size = 0;
+
+  spinlock_lock(&shmem_lock);
+  ch = shmem_find(paddr);
+  if(ch && shmem_is_member(ch, eid))
+    size = ch->size;
+  spinlock_unlock(&shmem_lock);
+
+  return size;
+}
+
+/* Tear down every channel end held by a dying enclave, and drop the
+ * approvals and grants that a later enclave with the same id must not
+ * inherit */
+static void shmem_destroy_enclave(enclave_id eid)
+{
+  uintptr_t attached[SHMEM_CHANNELS_MAX];
+  int i, n = 0;
+
+  spinlock_lock(&shmem_lock);
+  for(i = 0; i < SHMEM_CHANNELS_MAX; i++) {
+    struct shmem_channel* ch = &channels[i];
+    if(ch->state == SHMEM_APPROVED && ch->owner == eid) {
+      ch->state = SHMEM_FREE;
+    } else if(ch->state == SHMEM_ACTIVE) {
+      if(shmem_is_attached(ch, eid))
+        attached[n++] = ch->paddr;
+      else if(ch->peer_granted && ch->peer == eid)
+        ch->peer_granted = 0;
+    }
+  }
+  spinlock_unlock(&shmem_lock);
+
+  for(i = 0; i < n; i++)
+    shmem_detach(eid, attached[i]);
+}
+
+static uintptr_t do_sbi_shmem(enclave_id eid, uintptr_t call_id,
+                              uintptr_t arg0, uintptr_t arg1)
+{
+  switch(call_id)
+  {
+    case SHMEM_CREATE:
+      return shmem_create(eid, arg0, (size_t) arg1);
+    case SHMEM_GRANT:
+      return shmem_grant(eid, arg0, (enclave_id) arg1);
+    case SHMEM_ATTACH:
+      return shmem_attach(eid, arg0);
+    case SHMEM_DETACH:
+      return shmem_detach(eid, arg0);
+    case SHMEM_GET_SIZE:
+      return shmem_get_size(eid, arg0);
+    default:
+      return ENCLAVE_NOT_IMPLEMENTED;
+  }
+}
+
+SM_PLUGIN_REGISTER(shmem, PLUGIN_ID_SHMEM, do_sbi_shmem,
+                   NULL, shmem_destroy_enclave);
@@ -0,0 +1,27 @@
+#ifndef __SM_SHMEM_H__
+#define __SM_SHMEM_H__
+
+#include "plugins/plugins.h"
+#include "enclave.h"
+
+/* Enclave-to-enclave shared memory.
+ *
+ * A channel is identified by the physical address of its region. The
+ * host first approves a range of DRAM for a given enclave with the
+ * host-only SBI_SM_SHMEM_APPROVE; that enclave then claims exactly that
+ * range with SHMEM_CREATE (the SM takes it away from the host and zeroes
+ * it), names one peer with SHMEM_GRANT, and the peer maps it in with
+ * SHMEM_ATTACH. Each side leaves with SHMEM_DETACH; once nobody is
+ * attached the region is zeroed and handed back to the host. */
+#define SHMEM_CREATE    0x1 /* arg0: paddr, arg1: size */
+#define SHMEM_GRANT     0x2 /* arg0: paddr, arg1: peer eid */
+#define SHMEM_ATTACH    0x3 /* arg0: paddr */
+#define SHMEM_DETACH    0x4 /* arg0: paddr */
+#define SHMEM_GET_SIZE  0x5 /* arg0: paddr */
+
+#define SHMEM_CHANNELS_MAX 4
+#define SHMEM_ENCLAVE_CHANNELS_MAX 2 /* approved or created, per owner */
+
+uintptr_t shmem_approve(enclave_id eid, uintptr_t paddr, size_t size);
+
+#endif
@@ -10,17 +10,15 @@
 #include <errno.h>
 #include "platform.h"
 #include "plugins/plugins.h"
+#include "plugins/shmem.h"
+
+/* Whether the host or an enclave may make a call is checked once, by the
+ * SBI dispatcher (mcall_trap), before any of these run. */
 
 uintptr_t mcall_sm_create_enclave(uintptr_t create_args)
 {
   struct keystone_sbi_create create_args_local;
   enclave_ret_code ret;
-
-  /* an enclave cannot call this SBI */
-  if (cpu_is_enclave_context()) {
-    return ENCLAVE_SBI_PROHIBITED;
-  }
-
   ret = copy_enclave_create_args(create_args,
                        &create_args_local);
 
@@ -34,24 +32,12 @@ uintptr_t mcall_sm_create_enclave(uintptr_t create_args)
 uintptr_t mcall_sm_destroy_enclave(unsigned long eid)
 {
   enclave_ret_code ret;
-
-  /* an enclave cannot call this SBI */
-  if (cpu_is_enclave_context()) {
-    return ENCLAVE_SBI_PROHIBITED;
-  }
-
   ret = destroy_enclave((unsigned int)eid);
   return ret;
 }
 uintptr_t mcall_sm_run_enclave(uintptr_t* regs, unsigned long eid)
 {
   enclave_ret_code ret;
-
-  /* an enclave cannot call this SBI */
-  if (cpu_is_enclave_context()) {
-    return ENCLAVE_SBI_PROHIBITED;
-  }
-
   ret = run_enclave(regs, (unsigned int) eid);
 
   return ret;
@@ -60,24 +46,27 @@ uintptr_t mcall_sm_run_enclave(uintptr_t* regs, unsigned long eid)
 uintptr_t mcall_sm_resume_enclave(uintptr_t* host_regs, unsigned long eid)
 {
   enclave_ret_code ret;
-
-  /* an enclave cannot call this SBI */
-  if (cpu_is_enclave_context()) {
-    return ENCLAVE_SBI_PROHIBITED;
-  }
-
   ret = resume_enclave(host_regs, (unsigned int) eid);
   return ret;
 }
 
+uintptr_t mcall_sm_set_time_slice(unsigned long eid, uintptr_t ticks)
+{
+  return set_enclave_time_slice((unsigned int) eid, (uint64_t) ticks);
+}
+
+uintptr_t mcall_sm_shmem_approve(unsigned long eid, uintptr_t paddr, uintptr_t size)
+{
+#ifdef PLUGIN_ENABLE_SHMEM
+  return shmem_approve((unsigned int) eid, paddr, (size_t) size);
+#else
+  return ENCLAVE_NOT_IMPLEMENTED;
+#endif
+}
+
 uintptr_t mcall_sm_exit_enclave(uintptr_t* encl_regs, unsigned long retval)
 {
   enclave_ret_code ret;
-  /* only an enclave itself can call this SBI */
-  if (!cpu_is_enclave_context()) {
-    return ENCLAVE_SBI_PROHIBITED;
-  }
-
   ret = exit_enclave(encl_regs, (unsigned long) retval, cpu_get_enclave_id());
   return ret;
 }
@@ -85,23 +74,24 @@ uintptr_t mcall_sm_exit_enclave(uintptr_t* encl_regs, unsigned long retval)
 uintptr_t mcall_sm_stop_enclave(uintptr_t* encl_regs, unsigned long request)
 {
   enclave_ret_code ret;
-  /* only an enclave itself can call this SBI */
-  if (!cpu_is_enclave_context()) {
-    return ENCLAVE_SBI_PROHIBITED;
-  }
-
   ret = stop_enclave(encl_regs, (uint64_t)request, cpu_get_enclave_id());
   return ret;
 }
 
-uintptr_t mcall_sm_attest_enclave(uintptr_t report, uintptr_t data, uintptr_t size)
+/* Not an SBI: entered from trap_vector_enclave on any interrupt */
+uintptr_t mcall_sm_interrupt(uintptr_t* encl_regs, uintptr_t mcause)
 {
-  enclave_ret_code ret;
-  /* only an enclave itself can call this SBI */
   if (!cpu_is_enclave_context()) {
     return ENCLAVE_SBI_PROHIBITED;
   }
 
+  enclave_interrupt(encl_regs, mcause, cpu_get_enclave_id());
+  return ENCLAVE_SUCCESS;
+}
+
+uintptr_t mcall_sm_attest_enclave(uintptr_t report, uintptr_t data, uintptr_t size)
+{
+  enclave_ret_code ret;
   ret = attest_enclave(report, data, size, cpu_get_enclave_id());
   return ret;
 }
@@ -109,39 +99,23 @@ uintptr_t mcall_sm_attest_enclave(uintptr_t report, uintptr_t data, uintptr_t si
 uintptr_t mcall_sm_get_sealing_key(uintptr_t sealing_key, uintptr_t key_ident,
                                    size_t key_ident_size)
 {
-  /* only an enclave itself can call this SBI */
-  if (!cpu_is_enclave_context()) {
-    return ENCLAVE_SBI_PROHIBITED;
-  }
-
   return get_sealing_key(sealing_key, key_ident, key_ident_size,
                          cpu_get_enclave_id());
 }
 
 uintptr_t mcall_sm_random()
 {
-  /* Anyone may call this interface. */
-
   return platform_random();
 }
 
 uintptr_t mcall_sm_call_plugin(uintptr_t plugin_id, uintptr_t call_id, uintptr_t arg0, uintptr_t arg1)
 {
-  if(!cpu_is_enclave_context()) {
-    return ENCLAVE_SBI_PROHIBITED;
-  }
-
   return call_plugin(cpu_get_enclave_id(), plugin_id, call_id, arg0, arg1);
 }
 
 /* TODO: this should be removed in the future. */
 uintptr_t mcall_sm_not_implemented(uintptr_t* encl_regs, unsigned long cause)
 {
-  /* only an enclave itself can call this SBI */
-  if (!cpu_is_enclave_context()) {
-    return ENCLAVE_SBI_PROHIBITED;
-  }
-
   if((long)cause < 0)
   {
     // discard MSB
@@ -19,6 +19,9 @@ uintptr_t mcall_sm_exit_enclave(uintptr_t* regs, unsigned long retval);
 uintptr_t mcall_sm_not_implemented(uintptr_t* regs, unsigned long a0);
 uintptr_t mcall_sm_stop_enclave(uintptr_t* regs, unsigned long request);
 uintptr_t mcall_sm_resume_enclave(uintptr_t* regs, unsigned long eid);
+uintptr_t mcall_sm_set_time_slice(unsigned long eid, uintptr_t ticks);
+uintptr_t mcall_sm_shmem_approve(unsigned long eid, uintptr_t paddr, uintptr_t size);
+uintptr_t mcall_sm_interrupt(uintptr_t* regs, uintptr_t mcause);
 uintptr_t mcall_sm_attest_enclave(uintptr_t report, uintptr_t data, uintptr_t size);
 uintptr_t mcall_sm_get_sealing_key(uintptr_t seal_key, uintptr_t key_ident,
                                    size_t key_ident_size);
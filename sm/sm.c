@@ -10,10 +10,10 @@
 #include "crypto.h"
 #include "enclave.h"
 #include "platform.h"
+#include "plugins/plugins.h"
 
-static int sm_init_done = 0;
+static volatile int sm_init_done = 0;
 static int sm_region_id = 0, os_region_id = 0;
-static spinlock_t sm_init_lock = SPINLOCK_INIT;
 
 /* from Sanctum BootROM */
 extern byte sanctum_sm_hash[MDSIZE];
@@ -112,44 +112,47 @@ void sm_print_cert()
 }
 */
 
-void sm_init(void)
+/* Once, on the boot hart before it wakes the others: reserve the SM and OS
+ * regions and set up everything the harts share. */
+void sm_init_global(void)
 {
-	// initialize SMM
-
-  spinlock_lock(&sm_init_lock);
-
-  if(!sm_init_done) {
-    sm_region_id = smm_init();
-    if(sm_region_id < 0)
-      die("[SM] intolerable error - failed to initialize SM memory");
-
-    os_region_id = osm_init();
-    if(os_region_id < 0)
-      die("[SM] intolerable error - failed to initialize OS memory");
-
-    sm_init_done = 1;
-
+  sm_region_id = smm_init();
+  if(sm_region_id < 0)
+    die("[SM] intolerable error - failed to initialize SM memory");
 
-    if(platform_init_global_once() != ENCLAVE_SUCCESS)
-      die("[SM] platform global init fatal error");
-  }
+  os_region_id = osm_init();
+  if(os_region_id < 0)
+    die("[SM] intolerable error - failed to initialize OS memory");
 
-  pmp_set(sm_region_id, PMP_NO_PERM);
-  pmp_set(os_region_id, PMP_ALL_PERM);
-
-  /* Fire platform specific global init */
-  if(platform_init_global() != ENCLAVE_SUCCESS)
+  if(platform_init_global_once() != ENCLAVE_SUCCESS)
     die("[SM] platform global init fatal error");
 
+  plugins_init();
+
   // Copy the keypair from the root of trust
   sm_copy_key();
 
   // Init the enclave metadata
   enclave_init_metadata();
 
-  spinlock_unlock(&sm_init_lock);
+  sm_init_done = 1;
+  mb();
 
-  return;
   // for debug
   // sm_print_cert();
 }
+
+/* On every hart before it first enters S-mode. This only programs the
+ * hart's own PMP entries, so the harts run it in parallel. */
+void sm_init(void)
+{
+  if(!sm_init_done)
+    die("[SM] sm_init before sm_init_global");
+
+  pmp_set(sm_region_id, PMP_NO_PERM);
+  pmp_set(os_region_id, PMP_ALL_PERM);
+
+  /* Fire platform specific per-hart init */
+  if(platform_init_global() != ENCLAVE_SUCCESS)
+    die("[SM] platform global init fatal error");
+}
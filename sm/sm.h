@@ -21,6 +21,8 @@
 #define SBI_SM_STOP_ENCLAVE      106
 #define SBI_SM_RESUME_ENCLAVE    107
 #define SBI_SM_RANDOM            108
+#define SBI_SM_SET_TIME_SLICE    109
+#define SBI_SM_SHMEM_APPROVE     110
 #define SBI_SM_EXIT_ENCLAVE     1101
 #define SBI_SM_CALL_PLUGIN      1000
 #define SBI_SM_NOT_IMPLEMENTED  1111
@@ -45,6 +47,7 @@
 #define ENCLAVE_SBI_PROHIBITED              (enclave_ret_code)14
 #define ENCLAVE_ILLEGAL_PTE                 (enclave_ret_code)15
 #define ENCLAVE_NOT_FRESH                   (enclave_ret_code)16
+#define ENCLAVE_EDGE_RING_BLOCKED           (enclave_ret_code)17
 
 #define PMP_UNKNOWN_ERROR                   -1U
 #define PMP_SUCCESS                         0
@@ -56,7 +59,8 @@
 #define PMP_REGION_OVERLAP                  25
 #define PMP_REGION_IMPOSSIBLE_TOR           26
 
-void sm_init(void);
+void sm_init_global(void); // boot hart, before waking the others
+void sm_init(void);        // every hart
 
 /* platform specific functions */
 #define ATTESTATION_KEY_LENGTH  64
@@ -79,6 +83,9 @@ struct runtime_va_params_t
   uintptr_t user_entry;
   uintptr_t untrusted_ptr;
   uintptr_t untrusted_size;
+  /* exit-less edge call ring, relative to the UTM base (0 size: none) */
+  uintptr_t edge_ring_offset;
+  uintptr_t edge_ring_size;
 };
 
 struct runtime_pa_params
@@ -13,7 +13,7 @@
 
 static void test_is_create_args_valid()
 {
-  struct keystone_sbi_create args;
+  struct keystone_sbi_create args = {0};
 
   // should return true
   args.epm_region.paddr = 0x4000;
@@ -72,6 +72,37 @@ static void test_is_create_args_valid()
   args.epm_region.size = 0x2000;
 }
 
+static void test_is_edge_ring_valid()
+{
+  struct runtime_va_params_t params = {0};
+
+  // no ring
+  assert_int_equal(is_edge_ring_valid(&params, 0x2000), 1);
+
+  // ring in the second half of the UTM
+  params.edge_ring_offset = 0x1000;
+  params.edge_ring_size = 0x1000;
+  assert_int_equal(is_edge_ring_valid(&params, 0x2000), 1);
+
+  // false if the ring runs past the UTM
+  assert_int_equal(is_edge_ring_valid(&params, 0x1800), 0);
+
+  // false if misaligned
+  params.edge_ring_offset = 0x1008;
+  params.edge_ring_size = 0x800;
+  assert_int_equal(is_edge_ring_valid(&params, 0x2000), 0);
+
+  // false if too small for a single slot
+  params.edge_ring_offset = 0x1000;
+  params.edge_ring_size = EDGE_RING_MIN_SIZE - 1;
+  assert_int_equal(is_edge_ring_valid(&params, 0x2000), 0);
+
+  // false if offset + size overflows
+  params.edge_ring_offset = -0x1000UL;
+  params.edge_ring_size = 0x2000;
+  assert_int_equal(is_edge_ring_valid(&params, 0x2000), 0);
+}
+
 static void test_context_switch_to_enclave()
 {
 
@@ -122,13 +153,77 @@ static void test_get_enclave_region_index()
   assert_int_equal( get_enclave_region_index(0, REGION_OTHER), 2 );
 }
 
+static void test_enclave_slice_has_time_left()
+{
+  uint64_t end;
+
+  // a zero slice disables slicing: the host's tick always stops the enclave
+  end = enclave_slice_end(1000, 0);
+  assert_int_equal( end, 0 );
+  assert_int_equal( enclave_slice_has_time_left(1000, end), 0 );
+  assert_int_equal( enclave_slice_has_time_left(5000, end), 0 );
+
+  // a slice started at 1000 has time left until it runs out at 1100
+  end = enclave_slice_end(1000, 100);
+  assert_int_equal( enclave_slice_has_time_left(1000, end), 1 );
+  assert_int_equal( enclave_slice_has_time_left(1099, end), 1 );
+  assert_int_equal( enclave_slice_has_time_left(1100, end), 0 );
+  assert_int_equal( enclave_slice_has_time_left(2000, end), 0 );
+}
+
+static void test_enclave_timer_deadline()
+{
+  uint64_t end = enclave_slice_end(1000, 100);
+
+  // without slicing the host's deadline is left alone
+  assert_int_equal( enclave_timer_deadline(0, 1500), 1500 );
+  assert_int_equal( enclave_timer_absorbs(1200, 0, 1500), 0 );
+
+  // the slice can end the run before the host's deadline ...
+  assert_int_equal( enclave_timer_deadline(end, 1500), 1100 );
+  assert_int_equal( enclave_timer_absorbs(1050, end, 1500), 1 );
+  assert_int_equal( enclave_timer_absorbs(1100, end, 1500), 0 );
+
+  // ... but never after it
+  assert_int_equal( enclave_timer_deadline(end, 1050), 1050 );
+  assert_int_equal( enclave_timer_absorbs(1049, end, 1050), 1 );
+  assert_int_equal( enclave_timer_absorbs(1050, end, 1050), 0 );
+}
+
+static void test_set_enclave_time_slice()
+{
+  uint64_t end;
+
+  enclave_init_metadata();
+  enclaves[0].state = FRESH;
+
+  assert_int_equal( set_enclave_time_slice(0, 500), ENCLAVE_SUCCESS );
+  assert_int_equal( enclaves[0].time_slice, 500 );
+
+  // a slice that would never run out is clamped, so it still expires
+  assert_int_equal( set_enclave_time_slice(0, -1ULL), ENCLAVE_SUCCESS );
+  assert_int_equal( enclaves[0].time_slice, ENCL_TIME_SLICE_MAX );
+  end = enclave_slice_end(-1ULL - ENCL_TIME_SLICE_MAX, enclaves[0].time_slice);
+  assert_int_equal( enclave_slice_has_time_left(end - 1, end), 1 );
+  assert_int_equal( enclave_slice_has_time_left(end, end), 0 );
+
+  assert_int_equal( set_enclave_time_slice(0, 0), ENCLAVE_SUCCESS );
+  assert_int_equal( enclaves[0].time_slice, 0 );
+
+  assert_int_equal( set_enclave_time_slice(ENCL_MAX, 500), ENCLAVE_INVALID_ID );
+}
+
 int main()
 {
   const struct CMUnitTest tests[] = {
     cmocka_unit_test(test_is_create_args_valid),
+    cmocka_unit_test(test_is_edge_ring_valid),
     cmocka_unit_test(test_context_switch_to_enclave),
     cmocka_unit_test(test_get_enclave_region_after_init),
     cmocka_unit_test(test_get_enclave_region_index),
+    cmocka_unit_test(test_enclave_slice_has_time_left),
+    cmocka_unit_test(test_enclave_timer_deadline),
+    cmocka_unit_test(test_set_enclave_time_slice),
   };
 
   return cmocka_run_group_tests(tests, NULL, NULL);
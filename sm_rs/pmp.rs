@@ -41,7 +41,8 @@ impl PmpRegion {
         out
     }
 
-    pub fn set_perm(&mut self, perm: u8) -> Result<(), c_int> {
+    /// Programs this hart's PMP registers only, so a shared reference will do
+    pub fn set_perm(&self, perm: u8) -> Result<(), c_int> {
         let err = unsafe { pmp_set(self.region, perm) };
         if err == 0 {
             Ok(())
@@ -56,7 +56,8 @@
 #define PMP_REGION_OVERLAP                  25
 #define PMP_REGION_IMPOSSIBLE_TOR           26
 
-void sm_init(void);
+void sm_init_global(void); // boot hart, before waking the others
+void sm_init(void);        // every hart
 
 /* platform specific functions */
 #define ATTESTATION_KEY_LENGTH  64
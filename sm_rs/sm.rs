@@ -120,33 +120,50 @@ void sm_print_cert()
 }
 */
 
+/// Once, on the boot hart before it wakes the others: reserve the SM and OS
+/// regions and set up everything the harts share.
 #[no_mangle]
-pub extern "C" fn sm_init() {
-    // initialize SMM
-
+pub extern "C" fn sm_init_global() {
     let mut init_data = INIT_DATA.write();
 
-    let init_inner = init_data.get_or_insert_with(|| {
-        let sm_region =
-            smm_init().expect("[SM] intolerable error - failed to initialize SM memory");
+    let sm_region =
+        smm_init().expect("[SM] intolerable error - failed to initialize SM memory");
+
+    let os_region =
+        osm_init().expect("[SM] intolerable error - failed to initialize OS memory");
+
+    if unsafe { platform_init_global_once() } != ENCLAVE_SUCCESS as usize {
+        panic!("[SM] platform global init fatal error");
+    }
+
+    let mut init_inner = InitData {
+        sm_region,
+        os_region,
+        dev_public_key: [0; crypto::PUBKEY_SIZE],
+        sm_public_key: [0; crypto::PUBKEY_SIZE],
+        sm_private_key: [0; crypto::PRIVKEY_SIZE],
+        sm_signature: [0; crypto::SIGNATURE_SIZE],
+        sm_hash: [0; crypto::HASH_SIZE],
+    };
 
-        let os_region =
-            osm_init().expect("[SM] intolerable error - failed to initialize OS memory");
+    // Copy the keypair from the root of trust
+    copy_keys(&mut init_inner);
 
-        if unsafe { platform_init_global_once() } != ENCLAVE_SUCCESS as usize {
-            panic!("[SM] platform global init fatal error");
-        }
+    *init_data = Some(init_inner);
+
+    // for debug
+    // sm_print_cert();
+}
 
-        InitData {
-            sm_region,
-            os_region,
-            dev_public_key: [0; crypto::PUBKEY_SIZE],
-            sm_public_key: [0; crypto::PUBKEY_SIZE],
-            sm_private_key: [0; crypto::PRIVKEY_SIZE],
-            sm_signature: [0; crypto::SIGNATURE_SIZE],
-            sm_hash: [0; crypto::HASH_SIZE],
-        }
-    });
+/// On every hart before it first enters S-mode. This only programs the
+/// hart's own PMP entries, and the read lock is shared, so the harts run
+/// it in parallel.
+#[no_mangle]
+pub extern "C" fn sm_init() {
+    let init_data = INIT_DATA.read();
+    let init_inner = init_data
+        .as_ref()
+        .expect("[SM] sm_init before sm_init_global");
 
     init_inner
         .sm_region
@@ -157,14 +174,8 @@ pub extern "C" fn sm_init() {
         .set_perm(PMP_ALL_PERM as u8)
         .expect("[SM] PMP set permission failed for OS region");
 
-    /* Fire platform specific global init */
+    /* Fire platform specific per-hart init */
     if unsafe { platform_init_global() } != ENCLAVE_SUCCESS as usize {
         panic!("[SM] platform global init fatal error");
     }
-
-    // Copy the keypair from the root of trust
-    copy_keys(init_inner);
-
-    // for debug
-    // sm_print_cert();
 }
@@ -39,10 +39,10 @@ float32_t
     signB = signF32UI( uiB );
     expB = expF32UI( uiB );
     sigB = fracF32UI( uiB );
-    signC = signF32UI( uiC ) ^ ( op == softfloat_mulAdd_subC );
+    signC = signF32UI( uiC ) ^ (( op & softfloat_mulAdd_subC ) != 0);
     expC = expF32UI( uiC );
     sigC = fracF32UI( uiC );
-    signProd = signA ^ signB ^ ( op == softfloat_mulAdd_subProd );
+    signProd = signA ^ signB ^ ( ( op & softfloat_mulAdd_subProd ) != 0);
     if ( expA == 0xFF ) {
         if ( sigA || ( ( expB == 0xFF ) && sigB ) ) goto propagateNaN_ABC;
         magBits = expB | sigB;